@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#include <cstdlib>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <boost/thread.hpp>
+
+#include "affinity.hpp"
+
+#if defined(__MINGW32__) || defined(__MINGW64__)
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+bool ParseCPUList(const std::string& str, std::vector<int>& cpus) {
+  cpus.clear();
+  std::stringstream ss(str);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    range.erase(std::remove_if(range.begin(), range.end(), ::isspace), range.end());
+    if (range.empty())
+      continue;
+    char *end;
+    long lo = strtol(range.c_str(), &end, 10);
+    long hi = lo;
+    if (*end == '-')
+      hi = strtol(end+1, &end, 10);
+    if (*end != '\0' || lo < 0 || hi < lo)
+      return false;
+    for (long c = lo; c <= hi; c++)
+      cpus.push_back((int)c);
+  }
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+  return true;
+}
+
+std::string FormatCPUList(const std::vector<int>& cpus) {
+  std::stringstream ss;
+  size_t i = 0;
+  while (i < cpus.size()) {
+    size_t j = i;
+    while (j+1 < cpus.size() && cpus[j+1] == cpus[j]+1)
+      j++;
+    if (i > 0) ss << ",";
+    ss << cpus[i];
+    if (j > i) ss << "-" << cpus[j];
+    i = j+1;
+  }
+  return ss.str();
+}
+
+bool SetThreadAffinity(const std::vector<int>& cpus) {
+  if (cpus.empty())
+    return false;
+#if defined(__MINGW32__) || defined(__MINGW64__)
+  DWORD_PTR mask = 0;
+  for (size_t i = 0; i < cpus.size(); i++)
+    if (cpus[i] < (int)(sizeof(mask)*8))
+      mask |= ((DWORD_PTR)1 << cpus[i]);
+  return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#elif defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (size_t i = 0; i < cpus.size(); i++)
+    if (cpus[i] < CPU_SETSIZE)
+      CPU_SET(cpus[i], &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+void GetOnlineCPUs(std::vector<int>& cpus) {
+  cpus.clear();
+#if defined(__linux__)
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int c = 0; c < CPU_SETSIZE; c++)
+      if (CPU_ISSET(c, &set))
+	cpus.push_back(c);
+  }
+#endif
+  if (cpus.empty()) {
+    unsigned int n = boost::thread::hardware_concurrency();
+    for (unsigned int c = 0; c < (n ? n : 1); c++)
+      cpus.push_back(c);
+  }
+}
+
+bool GetPCIDeviceLocality(const std::string& busid, std::vector<int>& cpus, int *numa_node) {
+  *numa_node = -1;
+  cpus.clear();
+#if defined(__linux__)
+  std::string id(busid);
+  std::transform(id.begin(), id.end(), id.begin(), ::tolower);
+  /* sysfs uses a 4 digit domain, some drivers report 8 */
+  size_t colon = id.find(':');
+  if (colon != std::string::npos && colon > 4)
+    id = id.substr(colon-4);
+  std::string dir = "/sys/bus/pci/devices/" + id + "/";
+
+  std::ifstream node((dir + "numa_node").c_str());
+  if (node)
+    node >> *numa_node;
+
+  std::ifstream local((dir + "local_cpulist").c_str());
+  std::string list;
+  if (!local || !std::getline(local, list))
+    return false;
+  return ParseCPUList(list, cpus) && !cpus.empty();
+#else
+  return false;
+#endif
+}
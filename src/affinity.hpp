@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#ifndef AFFINITY_HPP
+#define AFFINITY_HPP
+
+#include <string>
+#include <vector>
+
+/* Parses a Linux-style cpu list ("0-3,8,10-11").  Returns false
+ * on a malformed list. */
+bool ParseCPUList(const std::string& str, std::vector<int>& cpus);
+std::string FormatCPUList(const std::vector<int>& cpus);
+
+/* Restricts the calling thread to the given CPUs.  Returns false if
+ * the list is empty or the platform doesn't support it. */
+bool SetThreadAffinity(const std::vector<int>& cpus);
+
+/* All CPUs the process may currently run on. */
+void GetOnlineCPUs(std::vector<int>& cpus);
+
+/* Looks up the CPUs and NUMA node attached to a PCI device
+ * ("0000:01:00.0").  numa_node is -1 if the platform doesn't say. */
+bool GetPCIDeviceLocality(const std::string& busid, std::vector<int>& cpus, int *numa_node);
+
+#endif /* AFFINITY_HPP */
@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "asynclog.hpp"
+
+#define LOG_RING_SIZE 512 /* records, power of two */
+#define LOG_MAX_RINGS 256 /* threads logging at once */
+#define LOG_TEXT_LEN 208
+
+struct LogRecord {
+  uint64_t ts_us;
+  uint8_t level;
+  uint8_t event;
+  uint8_t pad[6];
+  uint64_t arg[4];
+  char text[LOG_TEXT_LEN];
+};
+
+/* A ring is owned by one thread until it exits, then retired until
+ * the drain thread has written out what's left, then free for the
+ * next thread that logs. */
+enum RingState { RING_OWNED = 0, RING_RETIRED, RING_FREE };
+
+struct LogRing {
+  LogRecord records[LOG_RING_SIZE];
+  boost::atomic<int> state;
+  boost::atomic<uint32_t> head; /* written by the producer */
+  boost::atomic<uint32_t> tail; /* written by the drain thread */
+  boost::atomic<uint64_t> dropped;
+  /* token bucket, producer only */
+  uint64_t bucket_ts_us;
+  double tokens;
+};
+
+static boost::atomic<LogRing *> rings[LOG_MAX_RINGS];
+static boost::atomic<unsigned int> n_rings(0);
+/* Records lost because every ring was taken */
+static boost::atomic<uint64_t> ringless_dropped(0);
+
+static void retire_ring(LogRing *ring) {
+  ring->state.store(RING_RETIRED, boost::memory_order_release);
+}
+
+static boost::thread_specific_ptr<LogRing> my_ring(retire_ring);
+
+static boost::atomic<bool> log_running(false);
+static boost::atomic<bool> log_stop(false);
+static boost::thread *drain_thread = NULL;
+static LogLevel log_min_level = LOG_INFO;
+static unsigned int log_rate_limit = 0;
+static boost::mutex sync_mutex;
+
+static const boost::posix_time::ptime log_epoch(boost::gregorian::date(1970, 1, 1));
+
+static uint64_t now_us() {
+  return (boost::posix_time::microsec_clock::universal_time() - log_epoch).total_microseconds();
+}
+
+static void format_record(const LogRecord& r, char *out, size_t len) {
+  switch (r.event) {
+  case LOGEV_COLLISION:
+    snprintf(out, len, "[WORKER] collision found: %u <-> %u #%llu @ %u by %u",
+	     (unsigned int)(r.arg[0] >> 32), (unsigned int)r.arg[0], (unsigned long long)r.arg[2],
+	     (unsigned int)r.arg[1], (unsigned int)r.arg[3]);
+    break;
+  default:
+    snprintf(out, len, "%s", r.text);
+  }
+}
+
+static void write_record(const LogRecord& r) {
+  char line[LOG_TEXT_LEN + 64];
+  format_record(r, line, sizeof(line));
+  std::cout << line << "\n";
+}
+
+/* The calling thread's ring:  a free one if there is one, else a new
+ * one, else NULL (and the record is counted as dropped) */
+static LogRing *get_ring() {
+  LogRing *ring = my_ring.get();
+  if (ring != NULL)
+    return ring;
+  unsigned int n = std::min(n_rings.load(), (unsigned int)LOG_MAX_RINGS);
+  for (unsigned int i = 0; i < n && ring == NULL; i++) {
+    LogRing *r = rings[i].load(boost::memory_order_acquire);
+    int expected = RING_FREE;
+    if (r != NULL && r->state.compare_exchange_strong(expected, RING_OWNED, boost::memory_order_acquire))
+      ring = r;
+  }
+  if (ring == NULL) {
+    unsigned int id = n_rings.fetch_add(1);
+    if (id >= LOG_MAX_RINGS) {
+      ringless_dropped.fetch_add(1, boost::memory_order_relaxed);
+      return NULL;
+    }
+    ring = new LogRing;
+    ring->head.store(0);
+    ring->tail.store(0);
+    ring->dropped.store(0);
+    ring->state.store(RING_OWNED);
+    rings[id].store(ring, boost::memory_order_release);
+  }
+  ring->bucket_ts_us = now_us();
+  ring->tokens = log_rate_limit;
+  my_ring.reset(ring);
+  return ring;
+}
+
+/* Fills in the common fields, applies the rate limit and hands the
+ * record to the ring (or straight to stdout when not running). */
+static LogRecord *log_begin(LogLevel level, LogRing **ring_out) {
+  LogRing *ring = get_ring();
+  if (ring == NULL)
+    return NULL;
+  uint64_t ts = now_us();
+
+  if (log_rate_limit > 0 && level < LOG_ERROR) {
+    ring->tokens += (double)(ts - ring->bucket_ts_us) * log_rate_limit / 1e6;
+    if (ring->tokens > log_rate_limit)
+      ring->tokens = log_rate_limit;
+    ring->bucket_ts_us = ts;
+    if (ring->tokens < 1.0) {
+      ring->dropped.fetch_add(1, boost::memory_order_relaxed);
+      return NULL;
+    }
+    ring->tokens -= 1.0;
+  }
+
+  uint32_t head = ring->head.load(boost::memory_order_relaxed);
+  uint32_t tail = ring->tail.load(boost::memory_order_acquire);
+  if (head - tail >= LOG_RING_SIZE) {
+    ring->dropped.fetch_add(1, boost::memory_order_relaxed);
+    return NULL;
+  }
+  LogRecord *r = &ring->records[head & (LOG_RING_SIZE-1)];
+  r->ts_us = ts;
+  r->level = level;
+  r->event = LOGEV_TEXT;
+  r->text[0] = '\0';
+  *ring_out = ring;
+  return r;
+}
+
+static void log_commit(LogRing *ring, LogRecord *r) {
+  if (!log_running.load(boost::memory_order_acquire)) {
+    boost::mutex::scoped_lock lock(sync_mutex);
+    write_record(*r);
+    std::cout.flush();
+    return;
+  }
+  ring->head.store(ring->head.load(boost::memory_order_relaxed) + 1, boost::memory_order_release);
+}
+
+void LogPrintf(LogLevel level, const char *fmt, ...) {
+  if (level < log_min_level)
+    return;
+  LogRing *ring;
+  LogRecord *r = log_begin(level, &ring);
+  if (r == NULL)
+    return;
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(r->text, LOG_TEXT_LEN, fmt, ap);
+  va_end(ap);
+  log_commit(ring, r);
+}
+
+void LogEventRecord(LogLevel level, LogEvent event, uint64_t a, uint64_t b, uint64_t c, uint64_t d) {
+  if (level < log_min_level)
+    return;
+  LogRing *ring;
+  LogRecord *r = log_begin(level, &ring);
+  if (r == NULL)
+    return;
+  r->event = event;
+  r->arg[0] = a;
+  r->arg[1] = b;
+  r->arg[2] = c;
+  r->arg[3] = d;
+  log_commit(ring, r);
+}
+
+static bool record_earlier(const LogRecord& a, const LogRecord& b) {
+  return a.ts_us < b.ts_us;
+}
+
+static void add_dropped_note(std::vector<LogRecord>& batch, uint64_t dropped, const char *why) {
+  LogRecord note;
+  memset(&note, 0, sizeof(note));
+  note.ts_us = now_us();
+  note.event = LOGEV_TEXT;
+  snprintf(note.text, LOG_TEXT_LEN, "[LOG] %llu messages suppressed%s", (unsigned long long)dropped, why);
+  batch.push_back(note);
+}
+
+/* Copies out everything queued, writes it in timestamp order.  A
+ * retired ring is free for reuse once it has been emptied. */
+static void drain_once(std::vector<LogRecord>& batch) {
+  batch.clear();
+  unsigned int n = std::min(n_rings.load(), (unsigned int)LOG_MAX_RINGS);
+  for (unsigned int i = 0; i < n; i++) {
+    LogRing *ring = rings[i].load(boost::memory_order_acquire);
+    if (ring == NULL)
+      continue;
+    bool retired = ring->state.load(boost::memory_order_acquire) == RING_RETIRED;
+    uint32_t tail = ring->tail.load(boost::memory_order_relaxed);
+    uint32_t head = ring->head.load(boost::memory_order_acquire);
+    for (; tail != head; tail++)
+      batch.push_back(ring->records[tail & (LOG_RING_SIZE-1)]);
+    ring->tail.store(tail, boost::memory_order_release);
+
+    uint64_t dropped = ring->dropped.exchange(0, boost::memory_order_relaxed);
+    if (dropped > 0)
+      add_dropped_note(batch, dropped, "");
+    if (retired)
+      ring->state.store(RING_FREE, boost::memory_order_release);
+  }
+  uint64_t ringless = ringless_dropped.exchange(0, boost::memory_order_relaxed);
+  if (ringless > 0)
+    add_dropped_note(batch, ringless, " (too many threads logging)");
+  if (batch.empty())
+    return;
+  std::stable_sort(batch.begin(), batch.end(), record_earlier);
+  boost::mutex::scoped_lock lock(sync_mutex);
+  for (size_t i = 0; i < batch.size(); i++)
+    write_record(batch[i]);
+  std::cout.flush();
+}
+
+static void drain_main() {
+  std::vector<LogRecord> batch;
+  while (!log_stop.load()) {
+    drain_once(batch);
+    boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+  }
+  drain_once(batch);
+}
+
+void LogStart(LogLevel min_level, unsigned int rate_limit) {
+  if (drain_thread != NULL)
+    return;
+  log_min_level = min_level;
+  log_rate_limit = rate_limit;
+  log_stop.store(false);
+  drain_thread = new boost::thread(drain_main);
+  log_running.store(true, boost::memory_order_release);
+}
+
+void LogStop() {
+  if (drain_thread == NULL)
+    return;
+  log_running.store(false, boost::memory_order_release);
+  log_stop.store(true);
+  drain_thread->join();
+  delete drain_thread;
+  drain_thread = NULL;
+}
+
+bool LogParseLevel(const char *name, LogLevel *level) {
+  static const char *names[] = { "debug", "info", "warn", "error" };
+  for (int i = 0; i < 4; i++) {
+    if (strcmp(name, names[i]) == 0) {
+      *level = (LogLevel)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+uint64_t LogQueueDepth() {
+  uint64_t depth = 0;
+  unsigned int n = std::min(n_rings.load(), (unsigned int)LOG_MAX_RINGS);
+  for (unsigned int i = 0; i < n; i++) {
+    LogRing *ring = rings[i].load(boost::memory_order_acquire);
+    if (ring == NULL)
+      continue;
+    depth += ring->head.load(boost::memory_order_relaxed) - ring->tail.load(boost::memory_order_relaxed);
+  }
+  return depth;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#ifndef ASYNCLOG_HPP
+#define ASYNCLOG_HPP
+
+#include <inttypes.h>
+
+/* Console logging that never blocks the caller.  Each thread that logs
+ * gets its own single-producer ring of fixed-size records; a
+ * background thread drains all rings in timestamp order and does the
+ * actual (slow, locked, flushing) writes to stdout.  If a ring fills
+ * up or a thread exceeds its rate limit, records are dropped and the
+ * drain thread reports how many.  A thread's ring is reused by later
+ * threads once it has exited and its records are written. */
+
+enum LogLevel { LOG_DEBUG = 0, LOG_INFO, LOG_WARN, LOG_ERROR };
+
+/* Structured records are formatted by the drain thread, so the hot
+ * path only copies a few integers. */
+enum LogEvent {
+  LOGEV_TEXT = 0,    // preformatted text
+  LOGEV_COLLISION,   // a=birthdayA<<32|birthdayB b=nTime c=collision count d=worker
+};
+
+/* Starts the drain thread.  Before this (and after LogStop) records
+ * are written synchronously.  rate_limit is records per second per
+ * thread, 0 for unlimited; LOG_ERROR records are never rate limited. */
+void LogStart(LogLevel min_level, unsigned int rate_limit);
+/* Drains everything still queued and stops the drain thread. */
+void LogStop();
+
+bool LogParseLevel(const char *name, LogLevel *level);
+
+void LogPrintf(LogLevel level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void LogEventRecord(LogLevel level, LogEvent event, uint64_t a, uint64_t b, uint64_t c, uint64_t d);
+
+/* Number of records queued but not yet written, over all threads */
+uint64_t LogQueueDepth();
+
+#endif /* ASYNCLOG_HPP */
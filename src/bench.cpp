@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+/* Microbenchmarks for the hashing primitives (make bench).
+ *
+ * Each case is timed in two modes:  "latency" feeds every output back
+ * into the next input, so calls can't overlap; "throughput" hashes
+ * independent inputs.  Results are one JSON object per line, preceded
+ * by a host record, so runs on different machines can be collected
+ * and compared.
+ *
+ * Options:  -cpu=<n> (pin to this CPU, default the first one we may
+ * use), -repeat=<n> (timed runs per case, default 5), -mintime=<ms>
+ * (minimum length of one run, default 200), -filter=<substring>
+ * (only cases whose name contains it). */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include "main_poolminer.hpp"
+
+struct BenchCase {
+  const char *primitive;
+  const char *impl;
+  unsigned int bytes;
+  void (*fn)(BenchCase& c, uint64_t iters);
+  bool chained;
+  unsigned char in[2048];
+  unsigned char out[128];
+};
+
+/* Throughput mode varies the input with the loop counter; latency
+ * mode hashes the previous output instead. */
+static inline void next_input(BenchCase& c, uint64_t i) {
+  if (!c.chained)
+    memcpy(c.in, &i, sizeof(i));
+}
+
+static void bench_sph_sha256(BenchCase& c, uint64_t iters) {
+  sph_sha256_context ctx;
+  for (uint64_t i = 0; i < iters; i++) {
+    next_input(c, i);
+    sph_sha256_init(&ctx);
+    sph_sha256(&ctx, c.in, c.bytes);
+    sph_sha256_close(&ctx, c.chained ? c.in : c.out);
+  }
+}
+
+static void bench_sph_sha256d(BenchCase& c, uint64_t iters) {
+  sph_sha256_context ctx;
+  for (uint64_t i = 0; i < iters; i++) {
+    next_input(c, i);
+    sph_sha256_init(&ctx);
+    sph_sha256(&ctx, c.in, c.bytes);
+    sph_sha256_close(&ctx, c.out);
+    sph_sha256_init(&ctx);
+    sph_sha256(&ctx, c.out, 32);
+    sph_sha256_close(&ctx, c.chained ? c.in : c.out);
+  }
+}
+
+static void bench_sph_sha512(BenchCase& c, uint64_t iters) {
+  sph_sha512_context ctx;
+  for (uint64_t i = 0; i < iters; i++) {
+    next_input(c, i);
+    sph_sha512_init(&ctx);
+    sph_sha512(&ctx, c.in, c.bytes);
+    sph_sha512_close(&ctx, c.chained ? c.in : c.out);
+  }
+}
+
+/* The CPU engine's single-block SHA-512 on a momentum message */
+static void bench_cpu_sha512_block(BenchCase& c, uint64_t iters) {
+  uint64_t D[5], H[8];
+  memcpy(D, c.in, sizeof(D));
+  memset(H, 0, sizeof(H));
+  for (uint64_t i = 0; i < iters; i++) {
+    if (c.chained)
+      D[0] = (D[0] & 0xffffffff00000000ULL) | (uint32_t)H[i & 7];
+    else
+      D[0] = (D[0] & 0xffffffff00000000ULL) | (uint32_t)(i*8);
+    cpu_sha512_block(H, D);
+  }
+  memcpy(c.out, H, sizeof(H));
+}
+
+/* sha512.c:  building the padded block the engines hash */
+static void bench_sha512_setup(BenchCase& c, uint64_t iters) {
+  SHA512_Context ctx;
+  for (uint64_t i = 0; i < iters; i++) {
+    next_input(c, i);
+    SHA512_Init(&ctx);
+    SHA512_Update_Simple(&ctx, c.in, 36);
+    SHA512_PreFinal(&ctx);
+    if (c.chained)
+      memcpy(c.in, ctx.buffer.bytes + 36, 8);
+  }
+  memcpy(c.out, ctx.buffer.bytes, 64);
+}
+
+static void bench_midhash(BenchCase& c, uint64_t iters) {
+  blockHeader_t block;
+  uint8_t midHash[32+4];
+  uint64_t data[16];
+  memcpy(&block, c.in, 80);
+  memset(data, 0, sizeof(data));
+  for (uint64_t i = 0; i < iters; i++) {
+    if (c.chained)
+      memcpy(block.hashMerkleRoot, data + 1, 32);
+    else
+      block.nNonce = (uint32_t)i;
+    protoshares_midhash<SPHLIB>(&block, midHash, data);
+  }
+  memcpy(c.out, data, 64);
+}
+
+/* Shares are found by hashes that match the target in the top words,
+ * so most comparisons run several words deep; half the inputs here
+ * differ only in word 1. */
+static void bench_target_compare(BenchCase& c, uint64_t iters) {
+  uint32_t hash[8], target[8];
+  memcpy(target, c.in, 32);
+  memcpy(hash, c.in, 32);
+  unsigned int pass = 0;
+  for (uint64_t i = 0; i < iters; i++) {
+    hash[1] = target[1] + (uint32_t)((c.chained ? pass + i : i) & 1);
+    pass += meetsTarget(hash, target);
+  }
+  memcpy(c.out, &pass, sizeof(pass));
+}
+
+static std::map<std::string, std::string> bench_args;
+
+static std::string arg(const std::string& name, const std::string& def) {
+  std::map<std::string, std::string>::const_iterator it = bench_args.find(name);
+  return it == bench_args.end() ? def : it->second;
+}
+
+static double run_once(BenchCase& c, uint64_t iters) {
+  uint64_t t0 = MonotonicMicros();
+  c.fn(c, iters);
+  return (double)(MonotonicMicros() - t0) * 1000.0 / iters; /* ns per op */
+}
+
+static void host_record(int cpu) {
+  std::string model = "unknown";
+  FILE *f = fopen("/proc/cpuinfo", "r");
+  if (f != NULL) {
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+      if (strncmp(line, "model name", 10) == 0) {
+	char *v = strchr(line, ':');
+	if (v != NULL) {
+	  model = v + 2;
+	  model.erase(model.find_last_not_of("\n") + 1);
+	}
+	break;
+      }
+    }
+    fclose(f);
+  }
+  printf("{\"type\":\"host\",\"cpu_model\":\"%s\",\"pinned_cpu\":%d", JsonEscape(model).c_str(), cpu);
+#ifdef __x86_64__
+  processor_info_t pc;
+  cpuid_basic_identify(&pc);
+  uint32_t a, b, cc, d;
+  /* leaf 7, subleaf 0: EBX bit 29 is the SHA extensions */
+  __asm__ __volatile__("cpuid" : "=a"(a), "=b"(b), "=c"(cc), "=d"(d) : "a"(7), "c"(0));
+  printf(",\"sse_level\":%d,\"sse_sub_level\":%d,\"avx_level\":%d,\"sha_ni\":%s",
+	 pc.sse_level, pc.sse_sub_level, pc.avx_level, (b & (1 << 29)) ? "true" : "false");
+#endif
+  printf("}\n");
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    if (a.size() < 2 || a[0] != '-') {
+      fprintf(stderr, "usage: %s [-cpu=<n>] [-repeat=<n>] [-mintime=<ms>] [-filter=<name>]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+    size_t eq = a.find('=');
+    bench_args[a.substr(0, eq)] = eq == std::string::npos ? "1" : a.substr(eq + 1);
+  }
+  int repeat = atoi(arg("-repeat", "5").c_str());
+  double mintime_us = atof(arg("-mintime", "200").c_str()) * 1000;
+  std::string filter = arg("-filter", "");
+  if (repeat < 1)
+    repeat = 1;
+
+  std::vector<int> cpus;
+  GetOnlineCPUs(cpus);
+  int cpu = bench_args.count("-cpu") ? atoi(arg("-cpu", "0").c_str()) : (cpus.empty() ? -1 : cpus[0]);
+  if (cpu >= 0) {
+    std::vector<int> mine(1, cpu);
+    if (!SetThreadAffinity(mine)) {
+      fprintf(stderr, "could not pin to CPU %d\n", cpu);
+      cpu = -1;
+    }
+  }
+  host_record(cpu);
+
+  static const struct {
+    const char *primitive, *impl;
+    unsigned int bytes;
+    void (*fn)(BenchCase& c, uint64_t iters);
+  } cases[] = {
+    { "sha256", "sph", 32, bench_sph_sha256 },
+    { "sha256", "sph", 64, bench_sph_sha256 },
+    { "sha256", "sph", 80, bench_sph_sha256 },
+    { "sha256", "sph", 88, bench_sph_sha256 },
+    { "sha256", "sph", 128, bench_sph_sha256 },
+    { "sha256", "sph", 1024, bench_sph_sha256 },
+    { "sha256d", "sph", 80, bench_sph_sha256d },
+    { "sha256d", "sph", 88, bench_sph_sha256d },
+    { "sha512", "sph", 36, bench_sph_sha512 },
+    { "sha512", "sph", 64, bench_sph_sha512 },
+    { "sha512", "sph", 128, bench_sph_sha512 },
+    { "sha512", "sph", 1024, bench_sph_sha512 },
+    { "sha512", "cpu_sha512_block", 36, bench_cpu_sha512_block },
+    { "sha512_setup", "sha512.c", 36, bench_sha512_setup },
+    { "midhash", "sph+sha512.c", 80, bench_midhash },
+    { "target_compare", "meetsTarget", 32, bench_target_compare }
+  };
+
+  for (size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+    std::string name = std::string(cases[k].primitive) + "/" + cases[k].impl;
+    if (!filter.empty() && name.find(filter) == std::string::npos)
+      continue;
+    for (int chained = 1; chained >= 0; chained--) {
+      BenchCase c;
+      c.primitive = cases[k].primitive;
+      c.impl = cases[k].impl;
+      c.bytes = cases[k].bytes;
+      c.fn = cases[k].fn;
+      c.chained = chained;
+      for (size_t i = 0; i < sizeof(c.in); i++)
+	c.in[i] = (unsigned char)(i * 131 + 7);
+
+      /* grow the run until it's long enough to time */
+      uint64_t iters = 1;
+      double ns = run_once(c, iters);
+      while (ns * iters < mintime_us * 1000 / 8 && iters < (1ULL << 40)) {
+	iters *= 2;
+	ns = run_once(c, iters);
+      }
+      iters = std::max<uint64_t>(1, (uint64_t)(mintime_us * 1000 / std::max(ns, 0.001)));
+
+      std::vector<double> runs;
+      for (int r = 0; r < repeat; r++)
+	runs.push_back(run_once(c, iters));
+      std::sort(runs.begin(), runs.end());
+      double median = runs[runs.size() / 2];
+      printf("{\"type\":\"bench\",\"primitive\":\"%s\",\"impl\":\"%s\",\"bytes\":%u,\"mode\":\"%s\","
+	     "\"iters\":%llu,\"repeat\":%d,\"ns_min\":%.2f,\"ns_median\":%.2f,\"ns_max\":%.2f,\"mb_per_s\":%.2f,\"sink\":%u}\n",
+	     c.primitive, c.impl, c.bytes, chained ? "latency" : "throughput",
+	     (unsigned long long)iters, repeat, runs.front(), median, runs.back(),
+	     median > 0 ? c.bytes * 1000.0 / median : 0, (unsigned int)c.out[0] ^ c.in[0]);
+      fflush(stdout);
+    }
+  }
+  return EXIT_SUCCESS;
+}
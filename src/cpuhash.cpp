@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "cpuhash.hpp"
+#include "affinity.hpp"
+
+/* Same table geometry as gpuhash.cu.  The counting filter holds
+ * 2^(filter_power-1) two-bit counters; a round below full intensity
+ * uses only the front of the table and of the filter. */
+#define MOMENTUM_N_HASHES (1<<26)
+#define MOMENTUM_N_SPOTS (MOMENTUM_N_HASHES/8)
+
+/* A partitioned table word is (birthday << CHUNK_BITS) | the nonce's
+ * offset in its chunk; the chunk is found from chunk_starts. */
+#define CHUNK_BITS 12
+#define CHUNK_MASK ((1<<CHUNK_BITS)-1)
+
+#define SWAP64(n) __builtin_bswap64(n)
+
+static const uint64_t iv512[8] = {
+  0x6a09e667f3bcc908ULL,
+  0xbb67ae8584caa73bULL,
+  0x3c6ef372fe94f82bULL,
+  0xa54ff53a5f1d36f1ULL,
+  0x510e527fade682d1ULL,
+  0x9b05688c2b3e6c1fULL,
+  0x1f83d9abfb41bd6bULL,
+  0x5be0cd19137e2179ULL
+};
+
+static const uint64_t k[80] = {
+  0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+  0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+  0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+  0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+  0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+  0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+  0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+  0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+  0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+  0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+  0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+  0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+  0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+  0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+  0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+  0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+  0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+  0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+  0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+  0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+#define ror(x,n) ((x >> n) | (x << (64-n)))
+#define Ch(x,y,z) ((x & y) ^ ( (~x) & z))
+#define Maj(x,y,z) ((x & y) ^ (x & z) ^ (y & z))
+#define Sigma0(x) ((ror(x,28))  ^ (ror(x,34)) ^ (ror(x,39)))
+#define Sigma1(x) ((ror(x,14))  ^ (ror(x,18)) ^ (ror(x,41)))
+#define sigma0(x) ((ror(x,1))  ^ (ror(x,8)) ^(x>>7))
+#define sigma1(x) ((ror(x,19)) ^ (ror(x,61)) ^(x>>6))
+
+/* Host copy of sha512_block() in gpuhash.cu */
+void cpu_sha512_block(uint64_t H[8], const uint64_t D[5])
+{
+  uint64_t a = iv512[0];
+  uint64_t b = iv512[1];
+  uint64_t c = iv512[2];
+  uint64_t d = iv512[3];
+  uint64_t e = iv512[4];
+  uint64_t f = iv512[5];
+  uint64_t g = iv512[6];
+  uint64_t h = iv512[7];
+
+  uint64_t w[16];
+
+  /* Lots of these middle entries are zero because of the pad */
+  w[0] = SWAP64(D[0]);
+  for (int i = 1; i < 5; i++)
+    w[i] = D[i];
+  for (int i = 5; i < 15; i++)
+    w[i] = 0;
+  w[15] = 0x120; /* 36 bytes of message */
+
+  uint64_t t1, t2;
+
+  for (int i = 0; i < 80; i++) {
+    if (i >= 16)
+      w[i & 15] = sigma1(w[(i - 2) & 15]) + sigma0(w[(i - 15) & 15]) + w[(i -16) & 15] + w[(i - 7) & 15];
+    t1 = k[i] + w[i & 15] + h + Sigma1(e) + Ch(e, f, g);
+    t2 = Maj(a, b, c) + Sigma0(a);
+
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  H[0] = SWAP64(iv512[0] + a);
+  H[1] = SWAP64(iv512[1] + b);
+  H[2] = SWAP64(iv512[2] + c);
+  H[3] = SWAP64(iv512[3] + d);
+  H[4] = SWAP64(iv512[4] + e);
+  H[5] = SWAP64(iv512[5] + f);
+  H[6] = SWAP64(iv512[6] + g);
+  H[7] = SWAP64(iv512[7] + h);
+}
+
+/* Two-bit saturating counters, as in gpuhash.cu:  00 -> 01 -> 11 */
+static inline void add_to_filter(uint32_t *countbits, uint32_t slot_mask, const uint64_t hash) {
+  uint32_t whichbit = (uint32_t(hash>>14) & slot_mask);
+  uint32_t whichword = whichbit/16;
+  uint32_t bitpat = 1UL << (2*(whichbit%16));
+  uint32_t old = __sync_fetch_and_or(&countbits[whichword], bitpat);
+  if (old & bitpat) {
+    uint32_t secondbit = (1UL<<((2*(whichbit%16)) +1));
+    if (!(old & secondbit)) {
+      __sync_fetch_and_or(&countbits[whichword], secondbit);
+    }
+  }
+}
+
+static inline bool is_in_filter_twice(const uint32_t *countbits, uint32_t slot_mask, const uint64_t hash) {
+  uint32_t whichbit = (uint32_t(hash>>14) & slot_mask);
+  uint32_t cbits = countbits[whichbit/16];
+  return (cbits & (1UL<<((2*(whichbit%16))+1)));
+}
+
+/* The hash a partitioned table word stands for, as far as the filters
+ * can tell:  its birthday in the usual place */
+static inline uint64_t packed_hash(uint64_t word) {
+  return (word >> CHUNK_BITS) << 14;
+}
+
+CPUHasher::CPUHasher(int threads, int batch, const EngineParams& params) {
+  n_threads = threads;
+  if (n_threads < 1) n_threads = 1;
+  max_batch = batch;
+  if (max_batch < 1) max_batch = 1;
+  if (max_batch > MAX_BATCH) max_batch = MAX_BATCH;
+  filter_power = params.filter_power;
+  if (filter_power < EngineParams::MIN_FILTER_POWER) filter_power = EngineParams::MIN_FILTER_POWER;
+  if (filter_power > EngineParams::MAX_FILTER_POWER) filter_power = EngineParams::MAX_FILTER_POWER;
+  countbits_words = (size_t)1 << (filter_power-5);
+  partition_shift = 0;
+  partition_slots = 0;
+  hashes = NULL;
+  countbits = NULL;
+  job_data = NULL;
+  job_results = NULL;
+  job_batch = 0;
+  job_spots = 0;
+  job_words = 0;
+  job_mask = 0;
+  shutdown = false;
+  start_barrier = NULL;
+  phase_barrier = NULL;
+}
+
+void CPUHasher::SetAffinity(const std::vector<int>& cpu_list) {
+  cpus = cpu_list;
+}
+
+bool CPUHasher::SetPartition(int index, int count) {
+  if (count < 1 || count > MAX_PARTITIONS || index < 0 || index >= count)
+    return false;
+  partition_index = index;
+  partition_count = count;
+  partition_shift = 0;
+  while ((2 << partition_shift) <= count)
+    partition_shift++;
+  return true;
+}
+
+int CPUHasher::Initialize() {
+  size_t table_words = MOMENTUM_N_HASHES;
+  if (partition_count > 1) {
+    /* A slice's share of a partition is binomial:  1/16 over the mean
+     * is hundreds of standard deviations. */
+    size_t slice = ((size_t)MOMENTUM_N_SPOTS / n_threads + 1) * 8;
+    size_t expect = slice / partition_count;
+    partition_slots = expect + expect/16 + 4096;
+    table_words = partition_slots * n_threads;
+    chunk_starts.assign(n_threads, std::vector<uint32_t>((slice >> CHUNK_BITS) + 2));
+    countbits_words >>= partition_shift;
+  }
+  if (!hash_buffer.Allocate(sizeof(uint64_t)*table_words) ||
+      !countbits_buffer.Allocate(sizeof(uint32_t)*countbits_words)) {
+    fprintf(stderr, "Could not allocate CPU hash tables\n");
+    return -1;
+  }
+  hashes = (uint64_t *)hash_buffer.data();
+  countbits = (uint32_t *)countbits_buffer.data();
+  if (partition_count > 1)
+    printf("Initializing.  CPU engine with %d threads, birthday partition %d of %d\n",
+	   n_threads, partition_index, partition_count);
+  else
+    printf("Initializing.  CPU engine with %d threads\n", n_threads);
+
+  start_barrier = new boost::barrier(n_threads+1);
+  phase_barrier = new boost::barrier(n_threads);
+  for (int i = 0; i < n_threads; i++)
+    threads.create_thread(boost::bind(&CPUHasher::thread_main, this, i));
+
+  /* Wait for every thread to pin itself and fault in its slices, so
+   * the first round doesn't pay for the page faults. */
+  start_barrier->wait();
+  printf("  hash table: %s\n", hash_buffer.Describe().c_str());
+  printf("  count table: %s\n", countbits_buffer.Describe().c_str());
+  return 0;
+}
+
+CPUHasher::~CPUHasher() {
+  if (start_barrier != NULL) {
+    shutdown = true;
+    start_barrier->wait();
+    threads.join_all();
+    delete start_barrier;
+    delete phase_barrier;
+  }
+}
+
+void CPUHasher::clear_countbits(int id, size_t words) {
+  size_t lo = words * id / n_threads;
+  size_t hi = words * (id+1) / n_threads;
+  memset(countbits + lo, 0, sizeof(uint32_t)*(hi-lo));
+}
+
+void CPUHasher::thread_main(int id) {
+  if (!cpus.empty()) {
+    std::vector<int> mine(1, cpus[id % cpus.size()]);
+    SetThreadAffinity(mine);
+  }
+
+  /* First touch:  the slices this thread works on every round */
+  if (partition_slots > 0) {
+    memset(hashes + partition_slots*id, 0, sizeof(uint64_t)*partition_slots);
+  } else {
+    uint32_t lo = (uint64_t)MOMENTUM_N_SPOTS * id / n_threads;
+    uint32_t hi = (uint64_t)MOMENTUM_N_SPOTS * (id+1) / n_threads;
+    memset(hashes + (size_t)lo*8, 0, sizeof(uint64_t)*8*(hi-lo));
+  }
+  clear_countbits(id, countbits_words);
+
+  start_barrier->wait();
+  while (true) {
+    start_barrier->wait();
+    if (shutdown)
+      break;
+    for (int b = 0; b < job_batch; b++) {
+      if (partition_slots > 0)
+	search_partition(id, job_data[b], job_results + b*N_RESULTS);
+      else
+	search_one(id, job_data[b], job_results + b*N_RESULTS);
+    }
+    start_barrier->wait();
+  }
+}
+
+void CPUHasher::search_one(int id, const uint64_t data[16], uint64_t *results) {
+  uint32_t lo = (uint64_t)job_spots * id / n_threads;
+  uint32_t hi = (uint64_t)job_spots * (id+1) / n_threads;
+  uint32_t slot_mask = job_mask;
+
+  uint64_t D[5];
+  for (int i = 1; i < 5; i++)
+    D[i] = SWAP64(data[i]);
+
+  clear_countbits(id, job_words);
+  phase_barrier->wait();
+
+  /* search_sha512_kernel */
+  for (uint32_t spot = lo; spot < hi; spot++) {
+    uint64_t *H = hashes + (size_t)spot*8;
+    D[0] = (data[0] & 0xffffffff00000000ULL) | (spot*8);
+    cpu_sha512_block(H, D);
+    for (int i = 0; i < 8; i++)
+      add_to_filter(countbits, slot_mask, H[i]);
+  }
+  phase_barrier->wait();
+
+  /* filter_sha512_kernel */
+  for (size_t n = (size_t)lo*8; n < (size_t)hi*8; n++) {
+    if (!is_in_filter_twice(countbits, slot_mask, hashes[n]))
+      hashes[n] = 0;
+  }
+  phase_barrier->wait();
+  clear_countbits(id, job_words);
+  phase_barrier->wait();
+
+  /* populate_filter_kernel */
+  for (size_t n = (size_t)lo*8; n < (size_t)hi*8; n++) {
+    if (hashes[n])
+      add_to_filter(countbits, slot_mask, (hashes[n]>>18));
+  }
+  phase_barrier->wait();
+
+  /* filter_and_rewrite_sha512_kernel */
+  for (size_t n = (size_t)lo*8; n < (size_t)hi*8; n++) {
+    uint64_t myword = hashes[n];
+    if (myword && is_in_filter_twice(countbits, slot_mask, (myword>>18))) {
+      uint32_t result_slot = __sync_fetch_and_add((uint32_t *)results, 1);
+      if (result_slot < (uint32_t)N_RESULT_SLOTS) {
+	results[result_slot*2+1] = (myword >> 14);
+	results[result_slot*2+2] = n;
+      }
+    }
+  }
+  phase_barrier->wait();
+}
+
+/* search_one over this partition's hashes only.  They're appended in
+ * nonce order, so the nonce needn't be stored whole:  the low bits go
+ * in the word and chunk_starts says where each run of 4096 nonces
+ * begins. */
+void CPUHasher::search_partition(int id, const uint64_t data[16], uint64_t *results) {
+  uint32_t lo = (uint64_t)job_spots * id / n_threads;
+  uint32_t hi = (uint64_t)job_spots * (id+1) / n_threads;
+  uint32_t slot_mask = job_mask;
+  uint64_t *table = hashes + partition_slots*id;
+  uint32_t *chunks = &chunk_starts[id][0];
+  uint32_t base = lo*8;
+
+  uint64_t D[5];
+  for (int i = 1; i < 5; i++)
+    D[i] = SWAP64(data[i]);
+
+  clear_countbits(id, job_words);
+  phase_barrier->wait();
+
+  /* search_sha512_kernel, keeping our partition */
+  size_t used = 0;
+  for (uint32_t spot = lo; spot < hi; spot++) {
+    uint64_t H[8];
+    D[0] = (data[0] & 0xffffffff00000000ULL) | (spot*8);
+    cpu_sha512_block(H, D);
+    for (int i = 0; i < 8; i++) {
+      uint32_t offset = spot*8 + i - base;
+      if ((offset & CHUNK_MASK) == 0)
+	chunks[offset >> CHUNK_BITS] = used;
+      uint64_t birthday = H[i] >> 14;
+      if (!InPartition(birthday) || used == partition_slots)
+	continue;
+      table[used++] = (birthday << CHUNK_BITS) | (offset & CHUNK_MASK);
+      add_to_filter(countbits, slot_mask, H[i]);
+    }
+  }
+  uint32_t n_chunks = ((hi-lo)*8 + CHUNK_MASK) >> CHUNK_BITS;
+  chunks[n_chunks] = used;
+  phase_barrier->wait();
+
+  /* filter_sha512_kernel */
+  for (size_t n = 0; n < used; n++) {
+    if (!is_in_filter_twice(countbits, slot_mask, packed_hash(table[n])))
+      table[n] = 0;
+  }
+  phase_barrier->wait();
+  clear_countbits(id, job_words);
+  phase_barrier->wait();
+
+  /* populate_filter_kernel */
+  for (size_t n = 0; n < used; n++) {
+    if (table[n])
+      add_to_filter(countbits, slot_mask, (packed_hash(table[n])>>18));
+  }
+  phase_barrier->wait();
+
+  /* filter_and_rewrite_sha512_kernel */
+  uint32_t chunk = 0;
+  for (size_t n = 0; n < used; n++) {
+    while (chunks[chunk+1] <= n)
+      chunk++;
+    uint64_t myword = table[n];
+    if (myword && is_in_filter_twice(countbits, slot_mask, (packed_hash(myword)>>18))) {
+      uint32_t result_slot = __sync_fetch_and_add((uint32_t *)results, 1);
+      if (result_slot < (uint32_t)N_RESULT_SLOTS) {
+	results[result_slot*2+1] = (myword >> CHUNK_BITS);
+	results[result_slot*2+2] = base + (chunk << CHUNK_BITS) + (myword & CHUNK_MASK);
+      }
+    }
+  }
+  phase_barrier->wait();
+}
+
+int CPUHasher::ComputeHashes(const uint64_t data[][16], uint64_t *results, int n_batch) {
+  if (n_batch < 1 || n_batch > max_batch) {
+    fprintf(stderr, "Bad batch size %d (max %d)\n", n_batch, max_batch);
+    return -1;
+  }
+  for (int b = 0; b < n_batch; b++)
+    results[b*N_RESULTS] = 0;
+
+  job_data = data;
+  job_results = results;
+  job_batch = n_batch;
+  int power = RoundFilterPower(filter_power, intensity) - partition_shift;
+  job_spots = (uint32_t)1 << (intensity-3);
+  job_words = (size_t)1 << (power-5);
+  job_mask = (uint32_t)(((uint64_t)1 << (power-1)) - 1);
+  start_barrier->wait();
+  start_barrier->wait();
+  return 0;
+}
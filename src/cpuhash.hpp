@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#ifndef CPUHASH_HPP
+#define CPUHASH_HPP
+
+#include <vector>
+#include <boost/thread.hpp>
+#include "hasher.h"
+#include "hugebuffer.hpp"
+
+/* Host implementation of the GPU search.  Runs the same pipeline as
+ * gpuhash.cu (hash, filter, re-filter on different bits, emit
+ * candidates) on a pool of threads.  Each thread owns a contiguous
+ * slice of the nonce space and the matching slice of the hash table,
+ * which it touches first so the pages land on its own NUMA node.
+ * Only the counting filter is shared.
+ *
+ * With a partition (SetPartition), a thread keeps only its
+ * partition's hashes, packed in nonce order into its slice of a table
+ * 1/count the size, and the filter shrinks to match. */
+class CPUHasher : public Hasher {
+public:
+  CPUHasher(int n_threads, int max_batch = 1, const EngineParams& params = EngineParams());
+  /* CPUs for the engine threads, handed out one per thread in
+   * order.  Must be called before Initialize. */
+  void SetAffinity(const std::vector<int>& cpus);
+  bool SetPartition(int index, int count);
+  int Initialize();
+  int ComputeHashes(const uint64_t data[][16], uint64_t *hashes, int n_batch);
+  ~CPUHasher();
+
+ private:
+  void thread_main(int id);
+  void search_one(int id, const uint64_t data[16], uint64_t *results);
+  void search_partition(int id, const uint64_t data[16], uint64_t *results);
+  void clear_countbits(int id, size_t words);
+
+  int n_threads;
+  int max_batch;
+  int filter_power;
+  int partition_shift;   /* the filter is 2^this times smaller */
+  size_t partition_slots; /* table words per thread, 0 if unpartitioned */
+  size_t countbits_words;
+  std::vector<int> cpus;
+  HugeBuffer hash_buffer;
+  HugeBuffer countbits_buffer;
+  uint64_t *hashes;
+  uint32_t *countbits;
+  /* Per thread, partitioned:  where each 4096-nonce chunk of its
+   * slice starts in its part of the table */
+  std::vector<std::vector<uint32_t> > chunk_starts;
+
+  /* The current job, set by ComputeHashes before releasing the
+   * engine threads. */
+  const uint64_t (*job_data)[16];
+  uint64_t *job_results;
+  int job_batch;
+  uint32_t job_spots;
+  size_t job_words;
+  uint32_t job_mask;
+  bool shutdown;
+
+  boost::thread_group threads;
+  boost::barrier *start_barrier; /* engine threads + caller */
+  boost::barrier *phase_barrier; /* engine threads only */
+};
+
+/* One SHA512 block of the momentum search:  D[0] carries the nonce in
+ * its low 32 bits, D[1..4] are the byte-swapped midhash words.  H
+ * gets the eight little-endian birthday words. */
+void cpu_sha512_block(uint64_t H[8], const uint64_t D[5]);
+
+#endif /* CPUHASH_HPP */
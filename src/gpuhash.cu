@@ -11,10 +11,10 @@
 //#include <thrust/sort.h>
 
 __device__ void sha512_block(uint64_t H[8], const uint64_t data[5]);
-__global__ void search_sha512_kernel(const __restrict__ uint64_t *dev_data, __restrict__ uint64_t *dev_hashes, __restrict__ uint32_t *dev_countbits);
-__global__ void filter_sha512_kernel(__restrict__ uint64_t *dev_hashes, const __restrict__ uint32_t *dev_countbits);
-__global__ void filter_and_rewrite_sha512_kernel(__restrict__ uint64_t *dev_hashes, const __restrict__ uint32_t *dev_countbits, __restrict__ uint64_t *dev_results);
-__global__ void populate_filter_kernel(__restrict__ uint64_t *dev_hashes, __restrict__ uint32_t *dev_countbits);
+__global__ void search_sha512_kernel(uint32_t spot_base, uint32_t slot_mask, const __restrict__ uint64_t *dev_data, __restrict__ uint64_t *dev_hashes, __restrict__ uint32_t *dev_countbits);
+__global__ void filter_sha512_kernel(uint32_t spot_base, uint32_t slot_mask, __restrict__ uint64_t *dev_hashes, const __restrict__ uint32_t *dev_countbits);
+__global__ void filter_and_rewrite_sha512_kernel(uint32_t spot_base, uint32_t slot_mask, __restrict__ uint64_t *dev_hashes, const __restrict__ uint32_t *dev_countbits, __restrict__ uint64_t *dev_results);
+__global__ void populate_filter_kernel(uint32_t spot_base, uint32_t slot_mask, __restrict__ uint64_t *dev_hashes, __restrict__ uint32_t *dev_countbits);
 
 #define SWAP64(n) \
   (((n) << 56)                                        \
@@ -28,8 +28,35 @@ __global__ void populate_filter_kernel(__restrict__ uint64_t *dev_hashes, __rest
 
 
 /* Empty constructor, please call Initialize */
-GPUHasher::GPUHasher(int gpu_device_id) {
+GPUHasher::GPUHasher(int gpu_device_id, int batch, const EngineParams& p) {
   device_id = gpu_device_id;
+  max_batch = batch;
+  if (max_batch < 1) max_batch = 1;
+  if (max_batch > MAX_BATCH) max_batch = MAX_BATCH;
+  params = p;
+  if (params.filter_power < EngineParams::MIN_FILTER_POWER) params.filter_power = EngineParams::MIN_FILTER_POWER;
+  if (params.filter_power > EngineParams::MAX_FILTER_POWER) params.filter_power = EngineParams::MAX_FILTER_POWER;
+  countbits_words = (size_t)1 << (params.filter_power-5);
+  dev_data = NULL;
+  dev_hashes = NULL;
+  dev_countbits = NULL;
+  dev_results = NULL;
+}
+
+int GPUHasher::GetPCIBusId(char *busid, int len) {
+  cudaError_t error = cudaDeviceGetPCIBusId(busid, len, device_id);
+  if (error != cudaSuccess) {
+    return -1;
+  }
+  return 0;
+}
+
+int GPUHasher::GetDeviceName(char *name, int len) {
+  cudaDeviceProp prop;
+  if (cudaGetDeviceProperties(&prop, device_id) != cudaSuccess)
+    return -1;
+  snprintf(name, len, "%s sm_%d%d", prop.name, prop.major, prop.minor);
+  return 0;
 }
 
 int GPUHasher::Initialize() {
@@ -48,7 +75,7 @@ int GPUHasher::Initialize() {
   cudaMemGetInfo(&free, &total);
   printf("Initializing.  Device has %ld free of %ld total bytes of memory\n", free, total);
 
-  error = cudaMalloc((void **)&dev_data, sizeof(uint64_t)*16);
+  error = cudaMalloc((void **)&dev_data, sizeof(uint64_t)*16*max_batch);
   if (error != cudaSuccess) {
     fprintf(stderr, "Could not malloc dev_data (%d)\n", error);
     exit(-1);
@@ -58,11 +85,9 @@ int GPUHasher::Initialize() {
   cudaStreamCreate(streamptr);
 
 #define MOMENTUM_N_HASHES (1<<26)
-  /* Note:  This is the allocation size.  We can only use
-   * one less than this because each countbit entry uses two bits. */
-#define NUM_COUNTBITS_POWER 31
-#define COUNTBITS_SLOTS_POWER (NUM_COUNTBITS_POWER-1)
-#define NUM_COUNTBITS_WORDS (1<<(NUM_COUNTBITS_POWER-5))
+#define MOMENTUM_N_SPOTS (MOMENTUM_N_HASHES/8)
+  /* The filter is 2^filter_power bits:  one less power of two of
+   * slots, because each countbit entry uses two bits. */
 
   error = cudaMalloc((void **)&dev_hashes, sizeof(uint64_t)*MOMENTUM_N_HASHES);
   if (error != cudaSuccess) {
@@ -70,15 +95,14 @@ int GPUHasher::Initialize() {
     return -1;
   }
 
-  error = cudaMalloc((void **)&dev_countbits, sizeof(uint32_t)*NUM_COUNTBITS_WORDS);
+  error = cudaMalloc((void **)&dev_countbits, sizeof(uint32_t)*countbits_words);
   if (error != cudaSuccess) {
-    fprintf(stderr, "Could not malloc dev_data (%d)\n", error);
-    exit(-1);
+    fprintf(stderr, "Could not malloc dev_countbits (%d)\n", error);
     return -1;
   }
 
-  /* Results holds any maybe-colliding keys */
-  error = cudaMalloc((void **)&dev_results, sizeof(uint64_t)*GPUHasher::N_RESULTS);
+  /* Results holds any maybe-colliding keys, one block per batch entry */
+  error = cudaMalloc((void **)&dev_results, sizeof(uint64_t)*GPUHasher::N_RESULTS*max_batch);
   if (error != cudaSuccess) {
     fprintf(stderr, "Could not malloc dev_data (%d)\n", error);
     exit(-1);
@@ -93,42 +117,68 @@ int GPUHasher::Initialize() {
 
 GPUHasher::~GPUHasher() {
   if (dev_hashes != NULL) { cudaFree(dev_hashes); }
-  if (dev_data != NULL) { cudaFree(dev_data); }
+  if (dev_data != NULL) { cudaFree(dev_data); cudaStreamDestroy(*(cudaStream_t *)opaqueStream_t); }
+  if (dev_countbits != NULL) { cudaFree(dev_countbits); }
+  if (dev_results != NULL) { cudaFree(dev_results); }
 }
 
-int GPUHasher::ComputeHashes(uint64_t data[16], uint64_t *hashes) {
+int GPUHasher::ComputeHashes(const uint64_t data[][16], uint64_t *hashes, int n_batch) {
   cudaError_t error;
   cudaStream_t *streamptr = (cudaStream_t *)opaqueStream_t;
-  error = cudaMemcpy(dev_data, data, sizeof(uint64_t)*16, cudaMemcpyHostToDevice);
+
+  if (n_batch < 1 || n_batch > max_batch) {
+    fprintf(stderr, "Bad batch size %d (max %d)\n", n_batch, max_batch);
+    return -1;
+  }
+
+  /* All of the per-round fixed costs that don't depend on the
+   * intermediate filter state are paid once per batch:  one upload
+   * of every midstate, one clear of every result block, one copy
+   * back and one synchronization.  The countbits still have to be
+   * cleared before each filter pass. */
+  error = cudaMemcpyAsync(dev_data, data, sizeof(uint64_t)*16*n_batch, cudaMemcpyHostToDevice, *streamptr);
   if (error != cudaSuccess) {
     fprintf(stderr, "Could not memcpy dev_data (%d)\n", error);
     return -1;
   }
 
-  // I want:  64 threads per block
-  // 128 blocks per grid entry
-  // 1024 grid slots
-
-  dim3 gridsize(4096,32);
-  cudaMemsetAsync(dev_results, 0, sizeof(uint64_t)*N_RESULTS, *streamptr);
-  cudaMemsetAsync(dev_countbits, 0, sizeof(uint32_t)*NUM_COUNTBITS_WORDS, *streamptr);
-  search_sha512_kernel<<<gridsize, 64, 0, *streamptr>>>(dev_data, dev_hashes, dev_countbits);
-  filter_sha512_kernel<<<gridsize, 64, 0, *streamptr>>>(dev_hashes, dev_countbits);
-  cudaMemsetAsync(dev_countbits, 0, sizeof(uint32_t)*NUM_COUNTBITS_WORDS, *streamptr);
-  populate_filter_kernel<<<gridsize, 64, 0, *streamptr>>>(dev_hashes, dev_countbits);
-  filter_and_rewrite_sha512_kernel<<<gridsize, 64, 0, *streamptr>>>(dev_hashes, dev_countbits, dev_results);
-  error = cudaMemcpyAsync(hashes, dev_results, sizeof(uint64_t)*N_RESULTS, cudaMemcpyDeviceToHost, *streamptr);
-
-  error = cudaDeviceSynchronize();
+  // One thread per spot:  by default 64 threads per block on a
+  // 4096x32 grid.  With slabs, each pass is that many launches over
+  // consecutive ranges of spots.  Below full intensity the grid
+  // shrinks, and only the front of the filter is used and cleared.
+  int threads = params.block_threads;
+  int slabs = params.slabs;
+  uint32_t slab_spots = ((uint32_t)1 << (intensity-3)) / slabs;
+  uint32_t blocks = slab_spots / threads;
+  dim3 gridsize(blocks < 4096 ? blocks : 4096, blocks < 4096 ? 1 : blocks / 4096);
+  int power = RoundFilterPower(params.filter_power, intensity);
+  size_t round_words = (size_t)1 << (power-5);
+  uint32_t slot_mask = (uint32_t)(((uint64_t)1 << (power-1)) - 1);
+  cudaMemsetAsync(dev_results, 0, sizeof(uint64_t)*N_RESULTS*n_batch, *streamptr);
+  for (int b = 0; b < n_batch; b++) {
+    cudaMemsetAsync(dev_countbits, 0, sizeof(uint32_t)*round_words, *streamptr);
+    for (int s = 0; s < slabs; s++)
+      search_sha512_kernel<<<gridsize, threads, 0, *streamptr>>>(s*slab_spots, slot_mask, dev_data + b*16, dev_hashes, dev_countbits);
+    for (int s = 0; s < slabs; s++)
+      filter_sha512_kernel<<<gridsize, threads, 0, *streamptr>>>(s*slab_spots, slot_mask, dev_hashes, dev_countbits);
+    cudaMemsetAsync(dev_countbits, 0, sizeof(uint32_t)*round_words, *streamptr);
+    for (int s = 0; s < slabs; s++)
+      populate_filter_kernel<<<gridsize, threads, 0, *streamptr>>>(s*slab_spots, slot_mask, dev_hashes, dev_countbits);
+    for (int s = 0; s < slabs; s++)
+      filter_and_rewrite_sha512_kernel<<<gridsize, threads, 0, *streamptr>>>(s*slab_spots, slot_mask, dev_hashes, dev_countbits, dev_results + b*N_RESULTS);
+  }
+  error = cudaMemcpyAsync(hashes, dev_results, sizeof(uint64_t)*N_RESULTS*n_batch, cudaMemcpyDeviceToHost, *streamptr);
   if (error != cudaSuccess) {
-    fprintf(stderr, "Error in kernel exec (%d)\n", error);
+    fprintf(stderr, "Could not memcpy dev_hashes out (%d)\n", error);
     return -1;
   }
 
+  error = cudaStreamSynchronize(*streamptr);
   if (error != cudaSuccess) {
-    fprintf(stderr, "Could not memcpy dev_hashes out (%d)\n", error);
+    fprintf(stderr, "Error in kernel exec (%d)\n", error);
     return -1;
   }
+
   return 0;
 }
 
@@ -163,14 +213,14 @@ void set_or_double(__restrict__ uint32_t *countbits, uint32_t whichbit) {
 }
 
 __device__ inline
-void add_to_filter(__restrict__ uint32_t *countbits, const uint64_t hash) {
-  uint32_t whichbit = (uint32_t(hash>>14) & ((1UL<<COUNTBITS_SLOTS_POWER)-1));
+void add_to_filter(__restrict__ uint32_t *countbits, uint32_t slot_mask, const uint64_t hash) {
+  uint32_t whichbit = (uint32_t(hash>>14) & slot_mask);
   set_or_double(countbits, whichbit);
 }
 
 __device__ inline
-bool is_in_filter_twice(const __restrict__ uint32_t *countbits, const uint64_t hash) {
-  uint32_t whichbit = (uint32_t(hash>>14) & ((1UL<<COUNTBITS_SLOTS_POWER)-1));
+bool is_in_filter_twice(const __restrict__ uint32_t *countbits, uint32_t slot_mask, const uint64_t hash) {
+  uint32_t whichbit = (uint32_t(hash>>14) & slot_mask);
   uint32_t cbits = countbits[whichbit/16];
   
   return (cbits & (1UL<<((2*(whichbit%16))+1)));
@@ -178,10 +228,10 @@ bool is_in_filter_twice(const __restrict__ uint32_t *countbits, const uint64_t h
 
 
 __global__
-void search_sha512_kernel(const __restrict__ uint64_t *dev_data, __restrict__ uint64_t *dev_hashes, __restrict__ uint32_t *dev_countbits) {
+void search_sha512_kernel(uint32_t spot_base, uint32_t slot_mask, const __restrict__ uint64_t *dev_data, __restrict__ uint64_t *dev_hashes, __restrict__ uint32_t *dev_countbits) {
   uint64_t H[8];
   uint64_t D[5];
-  uint32_t spot = (((gridDim.x * blockIdx.y) + blockIdx.x)* blockDim.x) + threadIdx.x;
+  uint32_t spot = spot_base + (((gridDim.x * blockIdx.y) + blockIdx.x)* blockDim.x) + threadIdx.x;
   for (int i = 0; i < 5; i++) {
     D[i] = dev_data[i]; /* constant memory would be better */
   }
@@ -194,18 +244,18 @@ void search_sha512_kernel(const __restrict__ uint64_t *dev_data, __restrict__ ui
   sha512_block(H, D);
 
   for (int i = 0; i < 8; i++) {
-    add_to_filter(dev_countbits, H[i]);
+    add_to_filter(dev_countbits, slot_mask, H[i]);
 #define POOLSIZE (1<<23)
     dev_hashes[i*POOLSIZE+spot] = H[i];
   }
 }
 
 __global__
-void filter_sha512_kernel(__restrict__ uint64_t *dev_hashes, const __restrict__ uint32_t *dev_countbits) {
-  uint32_t spot = (((gridDim.x * blockIdx.y) + blockIdx.x)* blockDim.x) + threadIdx.x;
+void filter_sha512_kernel(uint32_t spot_base, uint32_t slot_mask, __restrict__ uint64_t *dev_hashes, const __restrict__ uint32_t *dev_countbits) {
+  uint32_t spot = spot_base + (((gridDim.x * blockIdx.y) + blockIdx.x)* blockDim.x) + threadIdx.x;
   for (int i = 0; i < 8; i++) {
     uint64_t myword = dev_hashes[i*POOLSIZE+spot];
-    bool c = is_in_filter_twice(dev_countbits, myword);
+    bool c = is_in_filter_twice(dev_countbits, slot_mask, myword);
     if (!c) {
       dev_hashes[i*POOLSIZE+spot] = 0;
     }
@@ -215,26 +265,30 @@ void filter_sha512_kernel(__restrict__ uint64_t *dev_hashes, const __restrict__
 
 
 __global__
-void populate_filter_kernel(__restrict__ uint64_t *dev_hashes, __restrict__ uint32_t *dev_countbits) {
-  uint32_t spot = (((gridDim.x * blockIdx.y) + blockIdx.x)* blockDim.x) + threadIdx.x;
+void populate_filter_kernel(uint32_t spot_base, uint32_t slot_mask, __restrict__ uint64_t *dev_hashes, __restrict__ uint32_t *dev_countbits) {
+  uint32_t spot = spot_base + (((gridDim.x * blockIdx.y) + blockIdx.x)* blockDim.x) + threadIdx.x;
   for (int i = 0; i < 8; i++) {
     uint64_t myword = dev_hashes[i*POOLSIZE+spot];
     if (myword) {
-      add_to_filter(dev_countbits, (myword>>18));
+      add_to_filter(dev_countbits, slot_mask, (myword>>18));
     }
   }
 }
 
 __global__
-void filter_and_rewrite_sha512_kernel(__restrict__ uint64_t *dev_hashes, const __restrict__ uint32_t *dev_countbits, __restrict__ uint64_t *dev_results) {
-  uint32_t spot = (((gridDim.x * blockIdx.y) + blockIdx.x)* blockDim.x) + threadIdx.x;
+void filter_and_rewrite_sha512_kernel(uint32_t spot_base, uint32_t slot_mask, __restrict__ uint64_t *dev_hashes, const __restrict__ uint32_t *dev_countbits, __restrict__ uint64_t *dev_results) {
+  uint32_t spot = spot_base + (((gridDim.x * blockIdx.y) + blockIdx.x)* blockDim.x) + threadIdx.x;
   for (int i = 0; i < 8; i++) {
     uint64_t myword = dev_hashes[i*POOLSIZE+spot];
 
-    if (myword && is_in_filter_twice(dev_countbits, (myword>>18))) {
-      uint32_t result_slot = atomicInc((uint32_t *)dev_results, GPUHasher::N_RESULTS);
-      dev_results[result_slot*2+1] = (myword >> 14); /* the actual momentum val */
-      dev_results[result_slot*2+2] = (spot*8+i);
+    if (myword && is_in_filter_twice(dev_countbits, slot_mask, (myword>>18))) {
+      uint32_t result_slot = atomicAdd((uint32_t *)dev_results, 1);
+      /* Past the end we keep counting but drop the candidate rather
+       * than writing into the next batch entry's results. */
+      if (result_slot < GPUHasher::N_RESULT_SLOTS) {
+	dev_results[result_slot*2+1] = (myword >> 14); /* the actual momentum val */
+	dev_results[result_slot*2+2] = (spot*8+i);
+      }
     }
   }
 }
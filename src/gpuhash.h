@@ -1,14 +1,25 @@
-class GPUHasher {
+#include "hasher.h"
+
+class GPUHasher : public Hasher {
 public:
-  GPUHasher(int gpu_device_id);
+  GPUHasher(int gpu_device_id, int max_batch = 1, const EngineParams& params = EngineParams());
   int Initialize();
-  int ComputeHashes(uint64_t data[16], uint64_t H[8]);
+  int ComputeHashes(const uint64_t data[][16], uint64_t *hashes, int n_batch);
   ~GPUHasher();
 
-  static const int N_RESULTS = (32768*2);
+  /* PCI bus id of the device ("0000:01:00.0"), used to find the
+   * CPUs and NUMA node closest to it.  Works before Initialize. */
+  int GetPCIBusId(char *busid, int len);
+
+  /* Model name and compute capability ("GeForce GTX 680 sm_30"),
+   * which keys the tuned profile.  Works before Initialize. */
+  int GetDeviceName(char *name, int len);
 
  private:
   int device_id;
+  int max_batch;
+  EngineParams params;
+  size_t countbits_words;
   uint64_t *dev_data;
   uint64_t *dev_hashes;
   uint32_t *dev_countbits;
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#ifndef HASHER_H
+#define HASHER_H
+
+#include <inttypes.h>
+
+/* Engine tunables.  The defaults are the original hand-tuned values;
+ * -autotune searches for better ones per device (see profile.hpp). */
+struct EngineParams {
+  int block_threads;  /* gpu:  threads per CUDA block */
+  int slabs;          /* gpu:  launches each kernel pass is split into */
+  int filter_power;   /* log2 of the counting filter's size in bits */
+
+  EngineParams() : block_threads(64), slabs(1), filter_power(31) { }
+
+  /* The GPU grid is 4096 x 2^23/(4096 * block_threads * slabs), so
+   * both must be powers of two with a product of at most 2048. */
+  bool Valid() const {
+    return block_threads >= 32 && block_threads <= 1024 && slabs >= 1 && block_threads * slabs <= 2048 &&
+      (block_threads & (block_threads-1)) == 0 && (slabs & (slabs-1)) == 0 &&
+      filter_power >= MIN_FILTER_POWER && filter_power <= MAX_FILTER_POWER;
+  }
+
+  /* Below 31 the filters pass more candidates than the result
+   * block holds; each step up doubles the filter's memory. */
+  static const int MIN_FILTER_POWER = 31;
+  static const int MAX_FILTER_POWER = 33;
+};
+
+/* Interface shared by the search engines.  An engine takes the SHA512
+ * midstate of a header (nonce word zeroed), hashes the whole momentum
+ * nonce space and returns every birthday that might collide.
+ *
+ * Result layout, per batch entry:  word 0 holds the number of
+ * candidates, followed by (birthday, nonce) pairs. */
+class Hasher {
+public:
+  Hasher() : intensity(MAX_INTENSITY), partition_index(0), partition_count(1) { }
+  virtual ~Hasher() { }
+
+  /* Allocate everything needed for a round.  Call once, from the
+   * thread that will call ComputeHashes. */
+  virtual int Initialize() = 0;
+
+  /* Runs n_batch independent searches back to back.  data holds
+   * n_batch 16-word SHA512 midstates, hashes must have room for
+   * n_batch * N_RESULTS words; batch entry b's results start at
+   * hashes + b*N_RESULTS. */
+  virtual int ComputeHashes(const uint64_t data[][16], uint64_t *hashes, int n_batch) = 0;
+
+  /* Later rounds search only nonces [0, 2^bits), with the counting
+   * filter shrunk to match.  A round gets shorter in proportion, but
+   * finds quadratically fewer collisions:  each step down halves the
+   * collisions per hash.  Shares from a short round are still valid,
+   * the pool only checks that both nonces are below 2^26. */
+  void SetIntensity(int bits) {
+    if (bits < MIN_INTENSITY) bits = MIN_INTENSITY;
+    if (bits > MAX_INTENSITY) bits = MAX_INTENSITY;
+    intensity = bits;
+  }
+  int GetIntensity() const { return intensity; }
+
+  /* Cooperative search (-partition):  count engines hash the same
+   * headers, and this one keeps only the birthdays whose top bits put
+   * them in partition index.  Both halves of a collision have the
+   * same birthday, so the partitions together find every collision
+   * one engine would, each with 1/count of the tables.  Call before
+   * Initialize; false if the engine can't. */
+  virtual bool SetPartition(int index, int count) { return count == 1; }
+  int GetPartitionIndex() const { return partition_index; }
+  int GetPartitionCount() const { return partition_count; }
+  static int Partition(uint64_t birthday, int count) {
+    return (int)(((birthday >> 18) * count) >> 32);
+  }
+  bool InPartition(uint64_t birthday) const {
+    return Partition(birthday, partition_count) == partition_index;
+  }
+
+  static const int N_RESULTS = (32768*2);
+  static const int N_RESULT_SLOTS = (N_RESULTS-1)/2;
+  static const int MAX_BATCH = 16;
+  static const int MIN_INTENSITY = 20;
+  static const int MAX_INTENSITY = 26;
+  static const int MAX_PARTITIONS = 64;
+
+protected:
+  /* log2 of the filter size in bits for a round at this intensity */
+  static int RoundFilterPower(int filter_power, int bits) {
+    return filter_power - (MAX_INTENSITY - bits);
+  }
+
+  int intensity;
+  int partition_index;
+  int partition_count;
+};
+
+#endif /* HASHER_H */
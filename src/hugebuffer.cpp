@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "hugebuffer.hpp"
+
+#if defined(__MINGW32__) || defined(__MINGW64__)
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#if defined(__linux__)
+/* Default huge page size from /proc/meminfo, in bytes */
+static size_t huge_page_size() {
+  std::ifstream meminfo("/proc/meminfo");
+  std::string line;
+  while (std::getline(meminfo, line)) {
+    if (line.compare(0, 13, "Hugepagesize:") == 0) {
+      long kb = strtol(line.c_str() + 13, NULL, 10);
+      if (kb > 0)
+	return (size_t)kb << 10;
+    }
+  }
+  return 2 << 20;
+}
+#endif
+
+bool HugeBuffer::Allocate(size_t size) {
+  Free();
+#if defined(__MINGW32__) || defined(__MINGW64__)
+  _ptr = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  if (_ptr == NULL)
+    return false;
+  _size = size;
+  _page_size = 4096;
+  _kind = SMALL;
+  return true;
+#else
+  size_t small = (size_t)sysconf(_SC_PAGESIZE);
+#if defined(__linux__)
+  size_t huge = huge_page_size();
+  size_t rounded = (size + huge - 1) & ~(huge - 1);
+  /* No MAP_NORESERVE:  we want this to fail now if the huge page pool
+   * is too small, not SIGBUS when the pages are first touched. */
+  void *p = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) {
+    _ptr = p;
+    _size = rounded;
+    _page_size = huge;
+    _kind = HUGETLB;
+    return true;
+  }
+#endif
+  size_t rounded_small = (size + small - 1) & ~(small - 1);
+  void *q = mmap(NULL, rounded_small, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (q == MAP_FAILED)
+    return false;
+  _ptr = q;
+  _size = rounded_small;
+  _page_size = small;
+  _kind = SMALL;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (madvise(q, rounded_small, MADV_HUGEPAGE) == 0) {
+    _page_size = huge;
+    _kind = THP;
+  }
+#endif
+  return true;
+#endif
+}
+
+void HugeBuffer::Free() {
+  if (_ptr == NULL)
+    return;
+#if defined(__MINGW32__) || defined(__MINGW64__)
+  VirtualFree(_ptr, 0, MEM_RELEASE);
+#else
+  munmap(_ptr, _size);
+#endif
+  _ptr = NULL;
+  _size = 0;
+  _page_size = 0;
+  _kind = NONE;
+}
+
+long HugeBuffer::HugeBytes() const {
+  if (_kind == HUGETLB)
+    return (long)_size;
+#if defined(__linux__)
+  /* Find our mapping in smaps and add up its AnonHugePages.  The
+   * kernel may have merged us with a neighbouring mapping, in which
+   * case the VMA's count is shared out by how much of it is ours. */
+  std::ifstream smaps("/proc/self/smaps");
+  std::string line;
+  unsigned long start = (unsigned long)_ptr;
+  unsigned long end = start + _size;
+  unsigned long overlap = 0, vma_size = 0;
+  double huge = 0;
+  while (std::getline(smaps, line)) {
+    unsigned long lo, hi;
+    if (sscanf(line.c_str(), "%lx-%lx ", &lo, &hi) == 2) {
+      vma_size = hi - lo;
+      overlap = (lo < end && hi > start) ? (std::min(hi, end) - std::max(lo, start)) : 0;
+      continue;
+    }
+    if (overlap > 0 && line.compare(0, 14, "AnonHugePages:") == 0)
+      huge += (double)(strtol(line.c_str() + 14, NULL, 10) << 10) * overlap / vma_size;
+  }
+  return (long)huge;
+#else
+  return -1;
+#endif
+}
+
+std::string HugeBuffer::Describe() const {
+  std::stringstream ss;
+  ss << (_size >> 20) << "MB, ";
+  switch (_kind) {
+  case HUGETLB: ss << "huge pages (" << (_page_size >> 10) << "KB)"; break;
+  case THP: {
+    ss << "transparent huge pages";
+    long huge = HugeBytes();
+    if (huge >= 0)
+      ss << " (" << (huge >> 20) << "MB in " << (_page_size >> 20) << "MB pages)";
+  } break;
+  case SMALL: ss << "small pages (" << (_page_size >> 10) << "KB)"; break;
+  default: ss << "not allocated";
+  }
+  return ss.str();
+}
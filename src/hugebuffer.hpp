@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#ifndef HUGEBUFFER_HPP
+#define HUGEBUFFER_HPP
+
+#include <cstddef>
+#include <string>
+
+/* Memory for the big, randomly accessed search tables.  With 4KB pages
+ * nearly every access to a 512MB table is a TLB miss, so try in turn:
+ *   1. explicit huge pages (MAP_HUGETLB, needs vm.nr_hugepages)
+ *   2. an anonymous mapping advised for transparent huge pages
+ *   3. plain pages
+ * The buffer is not touched here; callers fault it in themselves so
+ * that each page lands on the NUMA node of the thread that uses it. */
+class HugeBuffer {
+public:
+  enum Kind { NONE = 0, HUGETLB, THP, SMALL };
+
+  HugeBuffer() : _ptr(NULL), _size(0), _page_size(0), _kind(NONE) { }
+  ~HugeBuffer() { Free(); }
+
+  bool Allocate(size_t size);
+  void Free();
+
+  void *data() const { return _ptr; }
+  size_t size() const { return _size; }
+  Kind kind() const { return _kind; }
+
+  /* Page size the kernel promised for this mapping */
+  size_t PageSize() const { return _page_size; }
+
+  /* Bytes of the mapping actually backed by huge pages right now.
+   * Only meaningful after the buffer has been faulted in; -1 if the
+   * platform can't tell. */
+  long HugeBytes() const;
+
+  /* e.g. "512MB, transparent huge pages (510MB in 2MB pages)" */
+  std::string Describe() const;
+
+private:
+  HugeBuffer(const HugeBuffer&);
+  HugeBuffer& operator=(const HugeBuffer&);
+
+  void *_ptr;
+  size_t _size;
+  size_t _page_size;
+  Kind _kind;
+};
+
+#endif /* HUGEBUFFER_HPP */
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#include "intensity.hpp"
+#include "hasher.h"
+#include "asynclog.hpp"
+
+#define N_INTENSITY_STEPS (Hasher::MAX_INTENSITY - Hasher::MIN_INTENSITY)
+
+/* Climb only when the next level is predicted to use at most this
+ * much of the budget, so one slow call doesn't bounce us back. */
+#define CLIMB_HEADROOM 0.75
+#define AVG_WEIGHT 0.3
+
+CIntensityControl::CIntensityControl(unsigned int worker, unsigned int max_batch, int fixed_intensity,
+				     uint64_t round_budget_us, uint64_t share_budget_us)
+  : worker(worker), max_batch(max_batch < 1 ? 1 : max_batch), adaptive(fixed_intensity < 0),
+    round_budget_us(round_budget_us), share_budget_us(share_budget_us), avg_us(0), calls_held(0) {
+  top_level = N_INTENSITY_STEPS + this->max_batch - 1;
+  if (adaptive) {
+    set_level(N_INTENSITY_STEPS); /* batch 1 at full intensity, as without -intensity */
+  } else {
+    level = -1;
+    batch = this->max_batch;
+    intensity = fixed_intensity;
+  }
+}
+
+/* Hashes per call, in units of 2^MIN_INTENSITY */
+uint64_t CIntensityControl::level_work(int l) {
+  if (l < N_INTENSITY_STEPS)
+    return (uint64_t)1 << l;
+  return (uint64_t)(l - N_INTENSITY_STEPS + 1) << N_INTENSITY_STEPS;
+}
+
+void CIntensityControl::set_level(int l) {
+  level = l;
+  if (l < N_INTENSITY_STEPS) {
+    batch = 1;
+    intensity = Hasher::MIN_INTENSITY + l;
+  } else {
+    batch = l - N_INTENSITY_STEPS + 1;
+    intensity = Hasher::MAX_INTENSITY;
+  }
+  calls_held = 0;
+}
+
+uint64_t CIntensityControl::BudgetMicros(uint64_t job_interval_us) const {
+  uint64_t budget = round_budget_us;
+  if (share_budget_us > 0 && share_budget_us / 2 < budget)
+    budget = share_budget_us / 2;
+  if (job_interval_us > 0 && job_interval_us / STALE_FRACTION < budget)
+    budget = job_interval_us / STALE_FRACTION;
+  return budget;
+}
+
+void CIntensityControl::Observe(uint64_t call_us, uint64_t job_interval_us) {
+  if (!adaptive)
+    return;
+  avg_us = avg_us == 0 ? call_us : (1 - AVG_WEIGHT) * avg_us + AVG_WEIGHT * call_us;
+  calls_held++;
+
+  /* The time of a call is taken to scale with its work.  Fixed costs
+   * make that pessimistic for climbing and optimistic for dropping,
+   * which the next few calls correct. */
+  double budget = BudgetMicros(job_interval_us);
+  int old_level = level;
+  double old_avg = avg_us;
+  if (avg_us > budget) {
+    int l = level;
+    while (l > 0 && avg_us > budget) {
+      avg_us = avg_us * level_work(l-1) / level_work(l);
+      l--;
+    }
+    set_level(l);
+  } else if (level < top_level && calls_held >= HOLD_CALLS) {
+    double next = avg_us * level_work(level+1) / level_work(level);
+    if (next <= CLIMB_HEADROOM * budget) {
+      avg_us = next;
+      set_level(level+1);
+    }
+  }
+  if (level != old_level)
+    LogPrintf(LOG_INFO, "[WORKER%u] intensity %d, batch %u (calls took %.0f ms, budget %.0f ms)",
+	      worker, intensity, batch, old_avg / 1000, budget / 1000);
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#ifndef INTENSITY_HPP
+#define INTENSITY_HPP
+
+#include <inttypes.h>
+
+/* Picks how much work one worker hands its engine per call, so that
+ * calls stay within a latency budget.  The work comes in levels,
+ * cheapest first:
+ *
+ *   batch 1 at intensity 20, 21, ... 26, then batch 2, 3, ... at 26
+ *
+ * Batch is given up before intensity, because a smaller batch only
+ * loses the per-call setup it amortizes, while every intensity step
+ * halves the collisions per hash.  After each call the time is folded
+ * into an average; above the budget the worker drops as many levels
+ * as the average says it must, and it climbs one level at a time once
+ * the next one is predicted to fit with room to spare.  A loaded host
+ * shows up as slower calls, so it backs off by itself.
+ *
+ * The budget is the smallest of:
+ *   - the round budget (-roundms)
+ *   - half the share budget (-sharems):  work that arrives just
+ *     after a call started waits for it, then needs a call of its own
+ *   - 1/STALE_FRACTION of the pool's job interval, which bounds the
+ *     work thrown away when a job is replaced mid-call
+ *
+ * With a fixed intensity the level never changes. */
+class CIntensityControl {
+public:
+  static const unsigned int STALE_FRACTION = 20;
+  static const unsigned int HOLD_CALLS = 4;   /* calls between climbs */
+
+  /* fixed_intensity < 0 for adaptive */
+  CIntensityControl(unsigned int worker, unsigned int max_batch, int fixed_intensity,
+		    uint64_t round_budget_us, uint64_t share_budget_us);
+
+  /* A call with the current settings took call_us.  job_interval_us
+   * is the pool's average time between jobs, 0 if not known yet. */
+  void Observe(uint64_t call_us, uint64_t job_interval_us);
+
+  unsigned int Batch() const { return batch; }
+  int Intensity() const { return intensity; }
+  uint64_t BudgetMicros(uint64_t job_interval_us) const;
+
+private:
+  void set_level(int l);
+  static uint64_t level_work(int l);
+
+  unsigned int worker;
+  unsigned int max_batch;
+  bool adaptive;
+  uint64_t round_budget_us;
+  uint64_t share_budget_us;
+  int level;
+  int top_level;
+  unsigned int batch;
+  int intensity;
+  double avg_us;    /* average call time at the current level */
+  unsigned int calls_held;
+};
+
+#endif /* INTENSITY_HPP */
@@ -9,9 +9,14 @@
 #include <cstdlib>
 #include <csignal>
 #include <map>
+#include <vector>
+#include <deque>
+#include <algorithm>
 #include <inttypes.h>
 #include <sys/mman.h>
 
+#include <boost/lexical_cast.hpp>
+
 #include "main_poolminer.hpp"
 
 #if defined(__GNUG__) && !defined(__MINGW32__) && !defined(__MINGW64__)
@@ -23,9 +28,13 @@
 
 #define VERSION_MAJOR 0
 #define VERSION_MINOR 8
+#ifdef NO_CUDA
+#define VERSION_EXT "GPU0.2 <experimental> (cpu only)"
+#define DEFAULT_ENGINE "cpu"
+#else
 #define VERSION_EXT "GPU0.2 <experimental>"
-
-#define MAX_THREADS 64
+#define DEFAULT_ENGINE "gpu"
+#endif
 
 /*********************************
  * global variables, structs and extern functions
@@ -38,15 +47,302 @@ static size_t fee_to_pay;
 static size_t miner_id;
 static boost::asio::ip::tcp::socket* socket_to_server;
 static boost::posix_time::ptime t_start;
-static std::map<int,unsigned long> statistics;
+static CStatSnapshot stats_start;
+static uint64_t process_start_us;
 static bool running;
 std::string pool_username;
 std::string pool_password;
+static std::string pool_host;
+static std::string pool_port;
+/* Reconnecting:  -dnsttl, -connecttimeout, -reconnectmin/max */
+static unsigned int dns_ttl;
+static uint64_t connect_timeout_us;
+static uint64_t reconnect_min_us;
+static uint64_t reconnect_max_us;
+static size_t batch_size;
+static bool roll_ntime;
+static std::string engine_type;
+/* Engine of each worker:  -engine=gpu+cpu runs one of each, the GPU
+ * worker first */
+static std::vector<std::string> worker_engines;
+static bool mixed_engines;
+/* -reservecores:  CPUs kept free of cpu engine threads, for the GPU
+ * worker, the network thread and the verifier */
+static std::vector<int> reserved_cpus;
+static CEngineScheduler engine_scheduler;
+static int cpu_threads;
+/* Engine tunables in effect:  defaults, then the -autotune profile
+ * cached for this device, then whatever the command line says */
+static EngineParams engine_params;
+/* -intensity:  fixed log2 nonces per round, or -1 to adapt to the
+ * -roundms and -sharems latency budgets */
+static int intensity_setting;
+static uint64_t round_budget_us;
+static uint64_t share_budget_us;
+/* -partition=i/n:  this node's share of a cooperative search */
+static int partition_index;
+static int partition_count;
+/* -spilldir:  where -engine=spill keeps its bucket file */
+static std::string spill_dir;
+static std::map<std::string, std::string> mapArgs;
+static CStatsStream *stats_stream;
+static CTraceWriter *trace_writer;
+static bool replaying;
+static bool benchmarking;
+static bool skip_selftest;
+static uint64_t selftest_data[16];
+static uint64_t selftest_quick_data[16];
 
 /* bleah this shouldn't be global so we can run one instance
  * on all GPUs. */
 int gpu_device_id = 0;
 
+/*********************************
+ * command line options (-name=value)
+ *********************************/
+
+static void ParseParameters(int argc, char **argv, std::vector<std::string>& positional) {
+  mapArgs.clear();
+  for (int i = 1; i < argc; i++) {
+    std::string str(argv[i]);
+    if (str.length() < 2 || str[0] != '-') {
+      positional.push_back(str);
+      continue;
+    }
+    std::string value;
+    size_t is_index = str.find('=');
+    if (is_index != std::string::npos) {
+      value = str.substr(is_index+1);
+      str = str.substr(0, is_index);
+    }
+    // interpret --foo as -foo
+    if (str.length() > 1 && str[1] == '-')
+      str = str.substr(1);
+    mapArgs[str] = value;
+  }
+}
+
+std::string GetArg(const std::string& strArg, const std::string& strDefault) {
+  std::map<std::string, std::string>::const_iterator it = mapArgs.find(strArg);
+  if (it != mapArgs.end())
+    return it->second;
+  return strDefault;
+}
+
+int64_t GetArg(const std::string& strArg, int64_t nDefault) {
+  std::map<std::string, std::string>::const_iterator it = mapArgs.find(strArg);
+  if (it != mapArgs.end())
+    return strtoll(it->second.c_str(), NULL, 10);
+  return nDefault;
+}
+
+bool GetBoolArg(const std::string& strArg, bool fDefault) {
+  std::map<std::string, std::string>::const_iterator it = mapArgs.find(strArg);
+  if (it != mapArgs.end()) {
+    if (it->second.empty())
+      return true;
+    return (atoi(it->second.c_str()) != 0);
+  }
+  return fDefault;
+}
+
+/*********************************
+ * class CNonceAllocator - splits the nNonce space of a work unit
+ *********************************/
+
+/* Every header a worker hashes differs from the pool's work unit only
+ * in nNonce (and nTime, which follows the clock).  The nNonce offsets
+ * are carved up so that no two (instance, worker, round) triples can
+ * ever produce the same header:
+ *
+ *   | instance (10 bits) | worker (6 bits) | round (16 bits) |
+ *
+ * The instance id comes from -minerid and must be unique across all
+ * processes mining with the same payout address. */
+class CNonceAllocator {
+public:
+  static const unsigned int INSTANCE_BITS = 10;
+  static const unsigned int WORKER_BITS = 6;
+  static const unsigned int ROUND_BITS = 16;
+  static const unsigned int MAX_INSTANCES = (1 << INSTANCE_BITS);
+  /* The farm proxy moves miners between instances (MoveInstance) */
+  BOOST_STATIC_ASSERT(WORKER_BITS + ROUND_BITS == PROTO_INSTANCE_SHIFT && MAX_INSTANCES == PROTO_MAX_INSTANCES);
+
+  CNonceAllocator() : _instance(0) {}
+
+  void setInstance(unsigned int instance) { _instance = instance; }
+  unsigned int getInstance() const { return _instance; }
+
+  /* First nNonce offset and size of the range owned by a worker. */
+  uint32_t rangeStart(unsigned int worker) const {
+    return (((uint32_t)_instance << WORKER_BITS) | worker) << ROUND_BITS;
+  }
+  uint32_t rangeSize() const { return (1 << ROUND_BITS); }
+
+  /* nNonce offset for a worker's round within the current work unit.
+   * If a worker ever runs through its whole range on one work unit,
+   * epoch says how many times it wrapped and the caller has to move
+   * nTime forward by at least that much. */
+  uint32_t variant(unsigned int worker, unsigned int round, unsigned int *epoch) const {
+    *epoch = round >> ROUND_BITS;
+    return rangeStart(worker) + (round & (rangeSize() - 1));
+  }
+
+private:
+  unsigned int _instance;
+};
+
+/*********************************
+ * structured stats (-statsjson): one JSON object per line
+ *********************************/
+
+static const char *stat_names[N_STAT_COUNTERS] = {
+  "collisions", "shares", "candidates", "rounds", "nonces", "stale_drops", "duplicates", "engine_errors",
+  "accepted", "rejected", "stale", "blocks", "reconnects"
+};
+
+static std::string engine_device(const std::string& type) {
+  std::stringstream out;
+  out << type;
+  if (type == "gpu")
+    out << gpu_device_id;
+  return out.str();
+}
+
+static std::string device_name() {
+  std::string name;
+  for (size_t i = 0; i < worker_engines.size(); i++)
+    name += (i ? "+" : "") + engine_device(worker_engines[i]);
+  return name;
+}
+
+static std::string worker_device(unsigned int worker) {
+  return engine_device(worker_engines[worker % worker_engines.size()]);
+}
+
+static void json_header(std::stringstream& out, const char *type) {
+  out << std::fixed << std::setprecision(3);
+  out << "{\"type\":\"" << type << "\",\"ts_us\":" << MonotonicMicros()
+      << ",\"unix_time\":" << (uint64_t)time(NULL)
+      << ",\"miner_id\":" << miner_id
+      << ",\"device\":\"" << JsonEscape(device_name()) << "\"";
+}
+
+static void json_latency(std::stringstream& out, const char *name, const Histogram::Snapshot& snap) {
+  out << "\"" << name << "\":{\"count\":" << snap.count
+      << ",\"p50\":" << snap.Quantile(0.5)
+      << ",\"p90\":" << snap.Quantile(0.9)
+      << ",\"p99\":" << snap.Quantile(0.99) << "}";
+}
+
+/* One share outcome.  worker is -1 when the pool's answer can't be
+ * matched to a submission (latency timing off or after a reconnect). */
+static std::string share_json(const char *result, const char *reason, int worker, int code, uint64_t latency_us) {
+  std::stringstream out;
+  json_header(out, "share");
+  out << ",\"worker\":" << worker
+      << ",\"result\":\"" << result << "\""
+      << ",\"reason\":\"" << reason << "\""
+      << ",\"code\":" << code
+      << ",\"latency_us\":" << latency_us << "}";
+  return out.str();
+}
+
+/* Interval record, built on the stats stream thread.  Rates are per
+ * minute, both since start and over the last interval; latencies are
+ * over the last interval, in microseconds. */
+static std::string stats_json_interval(uint64_t lines_dropped) {
+  static uint64_t last_us = 0;
+  static uint64_t last_count[N_STAT_SHARDS][N_STAT_COUNTERS];
+  static Histogram::Snapshot last_midhash, last_verify, last_ack, last_reconnect, last_round[MAX_THREADS];
+
+  uint64_t now_us = MonotonicMicros();
+  if (last_us == 0)
+    last_us = process_start_us;
+  double minutes = (now_us - process_start_us) / 60e6;
+  double interval_minutes = (now_us - last_us) / 60e6;
+  last_us = now_us;
+
+  uint64_t total[N_STAT_COUNTERS], delta[N_STAT_COUNTERS];
+  uint64_t worker_delta[MAX_THREADS][N_STAT_COUNTERS];
+  for (int c = 0; c < N_STAT_COUNTERS; c++) {
+    total[c] = delta[c] = 0;
+    for (unsigned int i = 0; i < N_STAT_SHARDS; i++) {
+      uint64_t v = stat_shards[i].count[c].load(boost::memory_order_relaxed);
+      if (i < MAX_THREADS)
+	worker_delta[i][c] = v - last_count[i][c];
+      total[c] += v;
+      delta[c] += v - last_count[i][c];
+      last_count[i][c] = v;
+    }
+  }
+
+  std::stringstream out;
+  json_header(out, "interval");
+  out << ",\"uptime_s\":" << minutes * 60 << ",\"interval_s\":" << interval_minutes * 60;
+  out << ",\"lines_dropped\":" << lines_dropped;
+  out << ",\"totals\":{";
+  for (int c = 0; c < N_STAT_COUNTERS; c++)
+    out << (c ? "," : "") << "\"" << stat_names[c] << "\":" << total[c];
+  out << "},\"interval\":{";
+  for (int c = 0; c < N_STAT_COUNTERS; c++)
+    out << (c ? "," : "") << "\"" << stat_names[c] << "\":" << delta[c];
+  out << "},\"rates_per_min\":{";
+  for (int c = 0; c < N_STAT_COUNTERS; c++)
+    out << (c ? "," : "") << "\"" << stat_names[c] << "\":" << (minutes > 0 ? total[c] / minutes : 0);
+  out << "},\"interval_rates_per_min\":{";
+  for (int c = 0; c < N_STAT_COUNTERS; c++)
+    out << (c ? "," : "") << "\"" << stat_names[c] << "\":" << (interval_minutes > 0 ? delta[c] / interval_minutes : 0);
+  out << "}";
+
+  Histogram::Snapshot snap;
+  out << ",\"latency_us\":{";
+  hist_midhash.Read(&snap);
+  { Histogram::Snapshot d = snap; d.Subtract(last_midhash); last_midhash = snap; json_latency(out, "midhash", d); }
+  out << ",";
+  hist_verify.Read(&snap);
+  { Histogram::Snapshot d = snap; d.Subtract(last_verify); last_verify = snap; json_latency(out, "verify", d); }
+  out << ",";
+  hist_share_ack.Read(&snap);
+  { Histogram::Snapshot d = snap; d.Subtract(last_ack); last_ack = snap; json_latency(out, "share_ack", d); }
+  out << ",";
+  hist_reconnect.Read(&snap);
+  { Histogram::Snapshot d = snap; d.Subtract(last_reconnect); last_reconnect = snap; json_latency(out, "reconnect", d); }
+  out << "}";
+
+  out << ",\"workers\":[";
+  for (unsigned int i = 0; i < thread_num_max; i++) {
+    hist_round[i].Read(&snap);
+    Histogram::Snapshot d = snap;
+    d.Subtract(last_round[i]);
+    last_round[i] = snap;
+    out << (i ? "," : "") << "{\"worker\":" << i << ",\"device\":\"" << JsonEscape(worker_device(i)) << "\"";
+    out << ",\"rounds\":" << worker_delta[i][STAT_ROUNDS]
+	<< ",\"collisions\":" << worker_delta[i][STAT_COLLISIONS]
+	<< ",\"shares\":" << worker_delta[i][STAT_SHARES]
+	<< ",\"stale_drops\":" << worker_delta[i][STAT_STALE_DROPS]
+	<< ",\"duplicates\":" << worker_delta[i][STAT_DUPLICATES]
+	<< ",\"engine_errors\":" << worker_delta[i][STAT_ENGINE_ERRORS]
+	<< ",\"intensity\":" << worker_intensity[i].load(boost::memory_order_relaxed)
+	<< ",\"batch\":" << worker_batch[i].load(boost::memory_order_relaxed)
+	<< ",\"mhash_per_s\":" << engine_scheduler.Rate(i) / 1e6
+	<< ",\"share\":" << engine_scheduler.Share(i);
+    if (collision_verifier != NULL) {
+      static const char *health[] = { "healthy", "throttled", "quarantined" };
+      out << ",\"verify_checks\":" << collision_verifier->Checked(i)
+	  << ",\"verify_errors\":" << collision_verifier->Errors(i)
+	  << ",\"error_rate\":" << collision_verifier->ErrorRate(i)
+	  << ",\"health\":\"" << health[collision_verifier->GetHealth(i)] << "\"";
+    }
+    out << ",\"rounds_per_min\":" << (interval_minutes > 0 ? worker_delta[i][STAT_ROUNDS] / interval_minutes : 0);
+    out << ",";
+    json_latency(out, "round_us", d);
+    out << "}";
+  }
+  out << "]}";
+  return out.str();
+}
+
 /*********************************
  * class CBlockProviderGW to (incl. SUBMIT_BLOCK)
  *********************************/
@@ -54,26 +350,71 @@ int gpu_device_id = 0;
 class CBlockProviderGW : public CBlockProvider {
 public:
 
-  CBlockProviderGW() : CBlockProvider(), nTime_offset(0), _block(NULL) {}
+  CBlockProviderGW() : CBlockProvider(), nTime_offset(0), nTime_skew(0), _work_us(0), _last_job_us(0), _job_interval_us(0),
+		       _replay(false), _replay_rounds(0), _generation(0), _submit_stop(false), _block(NULL), _next_slot(0) {
+    for (unsigned int i = 0; i < MAX_THREADS; i++) {
+      _replay_seen[i] = 0;
+      _replay_done[i] = 0;
+    }
+    _submitter.reset(new boost::thread(boost::bind(&CBlockProviderGW::submit_main, this)));
+  }
 
-  virtual ~CBlockProviderGW() { /* TODO */ }
+  virtual ~CBlockProviderGW() {
+    {
+      boost::mutex::scoped_lock lock(_mutex_submit);
+      _submit_stop = true;
+    }
+    _submit_ready.notify_one();
+    _submitter->join();
+  }
 
   virtual unsigned int GetAdjustedTimeWithOffset(unsigned int thread_id) {
     return nTime_offset + ((((unsigned int)time(NULL) + thread_num_max) / thread_num_max) * thread_num_max) + thread_id;
   }
 
+  /* Our best guess at the server's current clock. */
+  unsigned int GetServerTime() {
+    if (_replay)
+      return 0; /* keep the recorded nTime */
+    if (partition_count > 1)
+      return 0; /* every node of the search must hash the same header */
+    return (unsigned int)((int)time(NULL) + nTime_skew);
+  }
+
+  CNonceAllocator& nonceAllocator() { return _nonces; }
+
   virtual blockHeader_t* getBlock(unsigned int thread_id, unsigned int last_time, unsigned int counter) {
     blockHeader_t* block = NULL;
     {
       boost::shared_lock<boost::shared_mutex> lock(_mutex_getwork);
       if (_block == NULL) return NULL;
+      if (_replay_rounds > 0 && counter >= replayQuota(thread_id)) {
+	/* Only a worker that hashed this unit can be done with it; its
+	 * counter may still belong to the previous one. */
+	if (_replay_seen[thread_id] == _generation)
+	  _replay_done[thread_id] = _generation;
+	return NULL;
+      }
+      _replay_seen[thread_id] = _generation;
       block = new blockHeader_t;
-      memcpy(block, _block, 80+32+8);
+      memcpy(block, _block, sizeof(blockHeader_t));
     }		
-    unsigned int new_time = GetAdjustedTimeWithOffset(thread_id);
-    new_time += counter * thread_num_max;
-    block->nTime = new_time;
-    //std::cout << "[WORKER" << thread_id << "] block @ " << new_time << std::endl;
+    if (roll_ntime) {
+      unsigned int new_time = GetAdjustedTimeWithOffset(thread_id);
+      new_time += counter * thread_num_max;
+      block->nTime = new_time;
+    } else {
+      /* Each (worker, round) gets its own nNonce, so nTime can simply
+       * follow the server's clock instead of running ahead of it. */
+      unsigned int epoch;
+      uint32_t variant = _nonces.variant(thread_id, counter, &epoch);
+      unsigned int new_time = GetServerTime();
+      if (new_time < block->nTime + epoch)
+	new_time = block->nTime + epoch;
+      block->nTime = new_time;
+      block->nNonce ^= variant;
+    }
+    //std::cout << "[WORKER" << thread_id << "] block @ " << block->nTime << std::endl;
     return block;
   }
 	
@@ -82,54 +423,528 @@ public:
     return _block;
   }
 	
+  /* The work is copied into the next of a few fixed slots, so that
+   * new work costs no allocation and a pointer from
+   * getOriginalBlock() stays readable for a while after it has been
+   * replaced. */
   virtual void setBlockTo(blockHeader_t* newblock) {
-    blockHeader_t* old_block = NULL;
-    {
-      boost::unique_lock<boost::shared_mutex> lock(_mutex_getwork);
-      old_block = _block;
-      _block = newblock;
+    boost::unique_lock<boost::shared_mutex> lock(_mutex_getwork);
+    if (newblock != NULL) {
+      blockHeader_t *slot = &_slots[_next_slot++ % N_BLOCK_SLOTS];
+      memcpy(slot, newblock, sizeof(blockHeader_t));
+      newblock = slot;
     }
-    if (old_block != NULL) delete old_block;
+    _block = newblock;
+    _generation++;
+    _work_us = MonotonicMicros();
   }
 
-  void setBlocksFromData(unsigned char* data) {
-    blockHeader_t* block = new blockHeader_t;
+  void setBlocksFromData(const unsigned char* data, unsigned int session = 0) {
+    blockHeader_t work;
+    blockHeader_t* block = &work;
     memcpy(block, data, 80); //0-79
     block->birthdayA = 0;    //80-83
     block->birthdayB = 0;    //84-87
     memcpy(((unsigned char*)block)+88,data+80, 32);
+    block->session = session;
     //
     unsigned int nTime_local = time(NULL);
     unsigned int nTime_server = block->nTime;
     nTime_offset = nTime_local > nTime_server ? 0 : (nTime_server-nTime_local);
+    nTime_skew = (int)(nTime_server - nTime_local);
     //
+    /* How often the pool replaces work, which bounds how long an
+     * adaptive engine call may take.  Benchmark units come as fast as
+     * they're hashed and would only drag it down. */
+    if (!benchmarking) {
+      uint64_t now = MonotonicMicros();
+      if (_last_job_us != 0) {
+	uint64_t interval = now - _last_job_us;
+	uint64_t avg = _job_interval_us.load(boost::memory_order_relaxed);
+	_job_interval_us.store(avg == 0 ? interval : (3*avg + interval) / 4, boost::memory_order_relaxed);
+      }
+      _last_job_us = now;
+    }
     setBlockTo(block);
   }
 
+  /* Average time between jobs, 0 until the second one */
+  uint64_t jobIntervalMicros() {
+    return _job_interval_us.load(boost::memory_order_relaxed);
+  }
+
+  /* True if the block was built from work the pool has since
+   * replaced with work on a different previous block. */
+  bool isStale(blockHeader_t *block) {
+    boost::shared_lock<boost::shared_mutex> lock(_mutex_getwork);
+    return _block == NULL || memcmp(_block->hashPrevBlock, block->hashPrevBlock, 32) != 0;
+  }
+
+  /* Workers only queue their shares; one thread writes them out, so
+   * a slow pool never holds up the hashing.  A share that was already
+   * sent on the same work (two workers on one header, or A/B and B/A
+   * being the same header) is counted and dropped, as the pool would
+   * only reject it.  Block solutions go out ahead of queued shares. */
   void submitBlock(blockHeader_t *block, unsigned int thread_id) {
-    if (socket_to_server != NULL) {
-      blockHeader_t submitblock; //!
-      memcpy((unsigned char*)&submitblock, (unsigned char*)block, 88);
-      std::cout << "[WORKER] collision found: " << submitblock.birthdayA << " <-> " << submitblock.birthdayB << " #" << totalCollisionCount << " @ " << submitblock.nTime << " by " << thread_id << std::endl;
-      boost::system::error_code submit_error = boost::asio::error::host_not_found;
-      if (socket_to_server != NULL) boost::asio::write(*socket_to_server, boost::asio::buffer((unsigned char*)&submitblock, 88), boost::asio::transfer_all(), submit_error); //FaF
-      //if (submit_error)
-      //	std::cout << submit_error << " @ submit" << std::endl;
-      if (!submit_error)
-	++totalShareCount;
+    if (isStale(block)) {
+      stat_add(thread_id, STAT_STALE_DROPS);
+      if (stats_stream != NULL)
+	stats_stream->Emit(share_json("dropped", isConnected() ? "superseded" : "disconnected", thread_id, 0, 0));
+      return;
+    }
+    if (_recent_shares.Seen(CShareFilter::Key((const unsigned char*)block, block->session))) {
+      stat_add(thread_id, STAT_DUPLICATES);
+      if (stats_stream != NULL)
+	stats_stream->Emit(share_json("dropped", "duplicate", thread_id, 0, 0));
+      return;
+    }
+    if (_replay) {
+      traceSubmit(block, block->session, thread_id);
+      stat_add(thread_id, STAT_SHARES);
+      uint64_t work_us;
+      {
+	boost::shared_lock<boost::shared_mutex> lock(_mutex_getwork);
+	work_us = _work_us;
+      }
+      boost::mutex::scoped_lock lock(_mutex_acks);
+      _replay_latencies.push_back(MonotonicMicros() - work_us);
+      return;
+    }
+    QueuedShare share;
+    memcpy(share.data, block, PROTO_SHARE_SIZE);
+    share.session = block->session;
+    share.worker = thread_id;
+    bool solves_block = meetsNetworkTarget(block);
+    size_t ahead_of;
+    {
+      boost::mutex::scoped_lock lock(_mutex_submit);
+      (solves_block ? _submit_blocks : _submit_shares).push_back(share);
+      ahead_of = _submit_shares.size();
     }
+    _submit_ready.notify_one();
+    if (solves_block)
+      LogPrintf(LOG_INFO, "[WORKER%u] found a block (nTime %u), sending it ahead of %u queued shares",
+		thread_id, block->nTime, (unsigned int)ahead_of);
+  }
+
+  size_t queuedShares() {
+    boost::mutex::scoped_lock lock(_mutex_submit);
+    return _submit_blocks.size() + _submit_shares.size();
+  }
+
+  /* Sessions that shares can be written to.  A session is removed
+   * before its socket is closed, and no write is in progress then. */
+  void addSession(unsigned int id, boost::asio::ip::tcp::socket *socket) {
+    boost::mutex::scoped_lock lock(_mutex_sessions);
+    _sessions[id] = socket;
+  }
+
+  void removeSession(unsigned int id) {
+    {
+      boost::mutex::scoped_lock lock(_mutex_sessions);
+      _sessions.erase(id);
+    }
+    boost::mutex::scoped_lock lock(_mutex_acks);
+    for (std::deque<PendingAck>::iterator it = _pending_acks.begin(); it != _pending_acks.end(); )
+      it = it->session == id ? _pending_acks.erase(it) : it + 1;
+  }
+
+  bool isConnected() {
+    boost::shared_lock<boost::shared_mutex> lock(_mutex_getwork);
+    return _block != NULL;
+  }
+
+  /* The pool answers a session's shares in order, so its oldest
+   * outstanding submission is the one being acknowledged.  Returns
+   * false if nothing was outstanding. */
+  bool shareAcknowledged(unsigned int session, uint64_t *latency_us, unsigned int *worker) {
+    boost::mutex::scoped_lock lock(_mutex_acks);
+    for (std::deque<PendingAck>::iterator it = _pending_acks.begin(); it != _pending_acks.end(); ++it) {
+      if (it->session != session)
+	continue;
+      *latency_us = MonotonicMicros() - it->submit_us;
+      *worker = it->worker;
+      hist_share_ack.Observe(*latency_us);
+      _pending_acks.erase(it);
+      return true;
+    }
+    return false;
+  }
+
+  size_t pendingAcks() {
+    boost::mutex::scoped_lock lock(_mutex_acks);
+    return _pending_acks.size();
+  }
+
+  /* Replay (-replay, -benchmark): shares are counted instead of sent,
+   * nTime stays at the recorded value, and with a round limit every
+   * worker hashes exactly that many variants of each work unit, which
+   * makes runs comparable share for share. */
+  void setReplay(unsigned int rounds) {
+    _replay = true;
+    _replay_rounds = rounds;
+  }
+
+  /* With engines of different speeds, a bounded unit's variants are
+   * split by measured rate instead of evenly, so mixed runs are not
+   * share-for-share reproducible. */
+  unsigned int replayQuota(unsigned int thread_id) {
+    return mixed_engines ? engine_scheduler.Quota(thread_id, _replay_rounds) : _replay_rounds;
+  }
+
+  /* True once every worker has fetched (started) or, with a round
+   * limit, finished the current work unit. */
+  bool replayWorkersAt(bool finished) {
+    boost::shared_lock<boost::shared_mutex> lock(_mutex_getwork);
+    for (unsigned int i = 0; i < thread_num_max; i++)
+      if ((finished ? _replay_done[i] : _replay_seen[i]) != _generation)
+	return false;
+    return true;
+  }
+
+  /* Microseconds from work arrival to each replayed share */
+  std::vector<uint64_t> replayLatencies() {
+    boost::mutex::scoped_lock lock(_mutex_acks);
+    return _replay_latencies;
   }
 
 protected:
+  struct QueuedShare {
+    unsigned char data[PROTO_SHARE_SIZE];
+    unsigned int session;
+    unsigned int worker;
+  };
+
+  void submit_main() {
+    while (true) {
+      QueuedShare share;
+      {
+	boost::mutex::scoped_lock lock(_mutex_submit);
+	while (!_submit_stop && _submit_blocks.empty() && _submit_shares.empty())
+	  _submit_ready.wait(lock);
+	if (_submit_stop)
+	  return;
+	std::deque<QueuedShare>& next = !_submit_blocks.empty() ? _submit_blocks : _submit_shares;
+	share = next.front();
+	next.pop_front();
+      }
+      sendShare(share);
+    }
+  }
+
+  /* A share goes to the session whose work it was found on, even
+   * if the master has since switched to another one. */
+  void sendShare(const QueuedShare& share) {
+    unsigned int thread_id = share.worker;
+    boost::mutex::scoped_lock sessions_lock(_mutex_sessions);
+    std::map<unsigned int, boost::asio::ip::tcp::socket*>::iterator session = _sessions.find(share.session);
+    if (session == _sessions.end()) {
+      stat_add(thread_id, STAT_STALE_DROPS);
+      if (stats_stream != NULL)
+	stats_stream->Emit(share_json("dropped", "disconnected", thread_id, 0, 0));
+      return;
+    }
+    blockHeader_t submitblock; //!
+    memcpy((unsigned char*)&submitblock, share.data, PROTO_SHARE_SIZE);
+    LogEventRecord(LOG_INFO, LOGEV_COLLISION, ((uint64_t)submitblock.birthdayA << 32) | submitblock.birthdayB,
+		   submitblock.nTime, stat_total(STAT_COLLISIONS), thread_id);
+    /* Traced ahead of the write, as the answer can come back before
+     * the write returns; a failed write ends the session anyway */
+    traceSubmit(&submitblock, share.session, thread_id);
+    boost::system::error_code submit_error = boost::asio::error::host_not_found;
+    boost::asio::write(*session->second, boost::asio::buffer((unsigned char*)&submitblock, PROTO_SHARE_SIZE), boost::asio::transfer_all(), submit_error); //FaF
+    if (!submit_error) {
+      stat_add(thread_id, STAT_SHARES);
+      if (metrics_enabled) {
+	boost::mutex::scoped_lock lock(_mutex_acks);
+	PendingAck ack = { MonotonicMicros(), thread_id, share.session };
+	_pending_acks.push_back(ack);
+      }
+    } else if (stats_stream != NULL)
+      stats_stream->Emit(share_json("dropped", "write_failed", thread_id, 0, 0));
+  }
+
+  void traceSubmit(blockHeader_t *block, unsigned int session, unsigned int thread_id) {
+    if (trace_writer == NULL)
+      return;
+    unsigned char rec[4+4+88];
+    uint32_t worker = thread_id, id = session;
+    memcpy(rec, &worker, 4);
+    memcpy(rec + 4, &id, 4);
+    memcpy(rec + 8, block, 88);
+    trace_writer->Record(TRACE_SUBMIT, rec, sizeof(rec));
+  }
+
   unsigned int nTime_offset;
+  int nTime_skew;
+  uint64_t _work_us;
+  uint64_t _last_job_us;
+  boost::atomic<uint64_t> _job_interval_us;
+  bool _replay;
+  unsigned int _replay_rounds;
+  unsigned int _generation;
+  boost::atomic<unsigned int> _replay_seen[MAX_THREADS];
+  boost::atomic<unsigned int> _replay_done[MAX_THREADS];
+  std::vector<uint64_t> _replay_latencies;
+  struct PendingAck {
+    uint64_t submit_us;
+    unsigned int worker;
+    unsigned int session;
+  };
+  boost::mutex _mutex_acks;
+  std::deque<PendingAck> _pending_acks;
+  boost::mutex _mutex_sessions;
+  std::map<unsigned int, boost::asio::ip::tcp::socket*> _sessions;
+  CShareFilter _recent_shares;
+  boost::mutex _mutex_submit;
+  boost::condition_variable _submit_ready;
+  std::deque<QueuedShare> _submit_blocks, _submit_shares;
+  bool _submit_stop;
+  boost::scoped_ptr<boost::thread> _submitter;
+  CNonceAllocator _nonces;
   boost::shared_mutex _mutex_getwork;
   blockHeader_t* _block;
+  static const unsigned int N_BLOCK_SLOTS = 4;
+  blockHeader_t _slots[N_BLOCK_SLOTS];
+  unsigned int _next_slot;
 };
 
 /*********************************
  * multi-threading
  *********************************/
 
+/* CPUs for the cpu engine threads:  -affinity-engine, or every
+ * online CPU that isn't reserved */
+static void engine_cpu_list(std::vector<int>& cpus) {
+  if (ParseCPUList(GetArg("-affinity-engine", ""), cpus) && !cpus.empty())
+    return;
+  std::vector<int> online;
+  GetOnlineCPUs(online);
+  cpus.clear();
+  for (size_t i = 0; i < online.size(); i++)
+    if (std::find(reserved_cpus.begin(), reserved_cpus.end(), online[i]) == reserved_cpus.end())
+      cpus.push_back(online[i]);
+}
+
+/* Builds an engine of the given type; gpu is set if it's a GPU */
+static Hasher *new_engine(const std::string& type, GPUHasher **gpu) {
+  *gpu = NULL;
+  if (type == "cpu") {
+    CPUHasher *cpu = new CPUHasher(cpu_threads, batch_size, engine_params);
+    std::vector<int> engine_cpus;
+    engine_cpu_list(engine_cpus);
+    cpu->SetAffinity(engine_cpus);
+    cpu->SetPartition(partition_index, partition_count);
+    return cpu;
+  }
+  if (type == "spill") {
+    CSpillHasher *spill = new CSpillHasher(cpu_threads, batch_size, spill_dir);
+    std::vector<int> engine_cpus;
+    engine_cpu_list(engine_cpus);
+    spill->SetAffinity(engine_cpus);
+    return spill;
+  }
+#ifdef NO_CUDA
+  return NULL; /* -engine=gpu is refused at startup */
+#else
+  *gpu = new GPUHasher(gpu_device_id, batch_size, engine_params);
+  return *gpu;
+#endif
+}
+
+/* midHash and SHA-512 known answers, on the host.  Leaves the golden
+ * headers' SHA-512 blocks in selftest_data and selftest_quick_data
+ * for the engine tests. */
+static bool selftest_host() {
+  blockHeader_t block;
+  memset(&block, 0, sizeof(block));
+  memcpy(&block, selftest_header, 80);
+  uint8_t midHash[32+4];
+  protoshares_midhash<SPHLIB>(&block, midHash, selftest_data);
+  blockHeader_t quick;
+  memset(&quick, 0, sizeof(quick));
+  memcpy(&quick, selftest_quick_header, 80);
+  uint8_t quickMidHash[32+4];
+  protoshares_midhash<SPHLIB>(&quick, quickMidHash, selftest_quick_data);
+  std::string error;
+  if (!SelfTestMidhash(midHash+4, &error) || !SelfTestBirthdays(selftest_data, &error)) {
+    LogPrintf(LOG_ERROR, "self-test failed: %s", error.c_str());
+    return false;
+  }
+  return true;
+}
+
+/* One engine round on a golden header:  a short one at startup, a
+ * full one for -selftest */
+static bool selftest_engine(Hasher *hasher, const char *who, bool full) {
+  std::string error;
+  uint64_t t0 = MonotonicMicros();
+  if (full ? !SelfTestEngine(hasher, selftest_data, &error) : !SelfTestEngineQuick(hasher, selftest_quick_data, &error)) {
+    LogPrintf(LOG_ERROR, "%s engine self-test failed: %s", who, error.c_str());
+    return false;
+  }
+  LogPrintf(LOG_INFO, "%s engine self-test passed (%.0f ms)", who, (MonotonicMicros() - t0) / 1000.0);
+  return true;
+}
+
+/*********************************
+ * autotuning (-autotune)
+ *********************************/
+
+/* Names the device an engine type runs on, for the profile cache */
+static std::string profile_key(const std::string& type) {
+#ifndef NO_CUDA
+  if (type == "gpu") {
+    char name[256];
+    GPUHasher gpu(gpu_device_id);
+    if (gpu.GetDeviceName(name, sizeof(name)) != 0)
+      return "";
+    return std::string("gpu:") + name;
+  }
+#endif
+  return CPUProfileKey();
+}
+
+static void use_profile(const EngineProfile& profile) {
+  batch_size = profile.batch;
+  cpu_threads = profile.cpu_threads;
+  engine_params = profile.params;
+}
+
+/* Hashes rounds variants of the benchmark header with a fresh engine
+ * built from the current settings.  Returns rounds per second, or 0
+ * if the engine fails; *collisions counts the candidate pairs with
+ * equal birthdays, which a correct engine always finds in full. */
+static double autotune_score(unsigned int rounds, uint64_t *collisions) {
+  GPUHasher *gpu;
+  Hasher *hasher = new_engine(engine_type, &gpu);
+  *collisions = 0;
+  if (hasher->Initialize() != 0) {
+    delete hasher;
+    return 0;
+  }
+  uint64_t *results = (uint64_t *)malloc(sizeof(uint64_t) * Hasher::N_RESULTS * batch_size);
+  uint64_t data[Hasher::MAX_BATCH][16];
+  uint8_t midHash[32+4];
+  blockHeader_t block;
+  memset(&block, 0, sizeof(block));
+  memcpy(&block, selftest_header, 80);
+
+  double score = 0;
+  uint64_t t0 = MonotonicMicros();
+  unsigned int r;
+  for (r = 0; r < rounds; r += batch_size) {
+    unsigned int n = std::min<unsigned int>(batch_size, rounds - r);
+    for (unsigned int b = 0; b < n; b++) {
+      block.nNonce = r + b;
+      protoshares_midhash<SPHLIB>(&block, midHash, data[b]);
+    }
+    if (hasher->ComputeHashes(data, results, n) != 0)
+      break;
+    for (unsigned int b = 0; b < n; b++) {
+      uint64_t *res = results + b*Hasher::N_RESULTS;
+      uint32_t n_results = std::min<uint32_t>(*(uint32_t *)res, Hasher::N_RESULT_SLOTS);
+      boost::unordered_map<uint64_t, uint32_t> seen;
+      for (uint32_t i = 0; i < n_results; i++)
+	if (!seen.insert(std::make_pair(res[1+i*2], 0)).second)
+	  (*collisions)++;
+    }
+  }
+  if (r >= rounds)
+    score = rounds / ((MonotonicMicros() - t0) / 1e6);
+  free(results);
+  delete hasher;
+  return score;
+}
+
+/* Measures one candidate and keeps it if it finds everything the
+ * starting point found and is clearly (2%) faster than the best. */
+static void autotune_try(EngineProfile *best, EngineProfile cand, unsigned int rounds, uint64_t want) {
+  if (!cand.params.Valid())
+    return;
+  use_profile(cand);
+  uint64_t found;
+  cand.score = autotune_score(rounds, &found);
+  LogPrintf(LOG_INFO, "[AUTOTUNE] %s%s", cand.Format().c_str(),
+	    cand.score == 0 ? " (engine failed)" : found != want ? " (lost collisions)" : "");
+  if (found == want && cand.score > best->score * 1.02)
+    *best = cand;
+}
+
+/* -autotune:  sweeps one setting at a time from the current ones
+ * (defaults or command line), keeping each improvement, and caches
+ * the winner under this device's key. */
+static bool autotune(const std::string& path) {
+  std::string key = profile_key(engine_type);
+  if (key.empty()) {
+    LogPrintf(LOG_ERROR, "[AUTOTUNE] can't identify the device");
+    return false;
+  }
+  unsigned int rounds = std::max<int64_t>(1, GetArg("-autotunerounds", 4));
+  LogPrintf(LOG_INFO, "[AUTOTUNE] tuning %s, %u rounds per setting", key.c_str(), rounds);
+
+  EngineProfile best;
+  best.batch = batch_size;
+  best.cpu_threads = cpu_threads;
+  best.params = engine_params;
+  use_profile(best);
+  uint64_t want;
+  best.score = autotune_score(rounds, &want);
+  LogPrintf(LOG_INFO, "[AUTOTUNE] %s (starting point)", best.Format().c_str());
+  if (best.score == 0)
+    return false;
+
+  EngineProfile cand;
+  if (engine_type == "cpu") {
+    std::vector<int> cpus;
+    GetOnlineCPUs(cpus);
+    int n_cpus = std::max<int>(1, cpus.size());
+    std::vector<int> counts;
+    for (int t = 1; t < n_cpus; t *= 2)
+      counts.push_back(t);
+    counts.push_back(n_cpus);
+    counts.push_back(2*n_cpus);
+    for (size_t i = 0; i < counts.size(); i++) {
+      cand = best;
+      cand.cpu_threads = counts[i];
+      if (counts[i] != best.cpu_threads)
+	autotune_try(&best, cand, rounds, want);
+    }
+  } else {
+    for (int t = 32; t <= 1024; t *= 2) {
+      cand = best;
+      cand.params.block_threads = t;
+      if (t != best.params.block_threads)
+	autotune_try(&best, cand, rounds, want);
+    }
+    for (int n = 1; n <= 16; n *= 2) {
+      cand = best;
+      cand.params.slabs = n;
+      if (n != best.params.slabs)
+	autotune_try(&best, cand, rounds, want);
+    }
+  }
+  for (int p = EngineParams::MIN_FILTER_POWER; p <= EngineParams::MAX_FILTER_POWER; p++) {
+    cand = best;
+    cand.params.filter_power = p;
+    if (p != best.params.filter_power)
+      autotune_try(&best, cand, rounds, want);
+  }
+  for (int b = 1; b <= 8; b *= 2) {
+    cand = best;
+    cand.batch = b;
+    if (b != best.batch)
+      autotune_try(&best, cand, rounds, want);
+  }
+
+  if (!SaveEngineProfile(path, key, best)) {
+    LogPrintf(LOG_ERROR, "[AUTOTUNE] could not write %s", path.c_str());
+    return false;
+  }
+  LogPrintf(LOG_INFO, "[AUTOTUNE] best: %s, saved to %s", best.Format().c_str(), path.c_str());
+  return true;
+}
+
 class CMasterThreadStub {
 public:
   virtual void wait_for_master() = 0;
@@ -144,23 +959,55 @@ public:
 
   }
 		
-  template<int COLLISION_TABLE_SIZE, int COLLISION_KEY_MASK, int CTABLE_BITS, SHAMODE shamode>
+  template<int COLLISION_TABLE_SIZE, uint32_t COLLISION_KEY_MASK, int CTABLE_BITS, SHAMODE shamode>
   void mineloop() {
     unsigned int blockcnt = 0;
-    blockHeader_t* thrblock = NULL;
+    unsigned int last_time = 0;
+    blockHeader_t* thrblocks[Hasher::MAX_BATCH];
     blockHeader_t* orgblock = NULL;
+    uint64_t last_round_us = 0;
+    CIntensityControl control(_id, batch_size, intensity_setting, round_budget_us, share_budget_us);
     while (running) {
+      /* A throttled engine idles once per round; a quarantined one
+       * sits out its cooldown here. */
+      if (collision_verifier != NULL) {
+	uint64_t pause = collision_verifier->PauseMicros(_id, last_round_us);
+	if (pause > 0)
+	  boost::this_thread::sleep(boost::posix_time::microseconds(pause));
+      }
       if (orgblock != _bprovider->getOriginalBlock()) {
 	orgblock = _bprovider->getOriginalBlock();
 	blockcnt = 0;
       }
-      thrblock = _bprovider->getBlock(_id, thrblock == NULL ? 0 : thrblock->nTime, blockcnt);
-      if (orgblock == _bprovider->getOriginalBlock()) {
+      /* Consecutive header variants are hashed as one batch so that
+       * the engine's per-round setup is paid once for all of them. */
+      unsigned int n_blocks = 0;
+      _hasher->SetIntensity(control.Intensity());
+      worker_intensity[_id % MAX_THREADS].store(control.Intensity(), boost::memory_order_relaxed);
+      worker_batch[_id % MAX_THREADS].store(control.Batch(), boost::memory_order_relaxed);
+      while (n_blocks < control.Batch()) {
+	blockHeader_t* thrblock = _bprovider->getBlock(_id, last_time, blockcnt);
+	if (thrblock == NULL)
+	  break;
+	/* New work partway through the batch carries on from the same
+	 * counter rather than from 0, so that no variant is fetched
+	 * twice whichever work the last header was copied from. */
+	orgblock = _bprovider->getOriginalBlock();
 	++blockcnt;
+	last_time = thrblock->nTime;
+	thrblocks[n_blocks++] = thrblock;
       }
-      if (thrblock != NULL) {
-	protoshares_process_512<COLLISION_TABLE_SIZE,COLLISION_KEY_MASK,CTABLE_BITS,shamode>(thrblock, _bprovider, _id, _gpu, _hashblock);
-      } else
+      if (n_blocks > 0) {
+	uint64_t t0 = MonotonicMicros();
+	protoshares_process_512<COLLISION_TABLE_SIZE,COLLISION_KEY_MASK,CTABLE_BITS,shamode>(thrblocks, n_blocks, _bprovider, _id, _hasher, _hashblock);
+	for (unsigned int b = 0; b < n_blocks; b++)
+	  delete thrblocks[b];
+	last_round_us = MonotonicMicros() - t0;
+	control.Observe(last_round_us, _bprovider->jobIntervalMicros());
+	engine_scheduler.Record(_id, (uint64_t)n_blocks << control.Intensity(), last_round_us);
+      } else if (replaying || benchmarking)
+	boost::this_thread::sleep(boost::posix_time::milliseconds(5));
+      else
 	boost::this_thread::sleep(boost::posix_time::seconds(1));
     }
   }
@@ -171,21 +1018,66 @@ public:
   }
 
   void run() {
-    std::cout << "[WORKER" << _id << "] starting" << std::endl;
+    LogPrintf(LOG_INFO, "[WORKER%u] starting", _id);
+
+    /* Ensure that thread is pinned to its allocation.  By default a
+     * GPU worker runs on the CPUs next to its device, so that the
+     * driver's staging buffers and our result buffer (first touched
+     * below) live on the device's NUMA node.  With reserved cores
+     * every worker stays on them, next to the device if possible,
+     * and leaves the rest to the cpu engine. */
+    std::vector<int> cpus;
+    GPUHasher *gpu = NULL;
+    _hasher = new_engine(worker_engines[_id % worker_engines.size()], &gpu);
+
+    if (mapArgs.count("-affinity-worker")) {
+      ParseCPUList(GetArg("-affinity-worker", ""), cpus);
+    }
+#ifndef NO_CUDA
+    else if (gpu != NULL) {
+      char busid[32];
+      int numa_node;
+      if (gpu->GetPCIBusId(busid, sizeof(busid)) == 0 && GetPCIDeviceLocality(busid, cpus, &numa_node))
+	LogPrintf(LOG_INFO, "[WORKER%u] GPU %s is on NUMA node %d", _id, busid, numa_node);
+    }
+#endif
+    if (!mapArgs.count("-affinity-worker") && !reserved_cpus.empty()) {
+      std::vector<int> near;
+      for (size_t i = 0; i < cpus.size(); i++)
+	if (std::find(reserved_cpus.begin(), reserved_cpus.end(), cpus[i]) != reserved_cpus.end())
+	  near.push_back(cpus[i]);
+      cpus = near.empty() ? reserved_cpus : near;
+    }
+    if (!cpus.empty()) {
+      if (SetThreadAffinity(cpus))
+	LogPrintf(LOG_INFO, "[WORKER%u] pinned to CPUs %s", _id, FormatCPUList(cpus).c_str());
+      else
+	LogPrintf(LOG_WARN, "[WORKER%u] could not pin to CPUs %s", _id, FormatCPUList(cpus).c_str());
+    }
 
-    /* Ensure that thread is pinned to its allocation */
-    _hashblock = (uint64_t *)malloc(sizeof(uint64_t) * GPUHasher::N_RESULTS);
-    _gpu = new GPUHasher(gpu_device_id);
-    _gpu->Initialize();
+    if (_hasher->Initialize() != 0) {
+      LogPrintf(LOG_ERROR, "[WORKER%u] engine failed to initialize", _id);
+      exit(EXIT_FAILURE);
+    }
+    if (!skip_selftest) {
+      char who[32];
+      snprintf(who, sizeof(who), "[WORKER%u]", _id);
+      if (!selftest_engine(_hasher, who, false)) {
+	LogPrintf(LOG_ERROR, "%s refusing to mine", who);
+	exit(EXIT_FAILURE);
+      }
+    }
+    _hashblock = (uint64_t *)malloc(sizeof(uint64_t) * Hasher::N_RESULTS * batch_size);
+    memset(_hashblock, 0, sizeof(uint64_t) * Hasher::N_RESULTS * batch_size);
 
     _master->wait_for_master();
-    std::cout << "[WORKER" << _id << "] GoGoGo!" << std::endl;
+    LogPrintf(LOG_INFO, "[WORKER%u] GoGoGo!", _id);
     boost::this_thread::sleep(boost::posix_time::seconds(1));
     if (use_avxsse4)
       mineloop_start<AVXSSE4>(); // <-- work loop
     else
       mineloop_start<SPHLIB>(); // ^
-    std::cout << "[WORKER" << _id << "] Bye Bye!" << std::endl;
+    LogPrintf(LOG_INFO, "[WORKER%u] Bye Bye!", _id);
   }
 
   void work() { // called from within master thread
@@ -197,19 +1089,40 @@ protected:
   unsigned int _id;
   CMasterThreadStub *_master;
   CBlockProviderGW  *_bprovider;
-  GPUHasher *_gpu;
+  Hasher *_hasher;
   uint64_t *_hashblock;
   boost::thread _thread;
 };
 
+/* One connection to the pool, with an io_service of its own for
+ * connecting with a timeout */
+struct CPoolSession {
+  CPoolSession(unsigned int _id) : id(_id), reject_counter(0) {}
+  unsigned int id;
+  boost::asio::io_service io_service;
+  boost::scoped_ptr<boost::asio::ip::tcp::socket> socket;
+  CPoolFrameReader reader;
+  int reject_counter;
+};
+
 class CMasterThread : public CMasterThreadStub {
 public:
 
-  CMasterThread(CBlockProviderGW *bprovider) : CMasterThreadStub(), _bprovider(bprovider) {}
+  CMasterThread(CBlockProviderGW *bprovider) : CMasterThreadStub(), _bprovider(bprovider), _next_session_id(1),
+    _reconnect(dns_ttl, reconnect_min_us, reconnect_max_us, (uint32_t)(MonotonicMicros() ^ time(NULL) ^ (miner_id << 20))),
+    _connect_after_us(0), _drain_deadline_us(0), _drain_done(false) {}
 
   void run() {
     bool devmine = true;
 
+    if (mapArgs.count("-affinity-master")) {
+      std::vector<int> cpus;
+      if (ParseCPUList(GetArg("-affinity-master", ""), cpus) && SetThreadAffinity(cpus))
+	LogPrintf(LOG_INFO, "[MASTER] pinned to CPUs %s", FormatCPUList(cpus).c_str());
+    } else if (!reserved_cpus.empty() && SetThreadAffinity(reserved_cpus)) {
+      LogPrintf(LOG_INFO, "[MASTER] pinned to reserved CPUs %s", FormatCPUList(reserved_cpus).c_str());
+    }
+
     /* This is the developer fund.
      * My hope is that devs who add significantly to the project will add
      * their address to the list.  The 1% developer share (or as configured)
@@ -236,7 +1149,7 @@ public:
 
     {
       boost::unique_lock<boost::shared_mutex> lock(_mutex_master);
-      std::cout << "spawning " << thread_num_max << " worker thread(s)" << std::endl;
+      LogPrintf(LOG_INFO, "spawning %u worker thread(s)", (unsigned int)thread_num_max);
       
       for (unsigned int i = 0; i < thread_num_max; ++i) {
 	CWorkerThread *worker = new CWorkerThread(this, i, _bprovider);
@@ -244,190 +1157,107 @@ public:
       }
     }
 
-    boost::asio::io_service io_service;
-    boost::asio::ip::tcp::resolver resolver(io_service); //resolve dns
-    boost::asio::ip::tcp::resolver::query query("ptsmine.beeeeer.org", "1337");
-    //boost::asio::ip::tcp::resolver::query query("127.0.0.1", "1337");
-    boost::asio::ip::tcp::resolver::iterator endpoint;
-    boost::asio::ip::tcp::resolver::iterator end;
-    boost::asio::ip::tcp::no_delay nd_option(true);
-    boost::asio::socket_base::keep_alive ka_option(true);
+    start_metrics();
+    if (replaying) {
+      replay(GetArg("-replay", ""));
+      return;
+    }
+    if (benchmarking) {
+      benchmark(GetArg("-benchmark", 0) > 0 ? GetArg("-benchmark", 0) : 4);
+      return;
+    }
 
+    /* The session for the other side of the dev/user split is
+     * connected PRECONNECT_SECONDS ahead of the switch, so that work
+     * hands over from one session to the next without the workers
+     * going idle.  The old session is drained for DRAIN_SECONDS:
+     * shares on its work are still written to it and answered. */
+    boost::shared_ptr<CPoolSession> session;
+    uint64_t lost_us = 0;
     while (running) {
-      endpoint = resolver.resolve(query);
-      boost::scoped_ptr<boost::asio::ip::tcp::socket> socket;
-      boost::system::error_code error_socket = boost::asio::error::host_not_found;
-      while (error_socket && endpoint != end)
-	{
-	  //socket->close();
-	  socket.reset(new boost::asio::ip::tcp::socket(io_service));
-	  boost::asio::ip::tcp::endpoint tcp_ep = *endpoint++;
-	  socket->connect(tcp_ep, error_socket);
-	  std::cout << "connecting to " << tcp_ep << std::endl;
+      if (!session) {
+	session = connect_session(devmine);
+	if (!session) {
+	  sleep_backoff(true);
+	  continue;
+	}
+	if (lost_us != 0) {
+	  uint64_t down_us = MonotonicMicros() - lost_us;
+	  if (metrics_enabled)
+	    hist_reconnect.Observe(down_us);
+	  LogPrintf(LOG_INFO, "[MASTER] reconnected %.1f s after losing the pool", down_us / 1e6);
+	  lost_us = 0;
 	}
-      socket->set_option(nd_option);
-      socket->set_option(ka_option);
-      
-      if (error_socket) {
-	std::cout << error_socket << std::endl;
-	boost::this_thread::sleep(boost::posix_time::seconds(10));
-	continue;
-      } else {
-	t_start = boost::posix_time::second_clock::local_time();
-	totalCollisionCount = 0;
-	totalShareCount = 0;
       }
-      
+
+      t_start = boost::posix_time::second_clock::local_time();
+      stats_start.take();
+      if (trace_writer != NULL)
+	trace_writer->Record(TRACE_CONNECT, &session->id, 4);
       std::string pu;
       if (!devmine) {
 	pu = pool_username;
-	std::cout << "Mining for approx " << usertime << " seconds to create shiny coins for user" << std::endl;
+	LogPrintf(LOG_INFO, "Mining for approx %d seconds to create shiny coins for user", usertime);
       } else {
-	std::cout << "Mining for approx " << devtime << " seconds to support further development" << std::endl;
+	LogPrintf(LOG_INFO, "Mining for approx %d seconds to support further development", devtime);
 	pu = donation_addrs[which_donation];
 	which_donation++;
 	which_donation %= n_donations;
       }
-      std::cout << "Payments to: " << pu << std::endl;
-
-      { //send hello message
-	char* hello = new char[pool_username.length()+/*v0.2/0.3=*/2+/*v0.4=*/20+/*v0.7=*/1+pool_password.length()];
-	memcpy(hello+1, pool_username.c_str(), pool_username.length());
-	*((unsigned char*)hello) = pool_username.length();
-	*((unsigned char*)(hello+pool_username.length()+1)) = 0; //hi, i'm v0.4+
-	*((unsigned char*)(hello+pool_username.length()+2)) = VERSION_MAJOR;
-	*((unsigned char*)(hello+pool_username.length()+3)) = VERSION_MINOR;
-	*((unsigned char*)(hello+pool_username.length()+4)) = thread_num_max;
-	*((unsigned char*)(hello+pool_username.length()+5)) = fee_to_pay;
-	*((unsigned short*)(hello+pool_username.length()+6)) = miner_id;
-	*((unsigned int*)(hello+pool_username.length()+8)) = 0;
-	*((unsigned int*)(hello+pool_username.length()+12)) = 0;
-	*((unsigned int*)(hello+pool_username.length()+16)) = 0;
-	*((unsigned char*)(hello+pool_username.length()+20)) = pool_password.length();
-	memcpy(hello+pool_username.length()+21, pool_password.c_str(), pool_password.length());
-	*((unsigned short*)(hello+pool_username.length()+21+pool_password.length())) = 0; //EXTENSIONS
-	boost::system::error_code error;
-	socket->write_some(boost::asio::buffer(hello, pool_username.length()+2+20+1+pool_password.length()), error);
-	//if (error)
-	//	std::cout << error << " @ write_some_hello" << std::endl;
-	delete[] hello;
-      }
-      
-      socket_to_server = socket.get(); //TODO: lock/mutex
-      
-      int reject_counter = 0;
-      bool done = false;
-      bool miner_switch = false; /* no reconnect delay on switch */
-
-      while (!done) {
+      LogPrintf(LOG_INFO, "Payments to: %s", pu.c_str());
+      _bprovider->addSession(session->id, session->socket.get());
+      socket_to_server = session->socket.get(); //TODO: lock/mutex
 
+      boost::shared_ptr<CPoolSession> next;
+      while (running) {
 	boost::posix_time::ptime t_now = boost::posix_time::second_clock::local_time();
 	int thresh = devtime;
 	if (!devmine) { thresh = usertime; }
+	int elapsed = (t_now - t_start).total_seconds();
 
-	if ((t_now - t_start).total_seconds() > thresh) {
-	  miner_switch = true;
-	  devmine = !devmine;
-	  break;
-	}
-	
-
-
-	int type = -1;
-	{ //get the data header
-	  unsigned char buf = 0; //get header
-	  boost::system::error_code error;
-	  size_t len = boost::asio::read(*socket_to_server, boost::asio::buffer(&buf, 1), boost::asio::transfer_all(), error);
-	  if (error == boost::asio::error::eof)
-	    break; // Connection closed cleanly by peer.
-	  else if (error) {
-	    //std::cout << error << " @ read_some1" << std::endl;
-	    break;
-	  }
-	  type = buf;
-	  if (len != 1)
-	    std::cout << "error on read1: " << len << " should be " << 1 << std::endl;
-	}
-	
-	switch (type) {
-	case 0: {
-	  size_t buf_size = 112; //*thread_num_max;
-	  unsigned char* buf = new unsigned char[buf_size]; //get header
-	  boost::system::error_code error;
-	  size_t len = boost::asio::read(*socket_to_server, boost::asio::buffer(buf, buf_size), boost::asio::transfer_all(), error);
-	  if (error == boost::asio::error::eof) {
-	    done = true;
-	    break; // Connection closed cleanly by peer.
-	  } else if (error) {
-	    //std::cout << error << " @ read2a" << std::endl;
-	    done = true;
-	    break;
-	  }
-	  if (len == buf_size) {
-	    _bprovider->setBlocksFromData(buf);
-	    std::cout << "[MASTER] work received - ";
-	    if (_bprovider->getOriginalBlock() != NULL) print256("sharetarget", (uint32_t*)(_bprovider->getOriginalBlock()->targetShare));
-	    else std::cout << "<NULL>" << std::endl;
-	  } else
-	    std::cout << "error on read2a: " << len << " should be " << buf_size << std::endl;
-	  delete[] buf;
-	} break;
-	case 1: {
-	  size_t buf_size = 4;
-	  int buf; //get header
-	  boost::system::error_code error;
-	  size_t len = boost::asio::read(*socket_to_server, boost::asio::buffer(&buf, buf_size), boost::asio::transfer_all(), error);
-	  if (error == boost::asio::error::eof) {
-	    done = true;
-	    break; // Connection closed cleanly by peer.
-	  } else if (error) {
-	    //std::cout << error << " @ read2b" << std::endl;
-	    done = true;
+	if (elapsed > thresh - PRECONNECT_SECONDS && !_connector)
+	  start_connect(!devmine);
+	if (elapsed > thresh) {
+	  next = take_connected();
+	  if (next)
 	    break;
-	  }
-	  if (len == buf_size) {
-	    int retval = buf > 1000 ? 1 : buf;
-	    std::cout << "[MASTER] submitted share -> " <<
-	      (retval == 0 ? "REJECTED" : retval < 0 ? "STALE" : retval ==
-	       1 ? "BLOCK" : "SHARE") << std::endl;
-	    if (retval > 0)
-	      reject_counter = 0;
-	    else
-	      reject_counter++;
-	    if (reject_counter >= 3) {
-	      std::cout << "too many rejects (3) in a row, forcing reconnect." << std::endl;
-	      socket->close();
-	      done = true;
-	    }
-	    {
-	      std::map<int,unsigned long>::iterator it = statistics.find(retval);
-	      if (it == statistics.end())
-		statistics.insert(std::pair<int,unsigned long>(retval,1));
-	      else
-		statistics[retval]++;
-	      stats_running();
-	    }
-	  } else
-	    std::cout << "error on read2b: " << len << " should be " << buf_size << std::endl;
-	} break;
-	case 2: {
-	  //PING-PONG EVENT, nothing to do
-	} break;
-	default: {
-	  //std::cout << "unknown header type = " << type << std::endl;
-	}
 	}
+	end_drain(false);
+	if (!read_message(*session, false))
+	  break;
+      }
+
+      if (next) {
+	/* The workers keep hashing the old session's work until the new
+	 * one's first job replaces it. */
+	LogPrintf(LOG_INFO, "[MASTER] switching to session %u, draining session %u", next->id, session->id);
+	start_drain(session);
+	session = next;
+	devmine = !devmine;
+	continue;
       }
 
       _bprovider->setBlockTo(NULL);
-      socket_to_server = NULL; //TODO: lock/mutex		
-      if (!miner_switch) {
-	std::cout << "no connection to the server, reconnecting in 10 seconds" << std::endl;
-	boost::this_thread::sleep(boost::posix_time::seconds(10));
+      socket_to_server = NULL; //TODO: lock/mutex
+      _bprovider->removeSession(session->id);
+      if (trace_writer != NULL)
+	trace_writer->Record(TRACE_DISCONNECT, &session->id, 4);
+      session.reset();
+      lost_us = MonotonicMicros();
+      if (_connector) {
+	_connector->join();
+	_connector.reset();
+	_connected.reset();
       }
+      /* Not straight back:  every miner of the pool may have lost it
+       * at this same moment */
+      if (running)
+	sleep_backoff(false);
     }
+    end_drain(true);
   }
 
+
   ~CMasterThread() {}
 
   void wait_for_master() {
@@ -444,7 +1274,533 @@ private:
     boost::unique_lock<boost::shared_mutex> lock(_mutex_working);
   }
 
+  static const int PRECONNECT_SECONDS = 10;
+  static const int DRAIN_SECONDS = 10;
+
+  static void connect_done(const boost::system::error_code& error, boost::system::error_code *result) {
+    *result = error;
+  }
+
+  static void connect_expired(const boost::system::error_code& error, boost::asio::ip::tcp::socket *socket, bool *expired) {
+    if (error == boost::asio::error::operation_aborted)
+      return;
+    *expired = true;
+    boost::system::error_code ignored;
+    socket->close(ignored);
+  }
+
+  /* A connect that gives up after -connecttimeout */
+  boost::system::error_code connect_endpoint(CPoolSession& session, const boost::asio::ip::tcp::endpoint& ep) {
+    session.socket.reset(new boost::asio::ip::tcp::socket(session.io_service));
+    boost::asio::deadline_timer timer(session.io_service);
+    boost::system::error_code error = boost::asio::error::would_block;
+    bool expired = false;
+    session.io_service.reset();
+    session.socket->async_connect(ep, boost::bind(connect_done, boost::asio::placeholders::error, &error));
+    timer.expires_from_now(boost::posix_time::microseconds(connect_timeout_us));
+    timer.async_wait(boost::bind(connect_expired, boost::asio::placeholders::error, session.socket.get(), &expired));
+    while (error == boost::asio::error::would_block)
+      session.io_service.run_one();
+    timer.cancel();
+    session.io_service.run();
+    return expired ? boost::asio::error::timed_out : error;
+  }
+
+  /* Connects a new session and says hello; empty if the pool can't
+   * be reached at any of its addresses.  Runs on the master or, ahead
+   * of a switch, on the connector thread, never on both at once. */
+  boost::shared_ptr<CPoolSession> connect_session(bool devmine) {
+    boost::shared_ptr<CPoolSession> session(new CPoolSession(_next_session_id++));
+    uint64_t now = MonotonicMicros();
+    if (!_reconnect.CacheFresh(now)) {
+      boost::asio::ip::tcp::resolver resolver(session->io_service); //resolve dns
+      boost::asio::ip::tcp::resolver::query query(pool_host, pool_port);
+      boost::system::error_code error;
+      boost::asio::ip::tcp::resolver::iterator endpoint = resolver.resolve(query, error);
+      if (!error)
+	_reconnect.StoreEndpoints(endpoint, now);
+      else if (_reconnect.Endpoints().empty()) {
+	LogPrintf(LOG_WARN, "could not resolve %s: %s", pool_host.c_str(), error.message().c_str());
+	return boost::shared_ptr<CPoolSession>();
+      } else
+	LogPrintf(LOG_WARN, "could not resolve %s (%s), trying the cached addresses", pool_host.c_str(), error.message().c_str());
+    }
+
+    /* Every address in turn, without waiting in between */
+    std::vector<boost::asio::ip::tcp::endpoint> endpoints = _reconnect.Endpoints();
+    boost::system::error_code error_socket = boost::asio::error::host_not_found;
+    for (size_t i = 0; i < endpoints.size() && error_socket; i++) {
+      LogPrintf(LOG_INFO, "connecting to %s", boost::lexical_cast<std::string>(endpoints[i]).c_str());
+      error_socket = connect_endpoint(*session, endpoints[i]);
+      if (error_socket)
+	LogPrintf(LOG_WARN, "%s", error_socket.message().c_str());
+      else
+	_reconnect.Connected(endpoints[i]);
+    }
+    if (error_socket)
+      return boost::shared_ptr<CPoolSession>();
+    boost::system::error_code error;
+    session->socket->set_option(boost::asio::ip::tcp::no_delay(true), error);
+    session->socket->set_option(boost::asio::socket_base::keep_alive(true), error);
+    stat_add(STAT_SHARD_MASTER, STAT_RECONNECTS);
+
+    { //send hello message
+      PoolHello hello;
+      hello.username = pool_username;
+      hello.password = pool_password;
+      hello.version_major = VERSION_MAJOR;
+      hello.version_minor = VERSION_MINOR;
+      hello.threads = thread_num_max;
+      hello.fee = fee_to_pay;
+      hello.miner_id = miner_id;
+      unsigned char msg[PROTO_MAX_HELLO_SIZE];
+      boost::asio::write(*session->socket, boost::asio::buffer(msg, EncodeHello(hello, msg)), boost::asio::transfer_all(), error);
+    }
+    if (error) {
+      LogPrintf(LOG_WARN, "%s", error.message().c_str());
+      return boost::shared_ptr<CPoolSession>();
+    }
+    LogPrintf(LOG_DEBUG, "[MASTER] session %u connected for %s", session->id, devmine ? "development" : "user");
+    return session;
+  }
+
+  void connector_main(bool devmine) {
+    _connected = connect_session(devmine);
+  }
+
+  void start_connect(bool devmine) {
+    if (MonotonicMicros() < _connect_after_us)
+      return;
+    _connector.reset(new boost::thread(boost::bind(&CMasterThread::connector_main, this, devmine)));
+  }
+
+  /* The connector's session, once it's done; a failed attempt is
+   * retried after the backoff. */
+  boost::shared_ptr<CPoolSession> take_connected() {
+    boost::shared_ptr<CPoolSession> session;
+    if (!_connector || !_connector->timed_join(boost::posix_time::seconds(0)))
+      return session;
+    _connector.reset();
+    session.swap(_connected);
+    if (!session)
+      _connect_after_us = MonotonicMicros() + _reconnect.NextDelay(true);
+    return session;
+  }
+
+  void sleep_backoff(bool round_failed) {
+    uint64_t delay_us = _reconnect.NextDelay(round_failed);
+    LogPrintf(LOG_WARN, "no connection to the server, reconnecting in %.1f seconds", delay_us / 1e6);
+    boost::this_thread::sleep(boost::posix_time::microseconds(delay_us));
+  }
+
+  void drain_main(boost::shared_ptr<CPoolSession> session) {
+    while (read_message(*session, true))
+      ;
+    _drain_done = true;
+  }
+
+  void start_drain(boost::shared_ptr<CPoolSession> session) {
+    end_drain(true);
+    _draining = session;
+    _drain_deadline_us = MonotonicMicros() + DRAIN_SECONDS * 1000000ULL;
+    _drain_done = false;
+    _drainer.reset(new boost::thread(boost::bind(&CMasterThread::drain_main, this, session)));
+  }
+
+  /* Retires the drained session once its time is up (or at once if
+   * forced).  It's unregistered first, so no share is being written
+   * when the socket is shut down under the drain thread's read. */
+  void end_drain(bool force) {
+    if (!_draining || (!force && !_drain_done && MonotonicMicros() < _drain_deadline_us))
+      return;
+    _bprovider->removeSession(_draining->id);
+    boost::system::error_code error;
+    _draining->socket->shutdown(boost::asio::ip::tcp::socket::shutdown_both, error);
+    _drainer->join();
+    _drainer.reset();
+    _draining->socket->close(error);
+    if (trace_writer != NULL)
+      trace_writer->Record(TRACE_DISCONNECT, &_draining->id, 4);
+    LogPrintf(LOG_DEBUG, "[MASTER] session %u closed", _draining->id);
+    _draining.reset();
+  }
+
+  /* Reads and handles one message from the pool.  A draining session
+   * only answers shares; its work is ignored.  Returns false once the
+   * session is over. */
+  bool read_message(CPoolSession& session, bool draining) {
+    int type = -1;
+    const unsigned char *payload = NULL;
+    while (!session.reader.Next(&type, &payload)) {
+      boost::system::error_code error;
+      unsigned char *space = session.reader.Space();
+      size_t len = session.socket->read_some(boost::asio::buffer(space, session.reader.SpaceSize()), error);
+      if (error) // including eof, connection closed cleanly by peer
+	return false;
+      session.reader.Commit(len);
+    }
+
+    switch (type) {
+    case PROTO_WORK: {
+      if (draining)
+	break; /* superseded by the session we switched to */
+      if (trace_writer != NULL)
+	trace_writer->Record(TRACE_WORK, payload, PROTO_WORK_SIZE);
+      _bprovider->setBlocksFromData(payload, session.id);
+      _reconnect.Established();
+      if (_bprovider->getOriginalBlock() != NULL)
+	LogPrintf(LOG_INFO, "[MASTER] work received - sharetarget: %s", format256((uint32_t*)(_bprovider->getOriginalBlock()->targetShare)).c_str());
+      else
+	LogPrintf(LOG_INFO, "[MASTER] work received - <NULL>");
+    } break;
+    case PROTO_RESULT: {
+      int buf = DecodeResult(payload);
+      if (trace_writer != NULL) {
+	unsigned char rec[4+PROTO_RESULT_SIZE];
+	uint32_t id = session.id;
+	memcpy(rec, &id, 4);
+	memcpy(rec + 4, payload, PROTO_RESULT_SIZE);
+	trace_writer->Record(TRACE_RESPONSE, rec, sizeof(rec));
+      }
+      int retval = buf > 1000 ? 1 : buf;
+      LogPrintf(retval > 0 ? LOG_INFO : LOG_WARN, "[MASTER] submitted share -> %s",
+		(retval == 0 ? "REJECTED" : retval < 0 ? "STALE" : retval ==
+		 1 ? "BLOCK" : "SHARE"));
+      stat_add(STAT_SHARD_MASTER, retval < 0 ? STAT_STALE : retval == 0 ? STAT_REJECTED :
+	       retval == 1 ? STAT_BLOCKS : STAT_ACCEPTED);
+      uint64_t ack_us = 0;
+      unsigned int ack_worker = 0;
+      bool acked = metrics_enabled && _bprovider->shareAcknowledged(session.id, &ack_us, &ack_worker);
+      if (stats_stream != NULL)
+	stats_stream->Emit(share_json(retval < 0 ? "stale" : retval == 0 ? "rejected" : retval == 1 ? "block" : "accepted",
+				      retval < 0 ? "pool_stale" : retval == 0 ? "pool_rejected" : "",
+				      acked ? (int)ack_worker : -1, buf, ack_us));
+      /* t_start and stats_start are the master's; a drained answer is
+       * counted above and shows up in the master's next line */
+      if (!draining)
+	stats_running();
+      if (retval > 0)
+	session.reject_counter = 0;
+      else
+	session.reject_counter++;
+      if (session.reject_counter >= 3 && !draining) {
+	LogPrintf(LOG_WARN, "too many rejects (3) in a row, forcing reconnect.");
+	return false;
+      }
+    } break;
+    case PROTO_PING: {
+      //PING-PONG EVENT, nothing to do
+    } break;
+    default: {
+      //std::cout << "unknown header type = " << type << std::endl;
+    }
+    }
+    return true;
+  }
+
   CBlockProviderGW  *_bprovider;
+  boost::atomic<unsigned int> _next_session_id;
+  CReconnectPolicy _reconnect;
+  /* The next session, being connected ahead of a switch */
+  boost::scoped_ptr<boost::thread> _connector;
+  boost::shared_ptr<CPoolSession> _connected;
+  uint64_t _connect_after_us;
+  /* The session switched away from, still answering shares */
+  boost::shared_ptr<CPoolSession> _draining;
+  boost::scoped_ptr<boost::thread> _drainer;
+  uint64_t _drain_deadline_us;
+  boost::atomic<bool> _drain_done;
+
+  /* The metrics endpoint's, run on its own thread; each pool session
+   * has its own (CPoolSession::io_service). */
+  boost::asio::io_service _metrics_io;
+  boost::scoped_ptr<boost::asio::io_service::work> _metrics_work;
+  boost::scoped_ptr<MetricsRegistry> _metrics;
+  boost::scoped_ptr<MetricsServer> _metrics_server;
+
+  static double stat_value(StatCounter c) { return (double)stat_total(c); }
+
+  static double stat_per_minute(StatCounter c) {
+    double minutes = (MonotonicMicros() - process_start_us) / 60e6;
+    return minutes > 0 ? stat_total(c) / minutes : 0;
+  }
+
+  double pending_acks() { return (double)_bprovider->pendingAcks(); }
+  double queued_shares() { return (double)_bprovider->queuedShares(); }
+  static double log_queue_depth() { return (double)LogQueueDepth(); }
+  static double verify_checks(unsigned int w) { return (double)collision_verifier->Checked(w); }
+  static double verify_errors(unsigned int w) { return (double)collision_verifier->Errors(w); }
+  static double verify_error_rate(unsigned int w) { return collision_verifier->ErrorRate(w); }
+  static double verify_health(unsigned int w) { return (double)collision_verifier->GetHealth(w); }
+  static double intensity_of(unsigned int w) { return worker_intensity[w].load(boost::memory_order_relaxed); }
+  static double rate_of(unsigned int w) { return engine_scheduler.Rate(w); }
+  static double share_of(unsigned int w) { return engine_scheduler.Share(w); }
+  static double verify_dropped() { return (double)collision_verifier->Dropped(); }
+  static double spill_value(int which) {
+    SpillStats spill = GetSpillStats();
+    uint64_t values[6] = { spill.bytes_written, spill.bytes_read, spill.hash_us, spill.write_us, spill.read_us, spill.dedup_us };
+    return which < 2 ? (double)values[which] : values[which] / 1e6;
+  }
+  static void run_io_service(boost::asio::io_service *io_service) { io_service->run(); }
+
+  void start_metrics() {
+    int port = GetArg("-metricsport", 0);
+    if (port <= 0)
+      return;
+    MetricsRegistry *m = new MetricsRegistry;
+    _metrics.reset(m);
+    m->AddCounter("cudapts_collisions_total", "Verified collisions (A/B and B/A count separately)", boost::bind(stat_value, STAT_COLLISIONS));
+    m->AddCounter("cudapts_shares_submitted_total", "Shares written to the pool", boost::bind(stat_value, STAT_SHARES));
+    m->AddCounter("cudapts_share_results_total", "Pool responses to submitted shares", boost::bind(stat_value, STAT_ACCEPTED), "result=\"accepted\"");
+    m->AddCounter("cudapts_share_results_total", "", boost::bind(stat_value, STAT_REJECTED), "result=\"rejected\"");
+    m->AddCounter("cudapts_share_results_total", "", boost::bind(stat_value, STAT_STALE), "result=\"stale\"");
+    m->AddCounter("cudapts_share_results_total", "", boost::bind(stat_value, STAT_BLOCKS), "result=\"block\"");
+    m->AddCounter("cudapts_candidates_total", "Candidate birthdays returned by the engines", boost::bind(stat_value, STAT_CANDIDATES));
+    m->AddCounter("cudapts_rounds_total", "Header variants searched", boost::bind(stat_value, STAT_ROUNDS));
+    m->AddCounter("cudapts_nonces_total", "Momentum nonces hashed", boost::bind(stat_value, STAT_NONCES));
+    m->AddCounter("cudapts_stale_drops_total", "Shares dropped locally because their work was superseded", boost::bind(stat_value, STAT_STALE_DROPS));
+    m->AddCounter("cudapts_duplicate_shares_total", "Shares not sent because the same one already had been", boost::bind(stat_value, STAT_DUPLICATES));
+    m->AddCounter("cudapts_engine_errors_total", "Failed engine calls", boost::bind(stat_value, STAT_ENGINE_ERRORS));
+    m->AddCounter("cudapts_reconnects_total", "Connections made to the pool", boost::bind(stat_value, STAT_RECONNECTS));
+    m->AddGauge("cudapts_collisions_per_minute", "Collisions per minute since start", boost::bind(stat_per_minute, STAT_COLLISIONS));
+    m->AddGauge("cudapts_shares_per_minute", "Shares per minute since start", boost::bind(stat_per_minute, STAT_SHARES));
+    m->AddGauge("cudapts_pending_share_acks", "Shares submitted but not yet answered by the pool", boost::bind(&CMasterThread::pending_acks, this));
+    m->AddGauge("cudapts_submit_queue_depth", "Shares found but not yet written to the pool", boost::bind(&CMasterThread::queued_shares, this));
+    m->AddGauge("cudapts_log_queue_depth", "Log records waiting to be written", log_queue_depth);
+    m->AddHistogram("cudapts_stage_seconds", "Time per pipeline stage, per engine call", &hist_midhash, "stage=\"midhash\"");
+    m->AddHistogram("cudapts_stage_seconds", "", &hist_verify, "stage=\"verify\"");
+    m->AddHistogram("cudapts_stage_seconds", "", &hist_share_ack, "stage=\"share_ack\"");
+    m->AddHistogram("cudapts_reconnect_seconds", "Time from losing the pool to the next working session", &hist_reconnect);
+    for (unsigned int i = 0; i < thread_num_max; i++) {
+      std::stringstream labels;
+      labels << "worker=\"" << i << "\",engine=\"" << worker_device(i) << "\"";
+      m->AddHistogram("cudapts_round_seconds", "Engine time per call (one batch of header variants)", &hist_round[i], labels.str());
+      m->AddGauge("cudapts_intensity", i == 0 ? "log2 of the nonces searched per round" : "", boost::bind(intensity_of, i), labels.str());
+      m->AddGauge("cudapts_engine_hash_rate", i == 0 ? "Smoothed momentum nonces hashed per second" : "", boost::bind(rate_of, i), labels.str());
+      m->AddGauge("cudapts_engine_share", i == 0 ? "Fraction of the summed hash rate" : "", boost::bind(share_of, i), labels.str());
+    }
+    if (collision_verifier != NULL) {
+      for (unsigned int i = 0; i < thread_num_max; i++) {
+	std::stringstream labels;
+	labels << "worker=\"" << i << "\"";
+	bool first = i == 0;
+	m->AddCounter("cudapts_verify_checks_total", first ? "Collisions re-verified on the CPU" : "", boost::bind(verify_checks, i), labels.str());
+	m->AddCounter("cudapts_verify_errors_total", first ? "Re-verified collisions whose birthdays were wrong" : "", boost::bind(verify_errors, i), labels.str());
+	m->AddGauge("cudapts_engine_error_rate", first ? "Recent fraction of re-verified collisions that were wrong" : "", boost::bind(verify_error_rate, i), labels.str());
+	m->AddGauge("cudapts_engine_health", first ? "0 healthy, 1 throttled, 2 quarantined" : "", boost::bind(verify_health, i), labels.str());
+      }
+      m->AddCounter("cudapts_verify_dropped_total", "Collisions not re-verified because the queue was full", verify_dropped);
+    }
+    if (engine_type == "spill") {
+      m->AddCounter("cudapts_spill_bytes_total", "Bucket records written to and read back from the spill file", boost::bind(spill_value, 0), "direction=\"write\"");
+      m->AddCounter("cudapts_spill_bytes_total", "", boost::bind(spill_value, 1), "direction=\"read\"");
+      m->AddCounter("cudapts_spill_seconds_total", "Spill engine time per phase", boost::bind(spill_value, 2), "phase=\"hash\"");
+      m->AddCounter("cudapts_spill_seconds_total", "", boost::bind(spill_value, 3), "phase=\"write\"");
+      m->AddCounter("cudapts_spill_seconds_total", "", boost::bind(spill_value, 4), "phase=\"read\"");
+      m->AddCounter("cudapts_spill_seconds_total", "", boost::bind(spill_value, 5), "phase=\"dedup\"");
+    }
+
+    std::string bind = GetArg("-metricsbind", "127.0.0.1");
+    _metrics_server.reset(new MetricsServer(_metrics_io, *m));
+    if (!_metrics_server->Listen(bind, port)) {
+      LogPrintf(LOG_ERROR, "[MASTER] could not listen for metrics on %s:%d", bind.c_str(), port);
+      _metrics_server.reset();
+      return;
+    }
+    metrics_enabled = true;
+    _metrics_work.reset(new boost::asio::io_service::work(_metrics_io));
+    boost::thread(boost::bind(run_io_service, &_metrics_io)).detach();
+    LogPrintf(LOG_INFO, "[MASTER] metrics on http://%s:%d/metrics", bind.c_str(), port);
+  }
+
+  static double percentile_ms(std::vector<uint64_t>& v, double q) {
+    if (v.empty())
+      return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, (size_t)(q * v.size()))] / 1000.0;
+  }
+
+  /* Sleep until a point on the monotonic clock, unless stopped */
+  static void sleep_until_us(uint64_t when) {
+    while (running) {
+      uint64_t now = MonotonicMicros();
+      if (now >= when)
+	break;
+      boost::this_thread::sleep(boost::posix_time::microseconds(std::min<uint64_t>(when - now, 10000)));
+    }
+  }
+
+  void wait_for_replay_workers(bool finished) {
+    while (running && !_bprovider->replayWorkersAt(finished))
+      boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+  }
+
+  /* -replay: feed a recorded trace's work to the workers in place of
+   * the pool, either at recorded speed scaled by -replayspeed or, with
+   * -replayrounds, a fixed amount of hashing per work unit.  Then
+   * compare what the trace saw with what we found. */
+  void replay(const std::string& path) {
+    CTraceReader reader;
+    if (!reader.Open(path)) {
+      LogPrintf(LOG_ERROR, "[REPLAY] %s is not a readable trace", path.c_str());
+      return;
+    }
+    double speed = atof(GetArg("-replayspeed", "1").c_str());
+    if (speed <= 0)
+      speed = 1;
+    bool by_rounds = GetArg("-replayrounds", 0) > 0;
+
+    std::vector<uint64_t> rec_share_us, rec_ack_us;
+    std::map<uint32_t, std::deque<uint64_t> > rec_pending; /* by session */
+    uint64_t rec_results[4] = { 0, 0, 0, 0 }; /* accepted, rejected, stale, block */
+    uint64_t rec_work_ts = 0, first_work_ts = 0, last_ts = 0;
+    uint64_t start_us = 0;
+    unsigned int n_units = 0;
+    CStatSnapshot before;
+    before.take();
+
+    TraceRecord rec;
+    while (running && reader.Next(&rec)) {
+      last_ts = rec.ts_us;
+      switch (rec.type) {
+      case TRACE_WORK:
+	if (rec.len != 112)
+	  break;
+	if (n_units == 0) {
+	  first_work_ts = rec.ts_us;
+	} else if (by_rounds) {
+	  wait_for_replay_workers(true);
+	} else
+	  sleep_until_us(start_us + (uint64_t)((rec.ts_us - first_work_ts) / speed));
+	rec_work_ts = rec.ts_us;
+	_bprovider->setBlocksFromData(rec.data);
+	if (n_units++ == 0) {
+	  /* engines may take a while to come up; start the clock once
+	   * they're all hashing */
+	  wait_for_replay_workers(false);
+	  start_us = MonotonicMicros();
+	}
+	break;
+      case TRACE_SUBMIT: {
+	if (rec.len != 4+4+88)
+	  break;
+	uint32_t session;
+	memcpy(&session, rec.data + 4, 4);
+	rec_share_us.push_back(rec.ts_us - rec_work_ts);
+	rec_pending[session].push_back(rec.ts_us);
+      } break;
+      case TRACE_RESPONSE: {
+	if (rec.len != 4+PROTO_RESULT_SIZE)
+	  break;
+	uint32_t session;
+	int32_t v;
+	memcpy(&session, rec.data, 4);
+	memcpy(&v, rec.data + 4, 4);
+	int retval = v > 1000 ? 1 : v;
+	rec_results[retval < 0 ? 2 : retval == 0 ? 1 : retval == 1 ? 3 : 0]++;
+	std::deque<uint64_t>& pending = rec_pending[session];
+	if (!pending.empty()) {
+	  rec_ack_us.push_back(rec.ts_us - pending.front());
+	  pending.pop_front();
+	}
+      } break;
+      case TRACE_DISCONNECT: {
+	/* its unanswered shares never will be */
+	uint32_t session;
+	if (rec.len == 4) {
+	  memcpy(&session, rec.data, 4);
+	  rec_pending.erase(session);
+	}
+      } break;
+      }
+    }
+    if (n_units > 0) {
+      if (by_rounds)
+	wait_for_replay_workers(true);
+      else
+	sleep_until_us(start_us + (uint64_t)((last_ts - first_work_ts) / speed));
+    }
+    _bprovider->setBlockTo(NULL);
+
+    CStatSnapshot after;
+    after.take();
+    std::vector<uint64_t> share_us = _bprovider->replayLatencies();
+    double elapsed = n_units > 0 ? (MonotonicMicros() - start_us) / 1e6 : 0;
+    uint64_t shares = after.count[STAT_SHARES] - before.count[STAT_SHARES];
+    LogPrintf(LOG_INFO, "[REPLAY] %u work units in %.1f s (trace covered %.1f s)",
+	      n_units, elapsed, (last_ts - first_work_ts) / 1e6);
+    LogPrintf(LOG_INFO, "[REPLAY] recorded: %u shares, work->share p50 %.1f ms p90 %.1f ms, pool ack p50 %.1f ms p90 %.1f ms, "
+	      "%llu accepted %llu rejected %llu stale %llu blocks",
+	      (unsigned int)rec_share_us.size(), percentile_ms(rec_share_us, 0.5), percentile_ms(rec_share_us, 0.9),
+	      percentile_ms(rec_ack_us, 0.5), percentile_ms(rec_ack_us, 0.9),
+	      (unsigned long long)rec_results[0], (unsigned long long)rec_results[1],
+	      (unsigned long long)rec_results[2], (unsigned long long)rec_results[3]);
+    LogPrintf(LOG_INFO, "[REPLAY] replayed: %llu shares (%.2f per unit), work->share p50 %.1f ms p90 %.1f ms, "
+	      "%llu rounds, %llu collisions, %llu stale drops, %llu engine errors",
+	      (unsigned long long)shares, n_units > 0 ? (double)shares / n_units : 0,
+	      percentile_ms(share_us, 0.5), percentile_ms(share_us, 0.9),
+	      (unsigned long long)(after.count[STAT_ROUNDS] - before.count[STAT_ROUNDS]),
+	      (unsigned long long)(after.count[STAT_COLLISIONS] - before.count[STAT_COLLISIONS]),
+	      (unsigned long long)(after.count[STAT_STALE_DROPS] - before.count[STAT_STALE_DROPS]),
+	      (unsigned long long)(after.count[STAT_ENGINE_ERRORS] - before.count[STAT_ENGINE_ERRORS]));
+  }
+
+  /* -benchmark: a fixed offline workload through the whole pipeline
+   * (midHash, engine, SHA-256 re-check of every collision, target
+   * test, submit), for comparing builds and training the release
+   * build's profile.  Each unit is the self-test header with a
+   * different merkle root and a target every collision meets; each
+   * worker hashes -replayrounds variants of it (default 1). */
+  void benchmark(unsigned int units) {
+    unsigned char data[80+32];
+    memcpy(data, selftest_header, 80);
+    memset(data + 80, 0xff, 32);
+
+    CStatSnapshot before;
+    before.take();
+    SpillStats spill_before = GetSpillStats();
+    uint64_t start_us = 0;
+    for (unsigned int u = 0; u < units && running; u++) {
+      data[36] = (unsigned char)u;
+      if (u > 0)
+	wait_for_replay_workers(true);
+      _bprovider->setBlocksFromData(data);
+      if (u == 0) {
+	wait_for_replay_workers(false);
+	start_us = MonotonicMicros();
+      }
+    }
+    wait_for_replay_workers(true);
+    double elapsed = (MonotonicMicros() - start_us) / 1e6;
+    _bprovider->setBlockTo(NULL);
+
+    CStatSnapshot after;
+    after.take();
+    uint64_t rounds = after.count[STAT_ROUNDS] - before.count[STAT_ROUNDS];
+    uint64_t nonces = after.count[STAT_NONCES] - before.count[STAT_NONCES];
+    LogPrintf(LOG_INFO, "[BENCHMARK] %u units, %llu rounds, %llu collisions, %llu shares, %llu engine errors",
+	      units, (unsigned long long)rounds,
+	      (unsigned long long)(after.count[STAT_COLLISIONS] - before.count[STAT_COLLISIONS]),
+	      (unsigned long long)(after.count[STAT_SHARES] - before.count[STAT_SHARES]),
+	      (unsigned long long)(after.count[STAT_ENGINE_ERRORS] - before.count[STAT_ENGINE_ERRORS]));
+    LogPrintf(LOG_INFO, "[BENCHMARK] %.2f s, %.3f rounds/s, %.2f Mhash/s",
+	      elapsed, elapsed > 0 ? rounds / elapsed : 0,
+	      elapsed > 0 ? nonces / elapsed / 1e6 : 0);
+    if (engine_type == "spill") {
+      SpillStats spill = GetSpillStats();
+      uint64_t written = spill.bytes_written - spill_before.bytes_written;
+      uint64_t read = spill.bytes_read - spill_before.bytes_read;
+      uint64_t write_us = spill.write_us - spill_before.write_us, read_us = spill.read_us - spill_before.read_us;
+      double busy = (double)(spill.hash_us + spill.write_us + spill.read_us + spill.dedup_us
+			     - spill_before.hash_us - spill_before.write_us - spill_before.read_us - spill_before.dedup_us);
+      LogPrintf(LOG_INFO, "[BENCHMARK] spill: %.0f MB written, %.0f MB read, %.1f MB/s, "
+		"hash %.0f%% write %.0f%% read %.0f%% dedup %.0f%%",
+		written / 1e6, read / 1e6, elapsed > 0 ? (written + read) / elapsed / 1e6 : 0,
+		busy > 0 ? (spill.hash_us - spill_before.hash_us) / busy * 100 : 0,
+		busy > 0 ? write_us / busy * 100 : 0, busy > 0 ? read_us / busy * 100 : 0,
+		busy > 0 ? (spill.dedup_us - spill_before.dedup_us) / busy * 100 : 0);
+    }
+  }
 
   boost::shared_mutex _mutex_master;
   boost::shared_mutex _mutex_working;
@@ -452,33 +1808,60 @@ private:
   // Provides real time stats
   void stats_running() {
     if (!running) return;
-    std::cout << std::fixed;
-    std::cout << std::setprecision(1);
+    std::stringstream out;
+    out << std::fixed;
+    out << std::setprecision(1);
     boost::posix_time::ptime t_end = boost::posix_time::second_clock::local_time();
-    unsigned long rejects = 0;
-    unsigned long stale = 0;
-    unsigned long valid = 0;
-    unsigned long blocks = 0;
-    for (std::map<int,unsigned long>::iterator it = statistics.begin(); it != statistics.end(); ++it) {
-      if (it->first < 0) stale += it->second;
-      if (it->first == 0) rejects = it->second;
-      if (it->first == 1) blocks = it->second;
-      if (it->first > 1) valid += it->second;
-    }
-    std::cout << "[STATS] " << t_end << " | ";
+    CStatSnapshot now;
+    now.take();
+    uint64_t rejects = now.count[STAT_REJECTED];
+    uint64_t stale = now.count[STAT_STALE];
+    uint64_t valid = now.count[STAT_ACCEPTED];
+    uint64_t blocks = now.count[STAT_BLOCKS];
+    out << "[STATS] " << t_end << " | ";
     if ((t_end - t_start).total_seconds() > 0) {
-      std::cout << static_cast<double>(totalCollisionCount) / (static_cast<double>((t_end - t_start).total_seconds()) / 60.0) << " c/m | ";
-      std::cout << static_cast<double>(totalShareCount) / (static_cast<double>((t_end - t_start).total_seconds()) / 60.0) << " sh/m | ";			
+      double minutes = static_cast<double>((t_end - t_start).total_seconds()) / 60.0;
+      out << static_cast<double>(now.count[STAT_COLLISIONS] - stats_start.count[STAT_COLLISIONS]) / minutes << " c/m | ";
+      out << static_cast<double>(now.count[STAT_SHARES] - stats_start.count[STAT_SHARES]) / minutes << " sh/m | ";
+      out << static_cast<double>(now.count[STAT_ROUNDS] - stats_start.count[STAT_ROUNDS]) / minutes << " r/m | ";
+    }
+    uint64_t dropped = now.count[STAT_STALE_DROPS] - stats_start.count[STAT_STALE_DROPS];
+    uint64_t duplicates = now.count[STAT_DUPLICATES] - stats_start.count[STAT_DUPLICATES];
+    uint64_t errors = now.count[STAT_ENGINE_ERRORS] - stats_start.count[STAT_ENGINE_ERRORS];
+    if (dropped > 0 || duplicates > 0 || errors > 0)
+      out << "DR: " << dropped << ", DUP: " << duplicates << ", ERR: " << errors << " | ";
+    if (mixed_engines) {
+      for (unsigned int i = 0; i < thread_num_max; i++)
+	out << worker_device(i) << " " << engine_scheduler.Share(i) * 100.0 << "% ";
+      out << "| ";
+    }
+    if (engine_type == "spill" && (t_end - t_start).total_seconds() > 0) {
+      SpillStats spill = GetSpillStats();
+      double seconds = static_cast<double>((t_end - t_start).total_seconds());
+      double busy = static_cast<double>(spill.hash_us + spill.write_us + spill.read_us + spill.dedup_us);
+      if (busy > 0) {
+	out << "SPILL: W " << spill.bytes_written / seconds / 1e6 << " MB/s, R " << spill.bytes_read / seconds / 1e6 << " MB/s, ";
+	out << "hash " << spill.hash_us / busy * 100.0 << "% write " << spill.write_us / busy * 100.0 << "% ";
+	out << "read " << spill.read_us / busy * 100.0 << "% dedup " << spill.dedup_us / busy * 100.0 << "% | ";
+      }
+    }
+    if (collision_verifier != NULL) {
+      uint64_t bad = 0;
+      for (unsigned int i = 0; i < thread_num_max; i++)
+	bad += collision_verifier->Errors(i);
+      if (bad > 0)
+	out << "HWERR: " << bad << " | ";
     }
     if (valid+blocks+rejects+stale > 0) {
-      std::cout << "VL: " << valid+blocks << " (" << (static_cast<double>(valid+blocks) / static_cast<double>(valid+blocks+rejects+stale)) * 100.0 << "%), ";
-      std::cout << "RJ: " << rejects << " (" << (static_cast<double>(rejects) / static_cast<double>(valid+blocks+rejects+stale)) * 100.0 << "%), ";
-      std::cout << "ST: " << stale << " (" << (static_cast<double>(stale) / static_cast<double>(valid+blocks+rejects+stale)) * 100.0 << "%)" << std::endl;
+      out << "VL: " << valid+blocks << " (" << (static_cast<double>(valid+blocks) / static_cast<double>(valid+blocks+rejects+stale)) * 100.0 << "%), ";
+      out << "RJ: " << rejects << " (" << (static_cast<double>(rejects) / static_cast<double>(valid+blocks+rejects+stale)) * 100.0 << "%), ";
+      out << "ST: " << stale << " (" << (static_cast<double>(stale) / static_cast<double>(valid+blocks+rejects+stale)) * 100.0 << "%)";
     } else {
-      std::cout <<  "VL: " << 0 << " (" << 0.0 << "%), ";
-      std::cout <<  "RJ: " << 0 << " (" << 0.0 << "%), ";
-      std::cout <<  "ST: " << 0 << " (" << 0.0 << "%)" << std::endl;
+      out <<  "VL: " << 0 << " (" << 0.0 << "%), ";
+      out <<  "RJ: " << 0 << " (" << 0.0 << "%), ";
+      out <<  "ST: " << 0 << " (" << 0.0 << "%)";
     }
+    LogPrintf(LOG_INFO, "%s", out.str().c_str());
   }
 };
 
@@ -493,6 +1876,11 @@ void exit_handler() {
     socket_to_server = NULL;
   }
   running = false;
+  if (stats_stream != NULL)
+    stats_stream->Close();
+  if (trace_writer != NULL)
+    trace_writer->Close();
+  LogStop();
 }
 
 #if defined(__MINGW32__) || defined(__MINGW64__)
@@ -535,7 +1923,8 @@ void ctrl_handler(int signum) {
 #endif
 
 void print_help(const char* _exec) {
-  std::cerr << "usage: " << _exec << " <payout-address> [cudaDevice] [shamode]" << std::endl;
+  std::cerr << "usage: " << _exec << " [options] <payout-address> [cudaDevice] [shamode]" << std::endl;
+  std::cerr << "       " << _exec << " -selftest [options] [payout-address [cudaDevice]]" << std::endl;
   std::cerr << std::endl;
   std::cerr << "cudaDevice:  0, 1, 2, ... up to how many GPUs you have" << std::endl;
   std::cerr << "shamode: string - mining implementation" << std::endl;
@@ -544,6 +1933,52 @@ void print_help(const char* _exec) {
   std::cerr << "\t\tsse4 --> use SSE4 (Intel optimized)" << std::endl;
   std::cerr << "\t\tsph --> use SPHLIB" << std::endl;
   std::cerr << std::endl;
+  std::cerr << "options:" << std::endl;
+  std::cerr << "\t-batch=<n>\theader variants hashed per engine call (1-" << Hasher::MAX_BATCH << ", default 1)" << std::endl;
+  std::cerr << "\t-intensity=<n|auto>\tsearch 2^n nonces per round, " << Hasher::MIN_INTENSITY << "-" << Hasher::MAX_INTENSITY
+	    << " (default " << Hasher::MAX_INTENSITY << "), or adapt n and the batch to the budgets below" << std::endl;
+  std::cerr << "\t-roundms=<ms>\tauto: longest an engine call should take (default 2000)" << std::endl;
+  std::cerr << "\t-sharems=<ms>\tauto: longest from new work to its shares being sent, 0 = no limit (default 0)" << std::endl;
+  std::cerr << "\t-ntimeroll\tvary nTime instead of nNonce between rounds (old behaviour)" << std::endl;
+  std::cerr << "\t-engine=<gpu|cpu|spill|gpu+cpu>\tsearch engine, or both side by side (default " << DEFAULT_ENGINE << ")" << std::endl;
+  std::cerr << "\t-spilldir=<dir>\twhere -engine=spill keeps its ~600MB bucket file (default /var/tmp)" << std::endl;
+  std::cerr << "\t-cputhreads=<n>\tthreads for the cpu engine (default: all CPUs not reserved)" << std::endl;
+  std::cerr << "\t-reservecores=<n>\tkeep the first n CPUs free of cpu engine threads (default 2 with gpu+cpu, else 0)" << std::endl;
+  std::cerr << "\t-blockthreads=<n>\tthreads per CUDA block (default 64)" << std::endl;
+  std::cerr << "\t-slabs=<n>\tsplit each GPU kernel pass into n launches (default 1)" << std::endl;
+  std::cerr << "\t-filterpower=<n>\tcounting filter of 2^n bits, " << EngineParams::MIN_FILTER_POWER << "-" << EngineParams::MAX_FILTER_POWER << " (default 31)" << std::endl;
+  std::cerr << "\t-autotune\ttry engine settings on synthetic work, save the fastest for this device, then exit" << std::endl;
+  std::cerr << "\t-autotunerounds=<n>\trounds hashed per setting tried (default 4)" << std::endl;
+  std::cerr << "\t-profiles=<file>\ttuned settings cache (default $HOME/.cudapts-profiles)" << std::endl;
+  std::cerr << "\t-noprofile\tdon't load this device's tuned settings" << std::endl;
+  std::cerr << "\t-affinity-worker=<cpus>\tCPUs for the worker threads, e.g. 0-3,8 (default: CPUs next to the GPU)" << std::endl;
+  std::cerr << "\t-affinity-master=<cpus>\tCPUs for the network thread (default: unpinned)" << std::endl;
+  std::cerr << "\t-affinity-verify=<cpus>\tCPUs for the collision re-verification thread (default: unpinned)" << std::endl;
+  std::cerr << "\t-affinity-engine=<cpus>\tCPUs for the cpu engine threads, one thread per CPU (default: all)" << std::endl;
+  std::cerr << "\t-loglevel=<level>\tdebug, info, warn or error (default info)" << std::endl;
+  std::cerr << "\t-lograte=<n>\tmax log lines per second per thread, 0 = unlimited (default 20)" << std::endl;
+  std::cerr << "\t-metricsport=<port>\tserve Prometheus metrics on this port (default off)" << std::endl;
+  std::cerr << "\t-metricsbind=<addr>\taddress for the metrics port (default 127.0.0.1)" << std::endl;
+  std::cerr << "\t-statsjson=<file|unix:path>\tappend JSON stats lines to a file or Unix socket (default off)" << std::endl;
+  std::cerr << "\t-statsinterval=<s>\tseconds between -statsjson interval records (default 60)" << std::endl;
+  std::cerr << "\t-verifyrate=<f>\tfraction of collisions re-checked on the CPU, 0 = off (default 1)" << std::endl;
+  std::cerr << "\t-verifymaxerr=<f>\terror rate that quarantines an engine; half of it throttles (default 0.01)" << std::endl;
+  std::cerr << "\t-verifycooldown=<s>\tseconds a quarantined engine sits out (default 300)" << std::endl;
+  std::cerr << "\t-selftest\tcheck the hashing code and the engine against known answers, then exit" << std::endl;
+  std::cerr << "\t-skipselftest\tdon't run a short engine round on known data before mining" << std::endl;
+  std::cerr << "\t-trace=<file>\trecord work, shares and pool answers to a binary trace" << std::endl;
+  std::cerr << "\t-replay=<file>\tmine a recorded trace offline instead of connecting to the pool" << std::endl;
+  std::cerr << "\t-replayspeed=<x>\treplay at x times recorded speed (default 1)" << std::endl;
+  std::cerr << "\t-replayrounds=<n>\tinstead, hash exactly n variants per worker of each work unit" << std::endl;
+  std::cerr << "\t-benchmark[=<units>]\tmine <units> (default 4) synthetic work units offline and report the rate" << std::endl;
+  std::cerr << "\t-pool=<host:port>\tpool or cudapts-proxy to mine on (default ptsmine.beeeeer.org:1337)" << std::endl;
+  std::cerr << "\t-dnsttl=<s>\tseconds to reuse the pool's resolved addresses (default 300)" << std::endl;
+  std::cerr << "\t-connecttimeout=<s>\tgive up on a pool address after this long (default 10)" << std::endl;
+  std::cerr << "\t-reconnectmin=<ms>\tfirst reconnect backoff limit, doubled per failed round (default 1000)" << std::endl;
+  std::cerr << "\t-reconnectmax=<s>\tlargest reconnect backoff limit; the wait is random below it (default 60)" << std::endl;
+  std::cerr << "\t-partition=<i/n>\tsearch only birthday partition i of n; n nodes on the same work (cudapts-proxy -coop) cover a round" << std::endl;
+  std::cerr << "\t-minerid=<n>\tinstance id (0-" << CNonceAllocator::MAX_INSTANCES-1 << "), unique per process sharing a payout address" << std::endl;
+  std::cerr << std::endl;
   std::cerr << "example:" << std::endl;
   std::cerr << "> " << _exec << " Pr8cnhz5eDsUegBZD4VZmGDARcKaozWbBc 0" << std::endl;
 }
@@ -564,13 +1999,19 @@ int main(int argc, char **argv)
   std::cout << "*** press CTRL+C to exit" << std::endl;
   std::cout << "********************************************" << std::endl;
 	
-  if (argc < 2 || argc > 4)
+  std::vector<std::string> args;
+  ParseParameters(argc, argv, args);
+  bool selftest_only = GetBoolArg("-selftest", false);
+  benchmarking = mapArgs.count("-benchmark") > 0;
+  bool autotuning = GetBoolArg("-autotune", false);
+  if (args.size() < (selftest_only || benchmarking || autotuning ? 0 : 1) || args.size() > 3)
     {
       print_help(argv[0]);
       return EXIT_FAILURE;
     }
 
   t_start = boost::posix_time::second_clock::local_time();
+  process_start_us = MonotonicMicros();
   running = true;
 
 #if defined(__MINGW32__) || defined(__MINGW64__)
@@ -586,12 +2027,30 @@ int main(int argc, char **argv)
   // init everything:
   socket_to_server = NULL;
   thread_num_max = 1;
-  gpu_device_id = atoi(argv[2]); 
+  gpu_device_id = args.size() > 1 ? atoi(args[1].c_str()) : 0;
   COLLISION_TABLE_BITS = 21;
   fee_to_pay = 0; //GetArg("-poolfee", 3);
-  miner_id = 0; //GetArg("-minerid", 0);
-  pool_username = argv[1]; //GetArg("-pooluser", "");
+  miner_id = GetArg("-minerid", 0);
+  pool_username = args.size() > 0 ? args[0] : ""; //GetArg("-pooluser", "");
+  batch_size = GetArg("-batch", 1);
+  roll_ntime = GetBoolArg("-ntimeroll", false);
+  engine_type = GetArg("-engine", DEFAULT_ENGINE);
   pool_password = "notused"; //GetArg("-poolpassword", "");
+  if (!ParseHostPort(GetArg("-pool", "ptsmine.beeeeer.org:1337"), &pool_host, &pool_port))
+    {
+      std::cerr << "usage: " << "-pool must be host:port" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  if (engine_type == "gpu+cpu" || engine_type == "cpu+gpu") {
+    worker_engines.push_back("gpu");
+    worker_engines.push_back("cpu");
+    mixed_engines = true;
+  } else {
+    worker_engines.push_back(engine_type);
+  }
+  thread_num_max = worker_engines.size();
+  engine_scheduler.SetWorkers(thread_num_max);
 	
   if (thread_num_max == 0 || thread_num_max > MAX_THREADS)
     {
@@ -599,10 +2058,209 @@ int main(int argc, char **argv)
       return EXIT_FAILURE;
     }
 
+  if (engine_type != "gpu" && engine_type != "cpu" && engine_type != "spill" && !mixed_engines)
+    {
+      std::cerr << "usage: " << "-engine must be gpu, cpu, spill or gpu+cpu" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+#ifdef NO_CUDA
+  if (engine_type != "cpu" && engine_type != "spill")
+    {
+      std::cerr << "usage: " << "this build has no CUDA support, only -engine=cpu or spill" << std::endl;
+      return EXIT_FAILURE;
+    }
+#endif
+
+  /* By default a mixed run keeps one core for the GPU worker and one
+   * for the network thread and the verifier, if it has them to spare. */
+  std::vector<int> online_cpus;
+  GetOnlineCPUs(online_cpus);
+  int64_t reserve = GetArg("-reservecores", mixed_engines ? std::min<int64_t>(2, (int64_t)online_cpus.size() - 1) : 0);
+  if (reserve < 0 || (reserve > 0 && reserve >= (int64_t)online_cpus.size()))
+    {
+      std::cerr << "usage: " << "-reservecores must leave at least one of the " << online_cpus.size() << " CPUs to the cpu engine" << std::endl;
+      return EXIT_FAILURE;
+    }
+  reserved_cpus.assign(online_cpus.begin(), online_cpus.begin() + reserve);
+  std::vector<int> cpu_engine_cpus;
+  engine_cpu_list(cpu_engine_cpus);
+  cpu_threads = GetArg("-cputhreads", reserve > 0 ? (int64_t)cpu_engine_cpus.size() : (int64_t)boost::thread::hardware_concurrency());
+
+  if (miner_id >= CNonceAllocator::MAX_INSTANCES)
+    {
+      std::cerr << "usage: " << "-minerid must be below " << CNonceAllocator::MAX_INSTANCES << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  if (batch_size == 0 || batch_size > Hasher::MAX_BATCH)
+    {
+      std::cerr << "usage: " << "-batch must be between 1 and " << Hasher::MAX_BATCH << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  std::string intensity_arg = GetArg("-intensity", boost::lexical_cast<std::string>((int)Hasher::MAX_INTENSITY));
+  intensity_setting = intensity_arg == "auto" ? -1 : atoi(intensity_arg.c_str());
+  int64_t round_ms = GetArg("-roundms", 2000);
+  int64_t share_ms = GetArg("-sharems", 0);
+  if ((intensity_setting < Hasher::MIN_INTENSITY || intensity_setting > Hasher::MAX_INTENSITY) && intensity_setting != -1)
+    {
+      std::cerr << "usage: " << "-intensity must be auto or between " << Hasher::MIN_INTENSITY << " and " << Hasher::MAX_INTENSITY << std::endl;
+      return EXIT_FAILURE;
+    }
+  if (round_ms <= 0 || share_ms < 0)
+    {
+      std::cerr << "usage: " << "-roundms must be above 0 and -sharems at least 0" << std::endl;
+      return EXIT_FAILURE;
+    }
+  round_budget_us = round_ms * 1000;
+  share_budget_us = share_ms * 1000;
+
+  std::string partition_arg = GetArg("-partition", "0/1");
+  if (sscanf(partition_arg.c_str(), "%d/%d", &partition_index, &partition_count) != 2 ||
+      partition_count < 1 || partition_count > Hasher::MAX_PARTITIONS ||
+      partition_index < 0 || partition_index >= partition_count)
+    {
+      std::cerr << "usage: " << "-partition must be i/n with 0 <= i < n <= " << Hasher::MAX_PARTITIONS << std::endl;
+      return EXIT_FAILURE;
+    }
+  if (partition_count > 1 && (engine_type != "cpu" || roll_ntime))
+    {
+      std::cerr << "usage: " << "-partition needs -engine=cpu and can't be used with -ntimeroll" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  spill_dir = GetArg("-spilldir", "/var/tmp");
+
+  dns_ttl = GetArg("-dnsttl", 300);
+  connect_timeout_us = GetArg("-connecttimeout", 10) * 1000000;
+  reconnect_min_us = GetArg("-reconnectmin", 1000) * 1000;
+  reconnect_max_us = GetArg("-reconnectmax", 60) * 1000000;
+  if (GetArg("-dnsttl", 300) < 0 || GetArg("-connecttimeout", 10) <= 0 || GetArg("-reconnectmin", 1000) <= 0 ||
+      GetArg("-reconnectmax", 60) <= 0 || reconnect_max_us < reconnect_min_us)
+    {
+      std::cerr << "usage: " << "-dnsttl must be at least 0, -connecttimeout and -reconnectmin above 0, "
+		<< "-reconnectmax at least -reconnectmin" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  LogLevel log_level = LOG_INFO;
+  if (!LogParseLevel(GetArg("-loglevel", "info").c_str(), &log_level))
+    {
+      std::cerr << "usage: " << "-loglevel must be debug, info, warn or error" << std::endl;
+      return EXIT_FAILURE;
+    }
+  LogStart(log_level, GetArg("-lograte", 20));
+
+  /* Tuned settings for this device, unless the command line names them */
+  std::string profile_path = GetArg("-profiles", DefaultProfilePath());
+  EngineProfile profile;
+  /* With mixed engines the first (GPU) one's profile sets the shared
+   * settings and the cpu one's only its thread count.  A thread count
+   * tuned without reserved cores would crowd them, so it's capped. */
+  for (size_t i = 0; i < worker_engines.size() && !autotuning && !GetBoolArg("-noprofile", false); i++) {
+    if (!LoadEngineProfile(profile_path, profile_key(worker_engines[i]), &profile))
+      continue;
+    LogPrintf(LOG_INFO, "using tuned %s settings from %s: %s", worker_engines[i].c_str(), profile_path.c_str(), profile.Format().c_str());
+    if (i == 0) {
+      if (!mapArgs.count("-batch"))
+	batch_size = profile.batch;
+      engine_params = profile.params;
+    }
+    if (worker_engines[i] == "cpu" && !mapArgs.count("-cputhreads"))
+      cpu_threads = reserve > 0 ? std::min<int>(profile.cpu_threads, cpu_engine_cpus.size()) : profile.cpu_threads;
+  }
+  engine_params.block_threads = GetArg("-blockthreads", engine_params.block_threads);
+  engine_params.slabs = GetArg("-slabs", engine_params.slabs);
+  engine_params.filter_power = GetArg("-filterpower", engine_params.filter_power);
+  if (!engine_params.Valid())
+    {
+      std::cerr << "usage: " << "-blockthreads and -slabs must be powers of two with a product of at most 2048, "
+		<< "-filterpower between " << EngineParams::MIN_FILTER_POWER << " and " << EngineParams::MAX_FILTER_POWER << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  std::string stats_target = GetArg("-statsjson", "");
+  if (!stats_target.empty()) {
+    stats_stream = new CStatsStream();
+    if (!stats_stream->Open(stats_target, GetArg("-statsinterval", 60), stats_json_interval)) {
+      std::cerr << "could not open -statsjson target " << stats_target << std::endl;
+      return EXIT_FAILURE;
+    }
+    metrics_enabled = true;
+  }
+
+  if (!selftest_host())
+    return EXIT_FAILURE;
+  skip_selftest = GetBoolArg("-skipselftest", false);
+
+  double verify_rate = atof(GetArg("-verifyrate", "1").c_str());
+  if (verify_rate > 0) {
+    collision_verifier = new CCollisionVerifier(verify_rate, atof(GetArg("-verifymaxerr", "0.01").c_str()),
+						GetArg("-verifycooldown", 300));
+    std::vector<int> cpus;
+    if (mapArgs.count("-affinity-verify"))
+      ParseCPUList(GetArg("-affinity-verify", ""), cpus);
+    else
+      cpus = reserved_cpus;
+    collision_verifier->Start(cpus);
+  }
+  if (selftest_only) {
+    std::string error;
+    if (!SelfTestReconnect(&error)) {
+      LogPrintf(LOG_ERROR, "[SELFTEST] reconnect backoff: %s", error.c_str());
+      return EXIT_FAILURE;
+    }
+    GPUHasher *gpu;
+    for (size_t i = 0; i < worker_engines.size(); i++) {
+      Hasher *hasher = new_engine(worker_engines[i], &gpu);
+      if (hasher->Initialize() != 0 || !selftest_engine(hasher, "[SELFTEST]", true))
+	return EXIT_FAILURE;
+      delete hasher;
+    }
+    LogPrintf(LOG_INFO, "[SELFTEST] all checks passed");
+    return EXIT_SUCCESS;
+  }
+
+  if (autotuning && mixed_engines)
+    {
+      std::cerr << "usage: " << "-autotune one engine at a time (-engine=gpu, then -engine=cpu)" << std::endl;
+      return EXIT_FAILURE;
+    }
+  if (autotuning && engine_type == "spill")
+    {
+      std::cerr << "usage: " << "-autotune has nothing to tune for -engine=spill" << std::endl;
+      return EXIT_FAILURE;
+    }
+  if (autotuning && partition_count > 1)
+    {
+      std::cerr << "usage: " << "-autotune tunes a whole search, leave out -partition" << std::endl;
+      return EXIT_FAILURE;
+    }
+  if (autotuning)
+    return autotune(profile_path) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  std::string trace_path = GetArg("-trace", "");
+  if (!trace_path.empty()) {
+    trace_writer = new CTraceWriter();
+    if (!trace_writer->Open(trace_path)) {
+      std::cerr << "could not create -trace file " << trace_path << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  replaying = mapArgs.count("-replay") > 0;
+
   // ok, start mining:
   CBlockProviderGW* bprovider = new CBlockProviderGW();
+  bprovider->nonceAllocator().setInstance(miner_id);
+  if (replaying)
+    bprovider->setReplay(GetArg("-replayrounds", 0));
+  else if (benchmarking)
+    bprovider->setReplay(GetArg("-replayrounds", 1));
   CMasterThread *mt = new CMasterThread(bprovider);
   mt->run();
+  if (replaying || benchmarking)
+    running = false;
 
   // end:
   return EXIT_SUCCESS;
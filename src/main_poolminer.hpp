@@ -8,7 +8,29 @@
 #include <boost/date_time/posix_time/posix_time_io.hpp>
 #include <cstring>
 #include <boost/unordered_map.hpp>
+#include <boost/atomic.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/static_assert.hpp>
+#ifdef NO_CUDA
+/* CPU-only build (cudapts-cpu):  no CUDA toolkit, only the cpu engine */
+class GPUHasher;
+#else
 #include "gpuhash.h"
+#endif
+#include "cpuhash.hpp"
+#include "spillhash.hpp"
+#include "affinity.hpp"
+#include "asynclog.hpp"
+#include "metrics.hpp"
+#include "statsjson.hpp"
+#include "trace.hpp"
+#include "selftest.hpp"
+#include "verifier.hpp"
+#include "profile.hpp"
+#include "intensity.hpp"
+#include "scheduler.hpp"
+#include "protocol.hpp"
 //#include <libcuckoo/cuckoohash_map.hh>
 //#include <libcuckoo/city_hasher.hh>
 
@@ -31,7 +53,8 @@ typedef struct {
   uint32_t  birthdayA;          // 80+32+4 (uint32_t)
   uint32_t  birthdayB;          // 84+32+4 (uint32_t)
   uint8_t   targetShare[32];
-} blockHeader_t;              // = 80+32+8 bytes header (80 default + 8 birthdayA&B + 32 target)
+  uint32_t  session;            // pool session the work came from (not sent)
+} blockHeader_t;              // = 80+32+8 bytes header (80 default + 8 birthdayA&B + 32 target) + session
 
 class CBlockProvider {
 public:
@@ -44,19 +67,128 @@ public:
   virtual unsigned int GetAdjustedTimeWithOffset(unsigned int thread_id) = 0;
 };
 
-volatile uint64_t totalCollisionCount = 0;
-volatile uint64_t totalShareCount = 0;
+#define MAX_THREADS 64
+
+/* Event counters.  Every worker adds only to its own shard, which has
+ * a cache line to itself, so counting on the hot path never bounces a
+ * line between workers.  Readers sum the shards.  Nothing is ever
+ * reset; to count from some point on, take a snapshot and subtract. */
+enum StatCounter {
+  STAT_COLLISIONS = 0,  // verified collisions (each counts twice, A/B and B/A)
+  STAT_SHARES,          // shares written to the pool
+  STAT_CANDIDATES,      // candidate birthdays returned by the engine
+  STAT_ROUNDS,          // header variants searched
+  STAT_NONCES,          // momentum nonces hashed (2^intensity per round)
+  STAT_STALE_DROPS,     // shares dropped because their work was superseded
+  STAT_DUPLICATES,      // shares not sent because they already had been
+  STAT_ENGINE_ERRORS,   // failed engine calls
+  STAT_ACCEPTED,        // pool responses: share accepted
+  STAT_REJECTED,        //   rejected
+  STAT_STALE,           //   stale
+  STAT_BLOCKS,          //   share was a block
+  STAT_RECONNECTS,      // connections made to the pool
+  N_STAT_COUNTERS
+};
+
+#define STAT_SHARD_MASTER MAX_THREADS
+#define N_STAT_SHARDS (MAX_THREADS+1)
+
+struct CStatShard {
+  boost::atomic<uint64_t> count[N_STAT_COUNTERS];
+} __attribute__((aligned(64)));
+
+CStatShard stat_shards[N_STAT_SHARDS];
+
+inline void stat_add(unsigned int shard, StatCounter c, uint64_t n = 1) {
+  stat_shards[shard % N_STAT_SHARDS].count[c].fetch_add(n, boost::memory_order_relaxed);
+}
+
+inline uint64_t stat_total(StatCounter c) {
+  uint64_t total = 0;
+  for (unsigned int i = 0; i < N_STAT_SHARDS; i++)
+    total += stat_shards[i].count[c].load(boost::memory_order_relaxed);
+  return total;
+}
+
+struct CStatSnapshot {
+  uint64_t count[N_STAT_COUNTERS];
+
+  void take() {
+    for (int c = 0; c < N_STAT_COUNTERS; c++)
+      count[c] = stat_total((StatCounter)c);
+  }
+};
+
+/* Latency histograms, only fed when -metricsport or -statsjson is on */
+boost::atomic<bool> metrics_enabled(false);
+Histogram hist_midhash;
+Histogram hist_verify;
+Histogram hist_share_ack;
+Histogram hist_reconnect;
+Histogram hist_round[MAX_THREADS];
+
+/* Each worker's current work per engine call, for the stats */
+boost::atomic<int> worker_intensity[MAX_THREADS];
+boost::atomic<unsigned int> worker_batch[MAX_THREADS];
+
+/* Background re-verification of collisions, NULL when -verifyrate=0 */
+CCollisionVerifier *collision_verifier = NULL;
 
 #define MAX_MOMENTUM_NONCE (1<<26) // 67.108.864
 #define SEARCH_SPACE_BITS  50
 #define BIRTHDAYS_PER_HASH 8
 
-void print256(const char* bfstr, uint32_t* v) {
+std::string format256(const uint32_t* v) {
   std::stringstream ss;
   for(ptrdiff_t i=7; i>=0; --i)
     ss << std::setw(8) << std::setfill('0') << std::hex << v[i];
-  ss.flush();
-  std::cout << bfstr << ": " << ss.str().c_str() << std::endl;
+  return ss.str();
+}
+
+/* 256-bit little-endian compare of a block hash against the share
+ * target, most significant word first.  Word 0 is never looked at; a
+ * hash equal in words 7..1 passes. */
+inline bool meetsTarget(const uint32_t* hash, const uint32_t* target)
+{
+  for(uint64_t hc=7; hc!=0; hc--)
+    {
+      if( hash[hc] < target[hc] )
+	return true;
+      else if( hash[hc] > target[hc] )
+	return false;
+    }
+  return true;
+}
+
+/* The network target a compact nBits stands for, as 256-bit
+ * little-endian words for meetsTarget */
+inline void compactToTarget(uint32_t nBits, uint32_t target[8])
+{
+  uint8_t *bytes = (uint8_t*)target;
+  memset(bytes, 0, 32);
+  int exponent = nBits >> 24;
+  uint32_t mantissa = nBits & 0x007fffff;
+  for (int i = 0; i < 3; i++) {
+    int at = exponent - 3 + i;
+    if (at >= 0 && at < 32)
+      bytes[at] = (mantissa >> (8*i)) & 0xff;
+  }
+}
+
+/* True if a share also solves the block itself */
+inline bool meetsNetworkTarget(const blockHeader_t* block)
+{
+  uint8_t proofOfWorkHash[32];
+  sph_sha256_context c256;
+  sph_sha256_init(&c256);
+  sph_sha256(&c256, (const unsigned char*)block, 80+8);
+  sph_sha256_close(&c256, proofOfWorkHash);
+  sph_sha256_init(&c256);
+  sph_sha256(&c256, proofOfWorkHash, 32);
+  sph_sha256_close(&c256, proofOfWorkHash);
+  uint32_t target[8];
+  compactToTarget(block->nBits, target);
+  return meetsTarget((uint32_t*)proofOfWorkHash, target);
 }
 
 template<SHAMODE shamode>
@@ -64,8 +196,8 @@ bool protoshares_revalidateCollision(blockHeader_t* block, uint8_t* midHash, uin
 {
   uint8_t tempHash[32+4];
   memcpy(tempHash+4, midHash, 32);
-  totalCollisionCount += 2; // we can use every collision twice -> A B and B A (srsly?)
-  //printf("Collision found %8d = %8d | num: %d\n", indexA, indexB, totalCollisionCount);
+  stat_add(thread_id, STAT_COLLISIONS, 2); // we can use every collision twice -> A B and B A (srsly?)
+  //printf("Collision found %8d = %8d\n", indexA, indexB);
         
   sph_sha256_context c256; //SPH
 		
@@ -80,23 +212,7 @@ bool protoshares_revalidateCollision(blockHeader_t* block, uint8_t* midHash, uin
   sph_sha256_init(&c256);
   sph_sha256(&c256, (unsigned char*)proofOfWorkHash, 32);
   sph_sha256_close(&c256, proofOfWorkHash);
-  bool hashMeetsTarget = true;
-  uint32_t* generatedHash32 = (uint32_t*)proofOfWorkHash;
-  uint32_t* targetHash32 = (uint32_t*)block->targetShare;
-  for(uint64_t hc=7; hc!=0; hc--)
-    {
-      if( generatedHash32[hc] < targetHash32[hc] )
-	{
-	  hashMeetsTarget = true;
-	  break;
-	}
-      else if( generatedHash32[hc] > targetHash32[hc] )
-	{
-	  hashMeetsTarget = false;
-	  break;
-	}
-    }
-  if( hashMeetsTarget )
+  if (meetsTarget((uint32_t*)proofOfWorkHash, (uint32_t*)block->targetShare))
     bp->submitBlock(block, thread_id);
 		
   // get full block hash (for B A)
@@ -109,33 +225,16 @@ bool protoshares_revalidateCollision(blockHeader_t* block, uint8_t* midHash, uin
   sph_sha256_init(&c256);
   sph_sha256(&c256, (unsigned char*)proofOfWorkHash, 32);
   sph_sha256_close(&c256, proofOfWorkHash);
-  hashMeetsTarget = true;
-  generatedHash32 = (uint32_t*)proofOfWorkHash;
-  targetHash32 = (uint32_t*)block->targetShare;
-  for(uint64_t hc=7; hc!=0; hc--)
-    {
-      if( generatedHash32[hc] < targetHash32[hc] )
-	{
-	  hashMeetsTarget = true;
-	  break;
-	}
-      else if( generatedHash32[hc] > targetHash32[hc] )
-	{
-	  hashMeetsTarget = false;
-	  break;
-	}
-    }
-  if( hashMeetsTarget )
+  if (meetsTarget((uint32_t*)proofOfWorkHash, (uint32_t*)block->targetShare))
     bp->submitBlock(block, thread_id);
 
   return true;
 }
 
-template<int COLLISION_TABLE_SIZE, int COLLISION_KEY_MASK, int COLLISION_TABLE_BITS, SHAMODE shamode>
-void protoshares_process_512(blockHeader_t* block, CBlockProvider* bp, unsigned int thread_id, GPUHasher *_gpu, uint64_t *hashblock)
+template<SHAMODE shamode>
+void protoshares_midhash(blockHeader_t* block, uint8_t midHash[32+4], uint64_t data[16])
 {
   // generate mid hash using sha256 (header hash)
-  uint8_t midHash[32+4];
   {
     //SPH
     sph_sha256_context c256;
@@ -154,18 +253,57 @@ void protoshares_process_512(blockHeader_t* block, CBlockProvider* bp, unsigned
   SHA512_PreFinal(&c512_avxsse);
 
   *(uint32_t *)(&c512_avxsse.buffer.bytes[0]) = 0;
-  _gpu->ComputeHashes((uint64_t *)c512_avxsse.buffer.bytes, hashblock);
-  uint32_t n_hashes_plus_one = *((uint32_t *)hashblock);
+  memcpy(data, c512_avxsse.buffer.bytes, sizeof(uint64_t)*16);
+}
+
+template<int COLLISION_TABLE_SIZE, uint32_t COLLISION_KEY_MASK, int COLLISION_TABLE_BITS, SHAMODE shamode>
+void protoshares_process_512(blockHeader_t** blocks, unsigned int n_blocks, CBlockProvider* bp, unsigned int thread_id, Hasher *hasher, uint64_t *hashblock)
+{
+  uint8_t midHash[Hasher::MAX_BATCH][32+4];
+  uint64_t data[Hasher::MAX_BATCH][16];
+
+  /* Read once, so a round is timed all the way through or not at all */
+  bool timed = metrics_enabled.load(boost::memory_order_relaxed);
+  uint64_t t0 = timed ? MonotonicMicros() : 0;
+  for (unsigned int b = 0; b < n_blocks; b++)
+    protoshares_midhash<shamode>(blocks[b], midHash[b], data[b]);
+  uint64_t t1 = timed ? MonotonicMicros() : 0;
+
+  stat_add(thread_id, STAT_ROUNDS, n_blocks);
+  stat_add(thread_id, STAT_NONCES, (uint64_t)n_blocks << hasher->GetIntensity());
+  if (hasher->ComputeHashes(data, hashblock, n_blocks) != 0) {
+    stat_add(thread_id, STAT_ENGINE_ERRORS);
+    return;
+  }
+  uint64_t t2 = timed ? MonotonicMicros() : 0;
+
   boost::unordered_map<uint64_t, uint32_t> resmap;
+  for (unsigned int b = 0; b < n_blocks; b++) {
+    uint64_t *results = hashblock + b*Hasher::N_RESULTS;
+    uint32_t n_results = *((uint32_t *)results);
+    if (n_results > Hasher::N_RESULT_SLOTS)
+      n_results = Hasher::N_RESULT_SLOTS;
+    stat_add(thread_id, STAT_CANDIDATES, n_results);
 
-  for (uint32_t i = 0; i < (n_hashes_plus_one-1); i++) {
-    uint64_t birthday = hashblock[1+i*2];
-    uint32_t mine = hashblock[1+i*2+1];
-    boost::unordered_map<uint64_t,uint32_t>::const_iterator r = resmap.find(birthday);
-    if (r != resmap.end()) {
-      uint32_t other = r->second;
-      protoshares_revalidateCollision<shamode>(block, midHash+4, other, mine, birthday, bp, thread_id);
+    resmap.clear();
+    for (uint32_t i = 0; i < n_results; i++) {
+      uint64_t birthday = results[1+i*2];
+      uint32_t mine = results[1+i*2+1];
+      boost::unordered_map<uint64_t,uint32_t>::const_iterator r = resmap.find(birthday);
+      if (r != resmap.end()) {
+	uint32_t other = r->second;
+	if (collision_verifier != NULL)
+	  collision_verifier->Sample(thread_id, midHash[b]+4, other, mine, birthday);
+	protoshares_revalidateCollision<shamode>(blocks[b], midHash[b]+4, other, mine, birthday, bp, thread_id);
+      }
+      resmap[birthday] = mine;
     }
-    resmap[birthday] = mine;
+  }
+
+  if (timed) {
+    uint64_t t3 = MonotonicMicros();
+    hist_midhash.Observe(t1 - t0);
+    hist_round[thread_id % MAX_THREADS].Observe(t2 - t1);
+    hist_verify.Observe(t3 - t2);
   }
 }
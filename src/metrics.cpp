@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#include <sstream>
+#include <iomanip>
+#include <set>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+
+#include "metrics.hpp"
+
+#if defined(__MINGW32__) || defined(__MINGW64__)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+uint64_t MonotonicMicros() {
+#if defined(__MINGW32__) || defined(__MINGW64__)
+  LARGE_INTEGER freq, now;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (uint64_t)(now.QuadPart / (double)freq.QuadPart * 1e6);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+const uint64_t Histogram::bounds_us[Histogram::N_BUCKETS-1] = {
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+  100000, 250000, 500000, 1000000, 2500000, 10000000
+};
+
+Histogram::Histogram() {
+  for (int i = 0; i < N_BUCKETS; i++)
+    buckets[i].store(0);
+  sum_us.store(0);
+  count.store(0);
+}
+
+void Histogram::Observe(uint64_t us) {
+  int b = 0;
+  while (b < N_BUCKETS-1 && us > bounds_us[b])
+    b++;
+  buckets[b].fetch_add(1, boost::memory_order_relaxed);
+  sum_us.fetch_add(us, boost::memory_order_relaxed);
+  count.fetch_add(1, boost::memory_order_relaxed);
+}
+
+void Histogram::Read(Snapshot *snap) const {
+  snap->count = 0;
+  for (int i = 0; i < N_BUCKETS; i++) {
+    snap->buckets[i] = buckets[i].load(boost::memory_order_relaxed);
+    snap->count += snap->buckets[i];
+  }
+  snap->sum_us = sum_us.load(boost::memory_order_relaxed);
+}
+
+double Histogram::Snapshot::Quantile(double q) const {
+  if (count == 0)
+    return 0;
+  double rank = q * count;
+  uint64_t seen = 0;
+  for (int b = 0; b < N_BUCKETS; b++) {
+    if (buckets[b] > 0 && seen + buckets[b] >= rank) {
+      double lo = b == 0 ? 0 : bounds_us[b-1];
+      /* nothing better to say about the +Inf bucket */
+      if (b == N_BUCKETS-1)
+	return lo;
+      double hi = bounds_us[b];
+      return lo + (hi - lo) * ((rank - seen) / buckets[b]);
+    }
+    seen += buckets[b];
+  }
+  return bounds_us[N_BUCKETS-2];
+}
+
+void Histogram::Snapshot::Subtract(const Snapshot& earlier) {
+  for (int b = 0; b < N_BUCKETS; b++)
+    buckets[b] -= earlier.buckets[b];
+  sum_us -= earlier.sum_us;
+  count -= earlier.count;
+}
+
+void MetricsRegistry::add(const Entry& e) {
+  entries.push_back(e);
+}
+
+void MetricsRegistry::AddCounter(const std::string& name, const std::string& help, ValueFn fn, const std::string& labels) {
+  Entry e = { name, help, labels, COUNTER, fn, NULL };
+  add(e);
+}
+
+void MetricsRegistry::AddGauge(const std::string& name, const std::string& help, ValueFn fn, const std::string& labels) {
+  Entry e = { name, help, labels, GAUGE, fn, NULL };
+  add(e);
+}
+
+void MetricsRegistry::AddHistogram(const std::string& name, const std::string& help, const Histogram *h, const std::string& labels) {
+  Entry e = { name, help, labels, HISTOGRAM, ValueFn(), h };
+  add(e);
+}
+
+static std::string with_labels(const std::string& labels, const std::string& extra) {
+  if (labels.empty() && extra.empty())
+    return "";
+  if (labels.empty())
+    return "{" + extra + "}";
+  if (extra.empty())
+    return "{" + labels + "}";
+  return "{" + labels + "," + extra + "}";
+}
+
+std::string MetricsRegistry::Render() const {
+  static const char *type_names[] = { "counter", "gauge", "histogram" };
+  std::stringstream out;
+  out << std::setprecision(10);
+  std::set<std::string> done;
+
+  /* All series of one metric have to be listed together, under one
+   * HELP/TYPE header. */
+  for (size_t i = 0; i < entries.size(); i++) {
+    const std::string& name = entries[i].name;
+    if (done.count(name))
+      continue;
+    done.insert(name);
+    out << "# HELP " << name << " " << entries[i].help << "\n";
+    out << "# TYPE " << name << " " << type_names[entries[i].type] << "\n";
+    for (size_t j = i; j < entries.size(); j++) {
+      const Entry& e = entries[j];
+      if (e.name != name)
+	continue;
+      if (e.type != HISTOGRAM) {
+	out << name << with_labels(e.labels, "") << " " << e.fn() << "\n";
+	continue;
+      }
+      Histogram::Snapshot snap;
+      e.histogram->Read(&snap);
+      uint64_t cumulative = 0;
+      for (int b = 0; b < Histogram::N_BUCKETS; b++) {
+	cumulative += snap.buckets[b];
+	std::stringstream le;
+	le << std::setprecision(10) << "le=\"";
+	if (b == Histogram::N_BUCKETS-1)
+	  le << "+Inf";
+	else
+	  le << Histogram::bounds_us[b] / 1e6;
+	le << "\"";
+	out << name << "_bucket" << with_labels(e.labels, le.str()) << " " << cumulative << "\n";
+      }
+      out << name << "_sum" << with_labels(e.labels, "") << " " << snap.sum_us / 1e6 << "\n";
+      out << name << "_count" << with_labels(e.labels, "") << " " << cumulative << "\n";
+    }
+  }
+  return out.str();
+}
+
+class MetricsServer::Connection : public boost::enable_shared_from_this<MetricsServer::Connection> {
+public:
+  Connection(boost::asio::io_service& io_service, const MetricsRegistry& registry)
+    : socket(io_service), _registry(registry) { }
+
+  void start() {
+    boost::asio::async_read_until(socket, request, "\r\n\r\n",
+				  boost::bind(&Connection::handle_read, shared_from_this(),
+					      boost::asio::placeholders::error));
+  }
+
+  boost::asio::ip::tcp::socket socket;
+
+private:
+  void handle_read(const boost::system::error_code& error) {
+    if (error)
+      return;
+    std::istream in(&request);
+    std::string method, path;
+    in >> method >> path;
+    std::stringstream reply;
+    if (method == "GET" && (path == "/metrics" || path == "/")) {
+      std::string body = _registry.Render();
+      reply << "HTTP/1.0 200 OK\r\n"
+	    << "Content-Type: text/plain; version=0.0.4\r\n"
+	    << "Content-Length: " << body.size() << "\r\n\r\n" << body;
+    } else {
+      reply << "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    }
+    response = reply.str();
+    boost::asio::async_write(socket, boost::asio::buffer(response),
+			     boost::bind(&Connection::handle_write, shared_from_this(),
+					 boost::asio::placeholders::error));
+  }
+
+  void handle_write(const boost::system::error_code& error) {
+    boost::system::error_code ignored;
+    socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+  }
+
+  const MetricsRegistry& _registry;
+  boost::asio::streambuf request;
+  std::string response;
+};
+
+MetricsServer::MetricsServer(boost::asio::io_service& io_service, const MetricsRegistry& registry)
+  : _io_service(io_service), _registry(registry), _acceptor(io_service) { }
+
+bool MetricsServer::Listen(const std::string& address, unsigned short port) {
+  boost::system::error_code error;
+  boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address::from_string(address, error), port);
+  if (error)
+    return false;
+  _acceptor.open(endpoint.protocol(), error);
+  if (error)
+    return false;
+  _acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true), error);
+  _acceptor.bind(endpoint, error);
+  if (error)
+    return false;
+  _acceptor.listen(boost::asio::socket_base::max_connections, error);
+  if (error)
+    return false;
+  start_accept();
+  return true;
+}
+
+void MetricsServer::start_accept() {
+  boost::shared_ptr<Connection> conn(new Connection(_io_service, _registry));
+  _acceptor.async_accept(conn->socket, boost::bind(&MetricsServer::handle_accept, this, conn,
+						  boost::asio::placeholders::error));
+}
+
+void MetricsServer::handle_accept(boost::shared_ptr<Connection> conn, const boost::system::error_code& error) {
+  if (error == boost::asio::error::operation_aborted)
+    return;
+  if (!error)
+    conn->start();
+  start_accept();
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <inttypes.h>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+
+/* Microseconds from an arbitrary, monotonic origin */
+uint64_t MonotonicMicros();
+
+/* Latency histogram with fixed, roughly logarithmic buckets from 100us
+ * to 10s.  Observe() is three relaxed atomic adds. */
+class Histogram {
+public:
+  static const int N_BUCKETS = 16;
+  /* upper bounds in microseconds; the last bucket is +Inf */
+  static const uint64_t bounds_us[N_BUCKETS-1];
+
+  Histogram();
+  void Observe(uint64_t us);
+
+  struct Snapshot {
+    uint64_t buckets[N_BUCKETS]; /* not cumulative */
+    uint64_t sum_us;
+    uint64_t count;
+
+    /* Estimated q-quantile in microseconds, interpolated within the
+     * bucket; 0 if empty. */
+    double Quantile(double q) const;
+    /* Leave only what was observed since an earlier snapshot */
+    void Subtract(const Snapshot& earlier);
+  };
+  void Read(Snapshot *snap) const;
+
+private:
+  boost::atomic<uint64_t> buckets[N_BUCKETS];
+  boost::atomic<uint64_t> sum_us;
+  boost::atomic<uint64_t> count;
+};
+
+/* Named metrics rendered in the Prometheus text exposition format.
+ * Counters and gauges are read through callbacks when scraped, so the
+ * code being measured doesn't need to know about the registry.
+ * Register everything before the server starts. */
+class MetricsRegistry {
+public:
+  typedef boost::function<double ()> ValueFn;
+
+  void AddCounter(const std::string& name, const std::string& help, ValueFn fn, const std::string& labels = "");
+  void AddGauge(const std::string& name, const std::string& help, ValueFn fn, const std::string& labels = "");
+  void AddHistogram(const std::string& name, const std::string& help, const Histogram *h, const std::string& labels = "");
+
+  std::string Render() const;
+
+private:
+  enum Type { COUNTER, GAUGE, HISTOGRAM };
+  struct Entry {
+    std::string name, help, labels;
+    Type type;
+    ValueFn fn;
+    const Histogram *histogram;
+  };
+  void add(const Entry& e);
+  std::vector<Entry> entries;
+};
+
+/* Minimal HTTP/1.0 server answering GET /metrics, running on the
+ * caller's io_service.  One request per connection. */
+class MetricsServer {
+public:
+  MetricsServer(boost::asio::io_service& io_service, const MetricsRegistry& registry);
+  bool Listen(const std::string& address, unsigned short port);
+
+private:
+  class Connection;
+  void start_accept();
+  void handle_accept(boost::shared_ptr<Connection> conn, const boost::system::error_code& error);
+
+  boost::asio::io_service& _io_service;
+  const MetricsRegistry& _registry;
+  boost::asio::ip::tcp::acceptor _acceptor;
+};
+
+#endif /* METRICS_HPP */
@@ -0,0 +1,330 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+/* cudapts-mockpool:  a stand-in pool for testing on one machine.
+ *
+ * Speaks the pool side of protocol.hpp to any number of miners (or a
+ * cudapts-proxy).  Work is a random header with the current nTime and
+ * a target every collision meets; a new block comes every -blocksecs.
+ * Each share is checked the way a pool would:  the header must be the
+ * current work (a share on the previous block is stale, -1), the two
+ * indices must be distinct nonces whose birthdays collide, the block
+ * hash must meet the target, and the share must not have been seen
+ * before.  Good shares are answered with 2, everything else with 0.
+ *
+ * Options:  -listen=[<addr>:]<port> (default 127.0.0.1:13370),
+ * -blocksecs=<s> (default 60), -statsinterval=<s> (default 60),
+ * -loglevel, -lograte. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <set>
+#include <iostream>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "protocol.hpp"
+#include "selftest.hpp"
+#include "asynclog.hpp"
+
+extern "C" {
+#include "sph_sha2.h"
+}
+
+using boost::asio::ip::tcp;
+
+/* Header offsets, as in blockHeader_t */
+static const size_t HDR_PREVHASH = 4;
+static const size_t HDR_TIME = 68;
+static const size_t HDR_SIZE = 80;
+static const size_t HDR_BIRTHDAY_A = 80;
+static const size_t HDR_BIRTHDAY_B = 84;
+
+static const uint32_t MAX_MOMENTUM_NONCE = (1 << 26);
+
+static void sha256d(const unsigned char *data, size_t len, unsigned char out[32]) {
+  sph_sha256_context c256;
+  sph_sha256_init(&c256);
+  sph_sha256(&c256, data, len);
+  sph_sha256_close(&c256, out);
+  sph_sha256_init(&c256);
+  sph_sha256(&c256, out, 32);
+  sph_sha256_close(&c256, out);
+}
+
+/* Same comparison as the miner's meetsTarget */
+static bool meets_target(const unsigned char hash[32], const unsigned char target[32]) {
+  uint32_t h[8], t[8];
+  memcpy(h, hash, 32);
+  memcpy(t, target, 32);
+  for (int i = 7; i != 0; i--) {
+    if (h[i] < t[i])
+      return true;
+    if (h[i] > t[i])
+      return false;
+  }
+  return true;
+}
+
+class CMockPool;
+
+class CPoolSession : public CMinerConnection {
+public:
+  CPoolSession(boost::asio::io_service& io_service, CMockPool *pool)
+    : CMinerConnection(io_service), shares(0), good(0), _pool(pool) { }
+
+  uint64_t shares, good;
+
+protected:
+  bool OnHello(const PoolHello& hello);
+  void OnShare(const unsigned char share[PROTO_SHARE_SIZE]);
+  void OnClose();
+
+private:
+  boost::shared_ptr<CPoolSession> self() { return boost::static_pointer_cast<CPoolSession>(shared_from_this()); }
+
+  CMockPool *_pool;
+};
+
+typedef boost::shared_ptr<CPoolSession> PoolSessionPtr;
+
+class CMockPool {
+public:
+  CMockPool(boost::asio::io_service& io_service)
+    : _io_service(io_service), _acceptor(io_service), _block_timer(io_service), _stats_timer(io_service),
+      _height(0) {
+    memset(_counts, 0, sizeof(_counts));
+    memset(_work, 0, sizeof(_work));
+  }
+
+  bool Listen(const std::string& address, unsigned short port);
+  void StartBlocks(unsigned int interval_secs);
+  void StartStats(unsigned int interval_secs);
+
+  void Join(PoolSessionPtr session, const PoolHello& hello);
+  void Leave(PoolSessionPtr session);
+  int32_t Check(const unsigned char share[PROTO_SHARE_SIZE]);
+
+private:
+  enum Count { SHARES = 0, GOOD, STALE, WRONG_WORK, BAD_INDEX, NO_COLLISION, ABOVE_TARGET, DUPLICATE, N_COUNTS };
+
+  void start_accept();
+  void handle_accept(PoolSessionPtr session, const boost::system::error_code& error);
+  void new_block(const boost::system::error_code& error);
+  void log_stats(const boost::system::error_code& error);
+
+  boost::asio::io_service& _io_service;
+  tcp::acceptor _acceptor;
+  boost::asio::deadline_timer _block_timer;
+  boost::asio::deadline_timer _stats_timer;
+  unsigned int _block_interval, _stats_interval;
+
+  unsigned int _height;
+  unsigned char _work[PROTO_WORK_SIZE];
+  unsigned char _previous[32];  /* prevhash of the block before */
+  std::set<std::string> _seen;  /* shares on the current block */
+
+  std::vector<PoolSessionPtr> _sessions;
+  uint64_t _counts[N_COUNTS];
+};
+
+/*********************************
+ * sessions
+ *********************************/
+
+bool CPoolSession::OnHello(const PoolHello& hello) {
+  _pool->Join(self(), hello);
+  return true;
+}
+
+void CPoolSession::OnShare(const unsigned char share[PROTO_SHARE_SIZE]) {
+  int32_t result = _pool->Check(share);
+  shares++;
+  if (result > 1)
+    good++;
+  Send(EncodeResult(result));
+}
+
+void CPoolSession::OnClose() {
+  _pool->Leave(self());
+}
+
+/*********************************
+ * the pool
+ *********************************/
+
+bool CMockPool::Listen(const std::string& address, unsigned short port) {
+  if (!::Listen(_acceptor, address, port))
+    return false;
+  start_accept();
+  return true;
+}
+
+void CMockPool::start_accept() {
+  PoolSessionPtr session(new CPoolSession(_io_service, this));
+  _acceptor.async_accept(session->socket, boost::bind(&CMockPool::handle_accept, this, session,
+						     boost::asio::placeholders::error));
+}
+
+void CMockPool::handle_accept(PoolSessionPtr session, const boost::system::error_code& error) {
+  if (error == boost::asio::error::operation_aborted)
+    return;
+  if (!error)
+    session->Start();
+  start_accept();
+}
+
+void CMockPool::Join(PoolSessionPtr session, const PoolHello& hello) {
+  _sessions.push_back(session);
+  LogPrintf(LOG_INFO, "[POOL] %s connected as %s (v%u.%u, %u threads, minerid %u), %u connected",
+	    session->name.c_str(), hello.username.c_str(), hello.version_major, hello.version_minor,
+	    hello.threads, hello.miner_id, (unsigned int)_sessions.size());
+  session->Send(EncodeWork(_work));
+}
+
+void CMockPool::Leave(PoolSessionPtr session) {
+  std::vector<PoolSessionPtr>::iterator it = std::find(_sessions.begin(), _sessions.end(), session);
+  if (it == _sessions.end())
+    return;
+  _sessions.erase(it);
+  LogPrintf(LOG_INFO, "[POOL] %s left after %llu shares (%llu good), %u connected", session->name.c_str(),
+	    (unsigned long long)session->shares, (unsigned long long)session->good, (unsigned int)_sessions.size());
+}
+
+int32_t CMockPool::Check(const unsigned char share[PROTO_SHARE_SIZE]) {
+  _counts[SHARES]++;
+  /* everything but nTime and nNonce is the pool's */
+  unsigned char header[HDR_SIZE];
+  memcpy(header, share, HDR_SIZE);
+  memcpy(header + HDR_TIME, _work + HDR_TIME, 4);
+  memcpy(header + PROTO_NONCE_OFFSET, _work + PROTO_NONCE_OFFSET, 4);
+  if (memcmp(header, _work, HDR_SIZE) != 0) {
+    bool stale = _height > 1 && memcmp(share + HDR_PREVHASH, _previous, 32) == 0;
+    _counts[stale ? STALE : WRONG_WORK]++;
+    return stale ? -1 : 0;
+  }
+
+  uint32_t a, b;
+  memcpy(&a, share + HDR_BIRTHDAY_A, 4);
+  memcpy(&b, share + HDR_BIRTHDAY_B, 4);
+  if (a == b || a >= MAX_MOMENTUM_NONCE || b >= MAX_MOMENTUM_NONCE) {
+    _counts[BAD_INDEX]++;
+    return 0;
+  }
+  uint8_t midhash[32];
+  sha256d(share, HDR_SIZE, midhash);
+  if (ReferenceBirthday(midhash, a) != ReferenceBirthday(midhash, b)) {
+    _counts[NO_COLLISION]++;
+    return 0;
+  }
+  unsigned char hash[32];
+  sha256d(share, PROTO_SHARE_SIZE, hash);
+  if (!meets_target(hash, _work + HDR_SIZE)) {
+    _counts[ABOVE_TARGET]++;
+    return 0;
+  }
+  if (!_seen.insert(std::string((const char *)share, PROTO_SHARE_SIZE)).second) {
+    _counts[DUPLICATE]++;
+    return 0;
+  }
+  _counts[GOOD]++;
+  return 2;
+}
+
+void CMockPool::StartBlocks(unsigned int interval_secs) {
+  _block_interval = interval_secs;
+  new_block(boost::system::error_code());
+}
+
+void CMockPool::new_block(const boost::system::error_code& error) {
+  if (error)
+    return;
+  memcpy(_previous, _work + HDR_PREVHASH, 32);
+  _height++;
+  int32_t version = 2;
+  uint32_t now = time(NULL), bits = 0x1d00ffff, nonce = 0;
+  memcpy(_work, &version, 4);
+  for (size_t i = HDR_PREVHASH; i < HDR_TIME; i++)  /* prevhash and merkle root */
+    _work[i] = rand() & 0xff;
+  memcpy(_work + HDR_TIME, &now, 4);
+  memcpy(_work + 72, &bits, 4);
+  memcpy(_work + PROTO_NONCE_OFFSET, &nonce, 4);
+  memset(_work + HDR_SIZE, 0xff, 32);
+  _seen.clear();
+
+  LogPrintf(LOG_INFO, "[POOL] block %u, sending work to %u miners", _height, (unsigned int)_sessions.size());
+  for (size_t i = 0; i < _sessions.size(); i++)
+    _sessions[i]->Send(EncodeWork(_work));
+  _block_timer.expires_from_now(boost::posix_time::seconds(_block_interval));
+  _block_timer.async_wait(boost::bind(&CMockPool::new_block, this, boost::asio::placeholders::error));
+}
+
+void CMockPool::StartStats(unsigned int interval_secs) {
+  _stats_interval = interval_secs;
+  _stats_timer.expires_from_now(boost::posix_time::seconds(_stats_interval));
+  _stats_timer.async_wait(boost::bind(&CMockPool::log_stats, this, boost::asio::placeholders::error));
+}
+
+void CMockPool::log_stats(const boost::system::error_code& error) {
+  if (error)
+    return;
+  LogPrintf(LOG_INFO, "[STATS] %u miners | block %u | shares %llu: good %llu, stale %llu, wrong work %llu, "
+	    "bad index %llu, no collision %llu, above target %llu, duplicate %llu",
+	    (unsigned int)_sessions.size(), _height, (unsigned long long)_counts[SHARES],
+	    (unsigned long long)_counts[GOOD], (unsigned long long)_counts[STALE],
+	    (unsigned long long)_counts[WRONG_WORK], (unsigned long long)_counts[BAD_INDEX],
+	    (unsigned long long)_counts[NO_COLLISION], (unsigned long long)_counts[ABOVE_TARGET],
+	    (unsigned long long)_counts[DUPLICATE]);
+  StartStats(_stats_interval);
+}
+
+/*********************************
+ * main
+ *********************************/
+
+int main(int argc, char **argv) {
+  CArgs args;
+  args.Parse(argc, argv);
+  if (!args.positional.empty()) {
+    std::cerr << "usage: " << argv[0] << " [-listen=[<addr>:]<port>] [-blocksecs=<s>] [-statsinterval=<s>]"
+	      << " [-loglevel=<level>]" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::string listen = args.Get("-listen", "127.0.0.1:13370");
+  std::string listen_addr = "127.0.0.1", listen_port = listen;
+  if (listen.find(':') != std::string::npos && !ParseHostPort(listen, &listen_addr, &listen_port)) {
+    std::cerr << "usage: " << "-listen must be [addr:]port" << std::endl;
+    return EXIT_FAILURE;
+  }
+  LogLevel log_level = LOG_INFO;
+  if (!LogParseLevel(args.Get("-loglevel", "info").c_str(), &log_level)) {
+    std::cerr << "usage: " << "-loglevel must be debug, info, warn or error" << std::endl;
+    return EXIT_FAILURE;
+  }
+  LogStart(log_level, atoi(args.Get("-lograte", "20").c_str()));
+  srand(time(NULL));
+
+  boost::asio::io_service io_service;
+  CMockPool pool(io_service);
+  if (!pool.Listen(listen_addr, atoi(listen_port.c_str()))) {
+    LogPrintf(LOG_ERROR, "[POOL] could not listen on %s:%s", listen_addr.c_str(), listen_port.c_str());
+    LogStop();
+    return EXIT_FAILURE;
+  }
+  LogPrintf(LOG_INFO, "[POOL] mock pool listening on %s:%s", listen_addr.c_str(), listen_port.c_str());
+  pool.StartBlocks(std::max(1, atoi(args.Get("-blocksecs", "60").c_str())));
+  pool.StartStats(std::max(1, atoi(args.Get("-statsinterval", "60").c_str())));
+  io_service.run();
+  LogStop();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <vector>
+#include <unistd.h>
+#include "profile.hpp"
+#include "affinity.hpp"
+
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
+
+std::string EngineProfile::Format() const {
+  std::stringstream out;
+  out << "batch=" << batch << " cputhreads=" << cpu_threads
+      << " blockthreads=" << params.block_threads << " slabs=" << params.slabs
+      << " filterpower=" << params.filter_power << " score=" << score;
+  return out.str();
+}
+
+std::string DefaultProfilePath() {
+  const char *home = getenv("HOME");
+  if (home == NULL || home[0] == '\0')
+    return "cudapts-profiles";
+  return std::string(home) + "/.cudapts-profiles";
+}
+
+static std::string cpu_model() {
+#if defined(__APPLE__)
+  char brand[256];
+  size_t len = sizeof(brand);
+  if (sysctlbyname("machdep.cpu.brand_string", brand, &len, NULL, 0) == 0)
+    return brand;
+#else
+  FILE *f = fopen("/proc/cpuinfo", "r");
+  if (f != NULL) {
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+      char *v = strchr(line, ':');
+      if (strncmp(line, "model name", 10) == 0 && v != NULL) {
+	fclose(f);
+	std::string model(v + 2);
+	return model.substr(0, model.find_last_not_of("\n") + 1);
+      }
+    }
+    fclose(f);
+  }
+#endif
+  return "unknown";
+}
+
+std::string CPUProfileKey() {
+  std::vector<int> cpus;
+  GetOnlineCPUs(cpus);
+  std::stringstream out;
+  out << "cpu:" << cpu_model() << " x" << cpus.size();
+  return out.str();
+}
+
+static bool parse_profile(const std::string& fields, EngineProfile *profile) {
+  EngineProfile p;
+  std::stringstream in(fields);
+  std::string field;
+  int seen = 0;
+  while (in >> field) {
+    size_t eq = field.find('=');
+    if (eq == std::string::npos)
+      return false;
+    std::string name = field.substr(0, eq);
+    const char *value = field.c_str() + eq + 1;
+    if (name == "batch")
+      p.batch = atoi(value), seen |= 1;
+    else if (name == "cputhreads")
+      p.cpu_threads = atoi(value), seen |= 2;
+    else if (name == "blockthreads")
+      p.params.block_threads = atoi(value), seen |= 4;
+    else if (name == "slabs")
+      p.params.slabs = atoi(value), seen |= 8;
+    else if (name == "filterpower")
+      p.params.filter_power = atoi(value), seen |= 16;
+    else if (name == "score")
+      p.score = atof(value);
+  }
+  if (seen != 31 || p.batch < 1 || p.batch > Hasher::MAX_BATCH || p.cpu_threads < 1 || !p.params.Valid())
+    return false;
+  *profile = p;
+  return true;
+}
+
+/* Every line of the cache, with the key's own line (if any) removed */
+static bool read_other_lines(const std::string& path, const std::string& key, std::vector<std::string> *lines,
+			     std::string *own) {
+  FILE *f = fopen(path.c_str(), "r");
+  if (f == NULL)
+    return false;
+  char buf[1024];
+  while (fgets(buf, sizeof(buf), f) != NULL) {
+    std::string line(buf);
+    line = line.substr(0, line.find_last_not_of("\r\n") + 1);
+    size_t tab = line.find('\t');
+    if (tab != std::string::npos && line.compare(0, tab, key) == 0 && tab == key.size()) {
+      if (own != NULL)
+	*own = line.substr(tab + 1);
+    } else if (!line.empty())
+      lines->push_back(line);
+  }
+  fclose(f);
+  return true;
+}
+
+bool LoadEngineProfile(const std::string& path, const std::string& key, EngineProfile *profile) {
+  std::vector<std::string> others;
+  std::string own;
+  if (!read_other_lines(path, key, &others, &own) || own.empty())
+    return false;
+  return parse_profile(own, profile);
+}
+
+bool SaveEngineProfile(const std::string& path, const std::string& key, const EngineProfile& profile) {
+  std::vector<std::string> lines;
+  read_other_lines(path, key, &lines, NULL);
+  lines.push_back(key + "\t" + profile.Format());
+
+  std::stringstream tmpname;
+  tmpname << path << ".tmp." << getpid();
+  std::string tmp = tmpname.str();
+  FILE *f = fopen(tmp.c_str(), "w");
+  if (f == NULL)
+    return false;
+  for (size_t i = 0; i < lines.size(); i++)
+    fprintf(f, "%s\n", lines[i].c_str());
+  if (fclose(f) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+    remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
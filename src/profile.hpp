@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include <string>
+#include "hasher.h"
+
+/* Engine settings found by -autotune, cached per device so that every
+ * later run on the same hardware starts from them.  The cache is a
+ * text file with one profile per line:
+ *
+ *   <key>\tbatch=1 cputhreads=8 blockthreads=64 slabs=1 filterpower=31 score=0.93
+ *
+ * The key names the device ("gpu:GeForce GTX 680 sm_30", "cpu:Intel(R)
+ * Xeon(R) CPU E5-2680 0 @ 2.70GHz x16") and score is in rounds per
+ * second. */
+struct EngineProfile {
+  EngineParams params;
+  int batch;
+  int cpu_threads;
+  double score;
+
+  EngineProfile() : batch(1), cpu_threads(1), score(0) { }
+  std::string Format() const;
+};
+
+/* $HOME/.cudapts-profiles, or cudapts-profiles in the current
+ * directory if there's no home directory */
+std::string DefaultProfilePath();
+
+/* Key for the CPU engine on this host:  model name and online CPUs */
+std::string CPUProfileKey();
+
+/* False if the file or the key isn't there, or the line is damaged */
+bool LoadEngineProfile(const std::string& path, const std::string& key, EngineProfile *profile);
+
+/* Adds or replaces the key's line.  The file is rewritten through a
+ * temporary and renamed into place, so concurrent readers never see
+ * half of it. */
+bool SaveEngineProfile(const std::string& path, const std::string& key, const EngineProfile& profile);
+
+#endif /* PROFILE_HPP */
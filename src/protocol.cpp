@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#include <cstring>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include "protocol.hpp"
+
+size_t EncodeHello(const PoolHello& hello, unsigned char out[PROTO_MAX_HELLO_SIZE]) {
+  unsigned char *p = out;
+  size_t ulen = std::min<size_t>(hello.username.size(), 255);
+  size_t plen = std::min<size_t>(hello.password.size(), 255);
+  *p++ = (unsigned char)ulen;
+  memcpy(p, hello.username.data(), ulen);
+  p += ulen;
+  *p++ = 0; /* hi, i'm v0.4+ */
+  *p++ = hello.version_major;
+  *p++ = hello.version_minor;
+  *p++ = hello.threads;
+  *p++ = hello.fee;
+  *p++ = hello.miner_id & 0xff;
+  *p++ = hello.miner_id >> 8;
+  memset(p, 0, 12);
+  p += 12;
+  *p++ = (unsigned char)plen;
+  memcpy(p, hello.password.data(), plen);
+  p += plen;
+  *p++ = 0; /* no extensions */
+  *p++ = 0;
+  return p - out;
+}
+
+std::string EncodeHello(const PoolHello& hello) {
+  unsigned char out[PROTO_MAX_HELLO_SIZE];
+  return std::string((const char *)out, EncodeHello(hello, out));
+}
+
+size_t HelloSize(const unsigned char *buf, size_t have) {
+  if (have < 1)
+    return 0;
+  size_t plen_at = 1 + buf[0] + PROTO_HELLO_FIXED;
+  if (have <= plen_at)
+    return 0;
+  return plen_at + 1 + buf[plen_at] + 2;
+}
+
+bool DecodeHello(const unsigned char *buf, size_t len, PoolHello *hello) {
+  size_t size = HelloSize(buf, len);
+  if (size == 0 || len < size)
+    return false;
+  size_t ulen = buf[0];
+  const unsigned char *p = buf + 1 + ulen;
+  hello->username.assign((const char *)buf + 1, ulen);
+  hello->version_major = p[1];
+  hello->version_minor = p[2];
+  hello->threads = p[3];
+  hello->fee = p[4];
+  hello->miner_id = p[5] | (p[6] << 8);
+  p += PROTO_HELLO_FIXED;
+  hello->password.assign((const char *)p + 1, p[0]);
+  return true;
+}
+
+std::string EncodeWork(const unsigned char work[PROTO_WORK_SIZE]) {
+  std::string out(1, (char)PROTO_WORK);
+  out.append((const char *)work, PROTO_WORK_SIZE);
+  return out;
+}
+
+std::string EncodeResult(int32_t result) {
+  std::string out(1, (char)PROTO_RESULT);
+  for (int i = 0; i < 4; i++)
+    out += (char)(((uint32_t)result >> (8*i)) & 0xff);
+  return out;
+}
+
+std::string EncodePing() {
+  return std::string(1, (char)PROTO_PING);
+}
+
+int32_t DecodeResult(const unsigned char buf[PROTO_RESULT_SIZE]) {
+  return (int32_t)(buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24));
+}
+
+/* Parsed bytes are only moved out of the way when there's no room
+ * left for a whole message behind them, and then there are fewer
+ * than one message's worth to move. */
+unsigned char *CPoolFrameReader::Space() {
+  if (_start == _end)
+    _start = _end = 0;
+  else if (BUFFER_SIZE - _end < 1 + PROTO_WORK_SIZE) {
+    memmove(_buf, _buf + _start, _end - _start);
+    _end -= _start;
+    _start = 0;
+  }
+  return _buf + _end;
+}
+
+bool CPoolFrameReader::Next(int *type, const unsigned char **payload) {
+  if (_start == _end)
+    return false;
+  size_t size = 0;
+  switch (_buf[_start]) {
+  case PROTO_WORK: size = PROTO_WORK_SIZE; break;
+  case PROTO_RESULT: size = PROTO_RESULT_SIZE; break;
+  }
+  if (_end - _start < 1 + size)
+    return false;
+  *type = _buf[_start];
+  *payload = size > 0 ? _buf + _start + 1 : NULL;
+  _start += 1 + size;
+  return true;
+}
+
+CShareFilter::CShareFilter() {
+  for (size_t i = 0; i < N_SLOTS; i++)
+    _slots[i].store(0, boost::memory_order_relaxed);
+}
+
+bool CShareFilter::Seen(uint64_t key) {
+  return _slots[(key ^ (key >> 32)) % N_SLOTS].exchange(key, boost::memory_order_relaxed) == key;
+}
+
+/* FNV-1a; 0 marks an empty slot, so no key is 0 */
+uint64_t CShareFilter::Key(const unsigned char share[PROTO_SHARE_SIZE], uint32_t job) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < PROTO_SHARE_SIZE; i++)
+    h = (h ^ share[i]) * 1099511628211ULL;
+  for (int i = 0; i < 4; i++)
+    h = (h ^ ((job >> (8*i)) & 0xff)) * 1099511628211ULL;
+  return h != 0 ? h : 1;
+}
+
+void MoveInstance(unsigned char work[PROTO_WORK_SIZE], unsigned int from, unsigned int to) {
+  uint32_t nonce;
+  memcpy(&nonce, work + PROTO_NONCE_OFFSET, 4);
+  nonce ^= ((from ^ to) % PROTO_MAX_INSTANCES) << PROTO_INSTANCE_SHIFT;
+  memcpy(work + PROTO_NONCE_OFFSET, &nonce, 4);
+}
+
+bool ParseHostPort(const std::string& spec, std::string *host, std::string *port) {
+  size_t colon = spec.rfind(':');
+  if (colon == std::string::npos || colon == 0 || colon + 1 == spec.size())
+    return false;
+  *host = spec.substr(0, colon);
+  *port = spec.substr(colon + 1);
+  return true;
+}
+
+CMinerConnection::CMinerConnection(boost::asio::io_service& io_service)
+  : socket(io_service), _hello_have(0), _closed(false) {
+}
+
+void CMinerConnection::Start() {
+  boost::system::error_code ignored;
+  socket.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+  name = boost::lexical_cast<std::string>(socket.remote_endpoint(ignored));
+  read_hello();
+}
+
+/* The hello's length is only known once the username and then the
+ * password length are in, so it's read in up to three pieces. */
+void CMinerConnection::read_hello() {
+  size_t want = HelloSize(_hello, _hello_have);
+  if (want == 0)
+    want = _hello_have < 1 ? 1 : 1 + _hello[0] + PROTO_HELLO_FIXED + 1;
+  boost::asio::async_read(socket, boost::asio::buffer(_hello + _hello_have, want - _hello_have),
+			  boost::bind(&CMinerConnection::handle_hello, shared_from_this(),
+				      boost::asio::placeholders::error, want));
+}
+
+void CMinerConnection::handle_hello(const boost::system::error_code& error, size_t want) {
+  if (error) {
+    Close();
+    return;
+  }
+  _hello_have = want;
+  size_t size = HelloSize(_hello, _hello_have);
+  if (size == 0 || _hello_have < size) {
+    read_hello();
+    return;
+  }
+  PoolHello hello;
+  if (!DecodeHello(_hello, _hello_have, &hello) || !OnHello(hello)) {
+    Close();
+    return;
+  }
+  read_share();
+}
+
+void CMinerConnection::read_share() {
+  boost::asio::async_read(socket, boost::asio::buffer(_share, sizeof(_share)),
+			  boost::bind(&CMinerConnection::handle_share, shared_from_this(),
+				      boost::asio::placeholders::error));
+}
+
+void CMinerConnection::handle_share(const boost::system::error_code& error) {
+  if (error) {
+    Close();
+    return;
+  }
+  OnShare(_share);
+  read_share();
+}
+
+void CMinerConnection::Send(const std::string& msg) {
+  if (_closed)
+    return;
+  _outbox.push_back(msg);
+  if (_outbox.size() == 1)
+    write_next();
+}
+
+void CMinerConnection::write_next() {
+  boost::asio::async_write(socket, boost::asio::buffer(_outbox.front()),
+			   boost::bind(&CMinerConnection::handle_write, shared_from_this(),
+				       boost::asio::placeholders::error));
+}
+
+void CMinerConnection::handle_write(const boost::system::error_code& error) {
+  if (error) {
+    Close();
+    return;
+  }
+  _outbox.pop_front();
+  if (!_outbox.empty())
+    write_next();
+}
+
+void CMinerConnection::Close() {
+  if (_closed)
+    return;
+  _closed = true;
+  boost::system::error_code ignored;
+  socket.close(ignored);
+  OnClose();
+}
+
+bool Listen(boost::asio::ip::tcp::acceptor& acceptor, const std::string& address, unsigned short port) {
+  boost::system::error_code error;
+  boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address::from_string(address, error), port);
+  if (error)
+    return false;
+  acceptor.open(endpoint.protocol(), error);
+  if (error)
+    return false;
+  acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true), error);
+  acceptor.bind(endpoint, error);
+  if (error)
+    return false;
+  acceptor.listen(boost::asio::socket_base::max_connections, error);
+  return !error;
+}
+
+void CArgs::Parse(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    if (a.size() > 2 && a[0] == '-' && a[1] == '-')
+      a = a.substr(1);
+    if (a.size() < 2 || a[0] != '-') {
+      positional.push_back(a);
+      continue;
+    }
+    size_t eq = a.find('=');
+    _args[a.substr(0, eq)] = eq == std::string::npos ? "1" : a.substr(eq + 1);
+  }
+}
+
+std::string CArgs::Get(const std::string& name, const std::string& def) const {
+  std::map<std::string, std::string>::const_iterator it = _args.find(name);
+  return it == _args.end() ? def : it->second;
+}
+
+CReconnectPolicy::CReconnectPolicy(unsigned int ttl_secs, uint64_t min_us, uint64_t max_us, uint32_t seed)
+  : _ttl_us((uint64_t)ttl_secs * 1000000), _min_us(min_us), _max_us(max_us < min_us ? min_us : max_us),
+    _resolved_us(0), _failures(0), _rng(seed ? seed : 1) {
+}
+
+bool CReconnectPolicy::CacheFresh(uint64_t now_us) const {
+  return !_endpoints.empty() && _resolved_us != 0 && now_us - _resolved_us < _ttl_us;
+}
+
+void CReconnectPolicy::StoreEndpoints(boost::asio::ip::tcp::resolver::iterator it, uint64_t now_us) {
+  std::vector<boost::asio::ip::tcp::endpoint> fresh;
+  for (boost::asio::ip::tcp::resolver::iterator end; it != end; ++it)
+    fresh.push_back(*it);
+  if (fresh.empty())
+    return;
+  /* Keep the address that worked last in front if it's still listed */
+  if (!_endpoints.empty()) {
+    std::vector<boost::asio::ip::tcp::endpoint>::iterator last = std::find(fresh.begin(), fresh.end(), _endpoints[0]);
+    if (last != fresh.end())
+      std::rotate(fresh.begin(), last, last + 1);
+  }
+  _endpoints.swap(fresh);
+  _resolved_us = now_us;
+}
+
+void CReconnectPolicy::Connected(const boost::asio::ip::tcp::endpoint& ep) {
+  std::vector<boost::asio::ip::tcp::endpoint>::iterator it = std::find(_endpoints.begin(), _endpoints.end(), ep);
+  if (it != _endpoints.end())
+    std::rotate(_endpoints.begin(), it, it + 1);
+}
+
+uint64_t CReconnectPolicy::Limit() const {
+  uint64_t limit = _min_us;
+  for (unsigned int i = 0; i < _failures && limit < _max_us; i++)
+    limit *= 2;
+  return limit > _max_us ? _max_us : limit;
+}
+
+uint64_t CReconnectPolicy::NextDelay(bool round_failed) {
+  if (round_failed)
+    _resolved_us = 0;
+  uint64_t limit = Limit();
+  _failures++;
+  /* xorshift32 */
+  _rng ^= _rng << 13;
+  _rng ^= _rng >> 17;
+  _rng ^= _rng << 5;
+  return limit * _rng / 0xffffffffULL;
+}
@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#ifndef PROTOCOL_HPP
+#define PROTOCOL_HPP
+
+#include <inttypes.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/enable_shared_from_this.hpp>
+
+/* The pool wire protocol (ptsminer's), shared by the miner, the
+ * farm proxy and the mock pool.  Integers are little-endian.
+ *
+ *   miner -> pool   hello, once after connecting (EncodeHello)
+ *                   share:  the 88-byte header with birthdayA/B,
+ *                   no type byte
+ *   pool -> miner   one type byte, then
+ *                     PROTO_WORK    80-byte header + 32-byte target
+ *                     PROTO_RESULT  int32:  <0 stale, 0 rejected,
+ *                                   1 block, above that a share
+ *                     PROTO_PING    nothing
+ *
+ * The pool answers shares in the order they were sent. */
+enum ProtoType { PROTO_WORK = 0, PROTO_RESULT = 1, PROTO_PING = 2 };
+
+static const size_t PROTO_WORK_SIZE = 112;
+static const size_t PROTO_SHARE_SIZE = 88;
+static const size_t PROTO_RESULT_SIZE = 4;
+
+/* Offset of nNonce in the header */
+static const size_t PROTO_NONCE_OFFSET = 76;
+
+/* The top bits of nNonce hold the miner instance (-minerid); see
+ * CNonceAllocator in main_poolminer.cpp. */
+static const unsigned int PROTO_INSTANCE_SHIFT = 22;
+static const unsigned int PROTO_MAX_INSTANCES = 1024;
+
+struct PoolHello {
+  std::string username;
+  std::string password;
+  uint8_t version_major;
+  uint8_t version_minor;
+  uint8_t threads;
+  uint8_t fee;
+  uint16_t miner_id;
+
+  PoolHello() : version_major(0), version_minor(0), threads(1), fee(0), miner_id(0) { }
+};
+
+/* [ulen] username [0] [major] [minor] [threads] [fee] [miner_id:2]
+ * [12 zero bytes] [plen] password [extensions:2 = 0].  Names longer
+ * than 255 bytes are cut short.  The first form writes the frame into
+ * out and returns its length. */
+static const size_t PROTO_HELLO_FIXED = 19;  /* bytes between the username and plen */
+static const size_t PROTO_MAX_HELLO_SIZE = 1 + 255 + PROTO_HELLO_FIXED + 1 + 255 + 2;
+size_t EncodeHello(const PoolHello& hello, unsigned char out[PROTO_MAX_HELLO_SIZE]);
+std::string EncodeHello(const PoolHello& hello);
+
+/* The whole hello's length, judging by its first have bytes, or 0
+ * if more are needed to tell.  Read at least this much before
+ * DecodeHello. */
+size_t HelloSize(const unsigned char *buf, size_t have);
+bool DecodeHello(const unsigned char *buf, size_t len, PoolHello *hello);
+
+/* Framed messages from the pool side */
+std::string EncodeWork(const unsigned char work[PROTO_WORK_SIZE]);
+std::string EncodeResult(int32_t result);
+std::string EncodePing();
+int32_t DecodeResult(const unsigned char buf[PROTO_RESULT_SIZE]);
+
+/* Splits the pool's byte stream into messages without copying or
+ * allocating:  read into Space() (which may make room, so call it
+ * before SpaceSize()), Commit() what arrived, then take messages with
+ * Next() until it returns false.  A message can arrive in pieces or
+ * several to a read.  A payload points into the buffer and is good
+ * until the next Space().  Unknown types come back with no payload,
+ * as they have none that we know of. */
+class CPoolFrameReader {
+public:
+  static const size_t BUFFER_SIZE = 4096;
+
+  CPoolFrameReader() : _start(0), _end(0) { }
+  unsigned char *Space();
+  size_t SpaceSize() const { return BUFFER_SIZE - _end; }
+  void Commit(size_t n) { _end += n; }
+  bool Next(int *type, const unsigned char **payload);
+  /* Drops whatever is left, for a new connection */
+  void Reset() { _start = _end = 0; }
+
+private:
+  unsigned char _buf[BUFFER_SIZE];
+  size_t _start, _end; /* unparsed bytes */
+};
+
+/* Remembers recently sent shares, so that each is sent only once.
+ * A share's key maps to one slot, and Seen() swaps it in, so that of
+ * two workers racing with the same share exactly one is told it is
+ * new; no lock is taken.  A different share landing in the same slot
+ * evicts the old one, which can only let a repeat through, never stop
+ * a new share. */
+class CShareFilter {
+public:
+  static const size_t N_SLOTS = 4096;
+
+  CShareFilter();
+  /* True if key was recorded before; records it either way */
+  bool Seen(uint64_t key);
+  /* The key of a share:  its header, nTime and the nonce pair in
+   * order, and job, which tells work from different pool sessions
+   * apart. */
+  static uint64_t Key(const unsigned char share[PROTO_SHARE_SIZE], uint32_t job);
+
+private:
+  boost::atomic<uint64_t> _slots[N_SLOTS];
+};
+
+/* Moves a work unit from one miner instance's slice of the nNonce
+ * space to another's:  a miner with -minerid=from that is sent the
+ * result hashes the headers a miner with -minerid=to would have. */
+void MoveInstance(unsigned char work[PROTO_WORK_SIZE], unsigned int from, unsigned int to);
+
+/* Splits "host:port"; false if there is no port */
+bool ParseHostPort(const std::string& spec, std::string *host, std::string *port);
+
+/* The pool end of one miner's connection, for the proxy and the mock
+ * pool:  reads the hello, then shares, and writes Send()'s messages
+ * in order.  Lives as long as its socket has a read pending or a
+ * write queued. */
+class CMinerConnection : public boost::enable_shared_from_this<CMinerConnection> {
+public:
+  CMinerConnection(boost::asio::io_service& io_service);
+  virtual ~CMinerConnection() { }
+
+  /* Once accepted */
+  void Start();
+  void Send(const std::string& msg);
+  void Close();
+
+  boost::asio::ip::tcp::socket socket;
+  std::string name;   /* for the log */
+
+protected:
+  /* false closes the connection */
+  virtual bool OnHello(const PoolHello& hello) = 0;
+  virtual void OnShare(const unsigned char share[PROTO_SHARE_SIZE]) = 0;
+  /* Once, after the socket is closed */
+  virtual void OnClose() = 0;
+
+private:
+  void read_hello();
+  void handle_hello(const boost::system::error_code& error, size_t want);
+  void read_share();
+  void handle_share(const boost::system::error_code& error);
+  void write_next();
+  void handle_write(const boost::system::error_code& error);
+
+  unsigned char _hello[PROTO_MAX_HELLO_SIZE];
+  size_t _hello_have;
+  unsigned char _share[PROTO_SHARE_SIZE];
+  std::deque<std::string> _outbox;
+  bool _closed;
+};
+
+/* Opens, binds and listens on address:port */
+bool Listen(boost::asio::ip::tcp::acceptor& acceptor, const std::string& address, unsigned short port);
+
+/* The proxy's and the mock pool's command line:  -name=value, or
+ * -name for "1", with one dash or two.  Anything else is positional. */
+class CArgs {
+public:
+  void Parse(int argc, char **argv);
+  std::string Get(const std::string& name, const std::string& def) const;
+  bool Has(const std::string& name) const { return _args.count(name) > 0; }
+
+  std::vector<std::string> positional;
+
+private:
+  std::map<std::string, std::string> _args;
+};
+
+/* When and where to reconnect to the pool.  Resolved addresses are
+ * cached for ttl seconds (the resolver doesn't tell us the record's
+ * own TTL) and kept past that if resolving fails.  A connect round
+ * tries every address, the last one that worked first, without
+ * waiting in between.  Only when a whole round fails, or a working
+ * connection is lost, does the caller wait:  a random time up to a
+ * limit that doubles each time from min_us to max_us ("full jitter"),
+ * so that miners that lost the pool together don't return together.
+ * Times are passed in, in microseconds, from any monotonic clock. */
+class CReconnectPolicy {
+public:
+  CReconnectPolicy(unsigned int ttl_secs, uint64_t min_us, uint64_t max_us, uint32_t seed);
+
+  bool CacheFresh(uint64_t now_us) const;
+  void StoreEndpoints(boost::asio::ip::tcp::resolver::iterator it, uint64_t now_us);
+  /* The cached addresses, best first; empty until resolved */
+  const std::vector<boost::asio::ip::tcp::endpoint>& Endpoints() const { return _endpoints; }
+
+  /* A connection to ep was made:  ep goes first */
+  void Connected(const boost::asio::ip::tcp::endpoint& ep);
+  /* The session has proved itself (the pool sent work):  the backoff
+   * resets.  A pool that accepts connections and then drops them
+   * keeps backing off. */
+  void Established() { _failures = 0; }
+  /* Every address failed or the connection was lost:  the time to
+   * wait before the next round.  A failed round also expires the
+   * cache, in case the pool has moved. */
+  uint64_t NextDelay(bool round_failed);
+  /* The most NextDelay() would wait now */
+  uint64_t Limit() const;
+
+private:
+  uint64_t _ttl_us;
+  uint64_t _min_us, _max_us;
+  uint64_t _resolved_us;
+  std::vector<boost::asio::ip::tcp::endpoint> _endpoints;
+  unsigned int _failures;
+  uint32_t _rng;
+};
+
+#endif /* PROTOCOL_HPP */
@@ -0,0 +1,565 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+/* cudapts-proxy:  one pool session for a whole farm.
+ *
+ * Holds a single connection to the pool and speaks the same protocol
+ * (protocol.hpp) to any number of local miners, which connect with
+ * -pool=<proxy host:port>.  Work from the pool goes to every miner;
+ * shares from the miners go up the one session, and the pool's
+ * answers, which come in order, go back to whoever sent the share.
+ *
+ * Each miner gets a slot, and its copy of the work is moved into that
+ * slot's part of the nNonce space (MoveInstance), whatever -minerid it
+ * was started with.  So the miners' header variants never overlap,
+ * and up to PROTO_MAX_INSTANCES of them can share one proxy.  The
+ * proxy owns the whole -minerid space of its payout address:  don't
+ * mine to the same address without it.
+ *
+ * With -coop the work is passed on unchanged instead, for nodes of a
+ * cooperative search (cudapts -partition=i/n):  they must hash the
+ * same headers, so they need the same -minerid and worker count, and
+ * each one only sends up the collisions in its birthday partition.
+ *
+ * The payout address is the proxy's; the addresses in the miners'
+ * hellos are only logged.  While the pool is away the miners keep
+ * their connections, and their shares are answered as stale.
+ *
+ * Options:  -pool=<host:port> (upstream, default
+ * ptsmine.beeeeer.org:1337), -listen=[<addr>:]<port> (default
+ * 0.0.0.0:1337), -minerid=<n> (sent to the pool), -coop,
+ * -connecttimeout=<s> (per pool address, default 10),
+ * -statsinterval=<s> (default 60), -loglevel, -lograte. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <iostream>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "protocol.hpp"
+#include "asynclog.hpp"
+#include "metrics.hpp"
+
+/* Sent in the proxy's own hello; same as the miner */
+#define VERSION_MAJOR 0
+#define VERSION_MINOR 8
+
+using boost::asio::ip::tcp;
+
+/* The payout address, sent in the proxy's hello */
+static std::string pool_username;
+
+class CProxy;
+
+/* One local miner */
+class CMinerSession : public CMinerConnection {
+public:
+  CMinerSession(boost::asio::io_service& io_service, CProxy *proxy)
+    : CMinerConnection(io_service), slot(-1), miner_id(0), _proxy(proxy) { }
+
+  void SendWork(const unsigned char work[PROTO_WORK_SIZE]);
+
+  int slot;           /* -1 until the hello is in, or with -coop */
+  unsigned int miner_id;  /* the -minerid it was started with */
+
+protected:
+  bool OnHello(const PoolHello& hello);
+  void OnShare(const unsigned char share[PROTO_SHARE_SIZE]);
+  void OnClose();
+
+private:
+  boost::shared_ptr<CMinerSession> self() { return boost::static_pointer_cast<CMinerSession>(shared_from_this()); }
+
+  CProxy *_proxy;
+};
+
+typedef boost::shared_ptr<CMinerSession> SessionPtr;
+
+class CProxy {
+public:
+  CProxy(boost::asio::io_service& io_service, const std::string& host, const std::string& port, unsigned int miner_id,
+	 bool coop, unsigned int connect_timeout_secs)
+    : _io_service(io_service), _acceptor(io_service), _resolver(io_service), _upstream(io_service),
+      _retry_timer(io_service), _connect_timer(io_service), _stats_timer(io_service), _host(host), _port(port),
+      _miner_id(miner_id), _coop(coop), _connect_timeout_secs(connect_timeout_secs), _next_endpoint(0),
+      _connect_timed_out(false), _reconnect(300, 1000000, 60000000, (uint32_t)(MonotonicMicros() ^ time(NULL))),
+      _lost_us(0), _reconnecting(false), _connected(false), _have_work(false), _writing(false), _slots(PROTO_MAX_INSTANCES, false) {
+    memset(_counts, 0, sizeof(_counts));
+  }
+
+  bool Listen(const std::string& address, unsigned short port);
+  void Connect();
+  void StartStats(unsigned int interval_secs);
+
+  /* Called by the sessions */
+  bool Join(SessionPtr session, const PoolHello& hello);
+  void Leave(SessionPtr session);
+  void Share(SessionPtr session, const unsigned char share[PROTO_SHARE_SIZE]);
+
+private:
+  enum Count { SHARES_IN = 0, SHARES_UP, LOCAL_STALE, RES_STALE, RES_REJECTED, RES_BLOCK, RES_SHARE, UNMATCHED, N_COUNTS };
+
+  void start_accept();
+  void handle_accept(SessionPtr session, const boost::system::error_code& error);
+  void handle_resolve(const boost::system::error_code& error, tcp::resolver::iterator it);
+  void connect_cached();
+  void connect_next();
+  void handle_connect(const boost::system::error_code& error);
+  void handle_connect_timeout(const boost::system::error_code& error);
+  void read_upstream();
+  void handle_upstream_read(const boost::system::error_code& error, size_t len);
+  void handle_work(const unsigned char *work);
+  void handle_result(int32_t result);
+  void upstream_write(const std::string& msg);
+  void upstream_write_next();
+  void handle_upstream_write(const boost::system::error_code& error);
+  void upstream_lost(const char *why);
+  void handle_retry(const boost::system::error_code& error);
+  void log_stats(const boost::system::error_code& error);
+
+  boost::asio::io_service& _io_service;
+  tcp::acceptor _acceptor;
+  tcp::resolver _resolver;
+  tcp::socket _upstream;
+  boost::asio::deadline_timer _retry_timer;
+  boost::asio::deadline_timer _connect_timer;
+  boost::asio::deadline_timer _stats_timer;
+  unsigned int _stats_interval;
+  std::string _host, _port;
+  unsigned int _miner_id;
+  bool _coop;
+  unsigned int _connect_timeout_secs;
+  CReconnectPolicy _reconnect;
+  std::vector<tcp::endpoint> _endpoints; /* this connect round's */
+  size_t _next_endpoint;
+  bool _connect_timed_out;               /* the current attempt */
+  std::string _connect_error;            /* the last attempt's */
+  uint64_t _lost_us;
+  bool _reconnecting; /* a retry is scheduled */
+
+  bool _connected;
+  CPoolFrameReader _reader;
+  unsigned char _work[PROTO_WORK_SIZE];
+  bool _have_work;
+  std::deque<std::string> _upstream_outbox;
+  bool _writing;
+  /* Who sent each share the pool hasn't answered yet, oldest first */
+  std::deque<boost::weak_ptr<CMinerSession> > _pending;
+
+  std::vector<SessionPtr> _sessions;
+  std::vector<bool> _slots;
+  uint64_t _counts[N_COUNTS];
+};
+
+/*********************************
+ * miner sessions
+ *********************************/
+
+bool CMinerSession::OnHello(const PoolHello& hello) {
+  return _proxy->Join(self(), hello);
+}
+
+void CMinerSession::OnShare(const unsigned char share[PROTO_SHARE_SIZE]) {
+  _proxy->Share(self(), share);
+}
+
+void CMinerSession::OnClose() {
+  _proxy->Leave(self());
+}
+
+void CMinerSession::SendWork(const unsigned char work[PROTO_WORK_SIZE]) {
+  unsigned char mine[PROTO_WORK_SIZE];
+  memcpy(mine, work, sizeof(mine));
+  if (slot >= 0)
+    MoveInstance(mine, miner_id, slot);
+  Send(EncodeWork(mine));
+}
+
+/*********************************
+ * the proxy
+ *********************************/
+
+bool CProxy::Listen(const std::string& address, unsigned short port) {
+  if (!::Listen(_acceptor, address, port))
+    return false;
+  start_accept();
+  return true;
+}
+
+void CProxy::start_accept() {
+  SessionPtr session(new CMinerSession(_io_service, this));
+  _acceptor.async_accept(session->socket, boost::bind(&CProxy::handle_accept, this, session,
+						     boost::asio::placeholders::error));
+}
+
+void CProxy::handle_accept(SessionPtr session, const boost::system::error_code& error) {
+  if (error == boost::asio::error::operation_aborted)
+    return;
+  if (!error)
+    session->Start();
+  start_accept();
+}
+
+bool CProxy::Join(SessionPtr session, const PoolHello& hello) {
+  if (_coop) {
+    if (!_sessions.empty() && _sessions[0]->miner_id != hello.miner_id)
+      LogPrintf(LOG_WARN, "[PROXY] miner %s has minerid %u, the search has %u:  it won't hash the same headers",
+		session->name.c_str(), hello.miner_id, _sessions[0]->miner_id);
+    session->miner_id = hello.miner_id;
+    _sessions.push_back(session);
+    LogPrintf(LOG_INFO, "[PROXY] miner %s (%s, v%u.%u, minerid %u) joined the search, %u connected",
+	      session->name.c_str(), hello.username.c_str(), hello.version_major, hello.version_minor,
+	      hello.miner_id, (unsigned int)_sessions.size());
+    if (_have_work)
+      session->SendWork(_work);
+    return true;
+  }
+  for (size_t i = 0; i < _slots.size(); i++) {
+    if (_slots[i])
+      continue;
+    _slots[i] = true;
+    session->slot = i;
+    session->miner_id = hello.miner_id;
+    _sessions.push_back(session);
+    LogPrintf(LOG_INFO, "[PROXY] miner %s (%s, v%u.%u, minerid %u) joined in slot %u, %u connected",
+	      session->name.c_str(), hello.username.c_str(), hello.version_major, hello.version_minor,
+	      hello.miner_id, (unsigned int)i, (unsigned int)_sessions.size());
+    if (_have_work)
+      session->SendWork(_work);
+    return true;
+  }
+  LogPrintf(LOG_WARN, "[PROXY] miner %s turned away, all %u slots in use", session->name.c_str(), (unsigned int)_slots.size());
+  return false;
+}
+
+void CProxy::Leave(SessionPtr session) {
+  std::vector<SessionPtr>::iterator it = std::find(_sessions.begin(), _sessions.end(), session);
+  if (it == _sessions.end())
+    return;
+  _sessions.erase(it);
+  if (session->slot >= 0)
+    _slots[session->slot] = false;
+  LogPrintf(LOG_INFO, "[PROXY] miner %s left, %u connected", session->name.c_str(), (unsigned int)_sessions.size());
+}
+
+void CProxy::Share(SessionPtr session, const unsigned char share[PROTO_SHARE_SIZE]) {
+  _counts[SHARES_IN]++;
+  if (!_connected || !_have_work) {
+    _counts[LOCAL_STALE]++;
+    session->Send(EncodeResult(-1));
+    return;
+  }
+  _counts[SHARES_UP]++;
+  _pending.push_back(session);
+  upstream_write(std::string((const char *)share, PROTO_SHARE_SIZE));
+}
+
+/*********************************
+ * the pool session
+ *********************************/
+
+/* Connects to the cached addresses, resolving first if the cache has
+ * expired */
+void CProxy::Connect() {
+  if (_reconnect.CacheFresh(MonotonicMicros())) {
+    connect_cached();
+    return;
+  }
+  tcp::resolver::query query(_host, _port);
+  _resolver.async_resolve(query, boost::bind(&CProxy::handle_resolve, this, boost::asio::placeholders::error,
+					     boost::asio::placeholders::iterator));
+}
+
+void CProxy::handle_resolve(const boost::system::error_code& error, tcp::resolver::iterator it) {
+  if (error && _reconnect.Endpoints().empty()) {
+    upstream_lost(error.message().c_str());
+    return;
+  }
+  if (error)
+    LogPrintf(LOG_WARN, "[PROXY] could not resolve %s (%s), trying the cached addresses", _host.c_str(), error.message().c_str());
+  else
+    _reconnect.StoreEndpoints(it, MonotonicMicros());
+  connect_cached();
+}
+
+/* Each address in turn, each with -connecttimeout to answer */
+void CProxy::connect_cached() {
+  _endpoints = _reconnect.Endpoints();
+  _next_endpoint = 0;
+  _connect_error = "no address";
+  connect_next();
+}
+
+void CProxy::connect_next() {
+  if (_next_endpoint >= _endpoints.size()) {
+    upstream_lost(_connect_error.c_str());
+    return;
+  }
+  const tcp::endpoint& ep = _endpoints[_next_endpoint++];
+  boost::system::error_code ignored;
+  _upstream.close(ignored);
+  _connect_timed_out = false;
+  _connect_timer.expires_from_now(boost::posix_time::seconds(_connect_timeout_secs));
+  _connect_timer.async_wait(boost::bind(&CProxy::handle_connect_timeout, this, boost::asio::placeholders::error));
+  _upstream.async_connect(ep, boost::bind(&CProxy::handle_connect, this, boost::asio::placeholders::error));
+}
+
+void CProxy::handle_connect_timeout(const boost::system::error_code& error) {
+  if (error == boost::asio::error::operation_aborted)
+    return;
+  /* The connect may have finished just as the timer went off, its
+   * handler still on the way */
+  boost::system::error_code not_connected;
+  _upstream.remote_endpoint(not_connected);
+  if (!not_connected)
+    return;
+  _connect_timed_out = true;
+  boost::system::error_code ignored;
+  _upstream.close(ignored);
+}
+
+void CProxy::handle_connect(const boost::system::error_code& error) {
+  _connect_timer.cancel();
+  const tcp::endpoint& ep = _endpoints[_next_endpoint - 1];
+  if (error) {
+    _connect_error = _connect_timed_out ? "timed out" : error.message();
+    if (_endpoints.size() > 1)
+      LogPrintf(LOG_WARN, "[PROXY] could not connect to the pool at %s (%s)",
+		boost::lexical_cast<std::string>(ep).c_str(), _connect_error.c_str());
+    connect_next();
+    return;
+  }
+  boost::system::error_code ignored;
+  _upstream.set_option(tcp::no_delay(true), ignored);
+  _upstream.set_option(boost::asio::socket_base::keep_alive(true), ignored);
+  _connected = true;
+  _reconnect.Connected(ep);
+  if (_lost_us != 0)
+    LogPrintf(LOG_INFO, "[PROXY] connected to the pool at %s after %.1f s without it",
+	      boost::lexical_cast<std::string>(ep).c_str(), (MonotonicMicros() - _lost_us) / 1e6);
+  else
+    LogPrintf(LOG_INFO, "[PROXY] connected to the pool at %s", boost::lexical_cast<std::string>(ep).c_str());
+  _lost_us = 0;
+
+  PoolHello hello;
+  hello.username = pool_username;
+  hello.password = "notused";
+  hello.version_major = VERSION_MAJOR;
+  hello.version_minor = VERSION_MINOR;
+  hello.miner_id = _miner_id;
+  upstream_write(EncodeHello(hello));
+  _reader.Reset();
+  read_upstream();
+}
+
+void CProxy::read_upstream() {
+  unsigned char *space = _reader.Space();
+  _upstream.async_read_some(boost::asio::buffer(space, _reader.SpaceSize()),
+			    boost::bind(&CProxy::handle_upstream_read, this, boost::asio::placeholders::error,
+					boost::asio::placeholders::bytes_transferred));
+}
+
+/* Everything that arrived, however many messages or pieces of one */
+void CProxy::handle_upstream_read(const boost::system::error_code& error, size_t len) {
+  if (error) {
+    upstream_lost(error.message().c_str());
+    return;
+  }
+  _reader.Commit(len);
+  int type;
+  const unsigned char *payload;
+  while (_reader.Next(&type, &payload)) {
+    switch (type) {
+    case PROTO_WORK:
+      handle_work(payload);
+      break;
+    case PROTO_RESULT:
+      handle_result(DecodeResult(payload));
+      break;
+    case PROTO_PING:
+      for (size_t i = 0; i < _sessions.size(); i++)
+	_sessions[i]->Send(EncodePing());
+      break;
+    default:
+      LogPrintf(LOG_WARN, "[PROXY] unknown message type %u from the pool", type);
+    }
+  }
+  read_upstream();
+}
+
+void CProxy::handle_work(const unsigned char *work) {
+  memcpy(_work, work, sizeof(_work));
+  _have_work = true;
+  _reconnect.Established();
+  LogPrintf(LOG_INFO, "[PROXY] work received, sent to %u miners", (unsigned int)_sessions.size());
+  for (size_t i = 0; i < _sessions.size(); i++)
+    _sessions[i]->SendWork(_work);
+}
+
+void CProxy::handle_result(int32_t result) {
+  _counts[result < 0 ? RES_STALE : result == 0 ? RES_REJECTED : result == 1 ? RES_BLOCK : RES_SHARE]++;
+  if (_pending.empty()) {
+    _counts[UNMATCHED]++;
+    LogPrintf(LOG_WARN, "[PROXY] the pool answered a share nobody sent");
+  } else {
+    SessionPtr session = _pending.front().lock();
+    _pending.pop_front();
+    if (session)
+      session->Send(EncodeResult(result));
+  }
+}
+
+void CProxy::upstream_write(const std::string& msg) {
+  _upstream_outbox.push_back(msg);
+  if (!_writing)
+    upstream_write_next();
+}
+
+void CProxy::upstream_write_next() {
+  _writing = true;
+  boost::asio::async_write(_upstream, boost::asio::buffer(_upstream_outbox.front()),
+			   boost::bind(&CProxy::handle_upstream_write, this, boost::asio::placeholders::error));
+}
+
+void CProxy::handle_upstream_write(const boost::system::error_code& error) {
+  _writing = false;
+  if (error) {
+    upstream_lost(error.message().c_str());
+    return;
+  }
+  _upstream_outbox.pop_front();
+  if (!_upstream_outbox.empty())
+    upstream_write_next();
+}
+
+/* Shares the pool never answered are answered as stale, so every
+ * miner's count of outstanding shares stays right.  The miners keep
+ * mining their old work until the pool is back.  A failed write and
+ * the read it aborts both end up here; only the first schedules the
+ * retry. */
+void CProxy::upstream_lost(const char *why) {
+  if (_connected || _upstream.is_open()) {
+    boost::system::error_code ignored;
+    _upstream.close(ignored);
+  }
+  if (_writing)
+    return; /* the aborted write comes back here and finishes the job */
+  if (_reconnecting)
+    return;
+  _reconnecting = true;
+  uint64_t delay_us = _reconnect.NextDelay(!_connected);
+  if (_connected)
+    LogPrintf(LOG_WARN, "[PROXY] lost the pool (%s), %u shares unanswered, reconnecting in %.1f s", why,
+	      (unsigned int)_pending.size(), delay_us / 1e6);
+  else
+    LogPrintf(LOG_WARN, "[PROXY] can't reach the pool at %s:%s (%s), retrying in %.1f s", _host.c_str(), _port.c_str(),
+	      why, delay_us / 1e6);
+  if (_lost_us == 0)
+    _lost_us = MonotonicMicros();
+  while (!_pending.empty()) {
+    SessionPtr session = _pending.front().lock();
+    _pending.pop_front();
+    _counts[LOCAL_STALE]++;
+    if (session)
+      session->Send(EncodeResult(-1));
+  }
+  _connected = false;
+  _have_work = false;
+  _upstream_outbox.clear();
+  _retry_timer.expires_from_now(boost::posix_time::microseconds(delay_us));
+  _retry_timer.async_wait(boost::bind(&CProxy::handle_retry, this, boost::asio::placeholders::error));
+}
+
+void CProxy::handle_retry(const boost::system::error_code& error) {
+  if (error == boost::asio::error::operation_aborted)
+    return;
+  _reconnecting = false;
+  Connect();
+}
+
+void CProxy::StartStats(unsigned int interval_secs) {
+  _stats_interval = interval_secs;
+  _stats_timer.expires_from_now(boost::posix_time::seconds(_stats_interval));
+  _stats_timer.async_wait(boost::bind(&CProxy::log_stats, this, boost::asio::placeholders::error));
+}
+
+void CProxy::log_stats(const boost::system::error_code& error) {
+  if (error)
+    return;
+  LogPrintf(LOG_INFO, "[STATS] %u miners | pool %s | shares in %llu, up %llu, answered stale here %llu | "
+	    "pool: %llu shares, %llu blocks, %llu rejected, %llu stale",
+	    (unsigned int)_sessions.size(), _connected ? "connected" : "down",
+	    (unsigned long long)_counts[SHARES_IN], (unsigned long long)_counts[SHARES_UP],
+	    (unsigned long long)_counts[LOCAL_STALE], (unsigned long long)_counts[RES_SHARE],
+	    (unsigned long long)_counts[RES_BLOCK], (unsigned long long)_counts[RES_REJECTED],
+	    (unsigned long long)_counts[RES_STALE]);
+  StartStats(_stats_interval);
+}
+
+/*********************************
+ * main
+ *********************************/
+
+int main(int argc, char **argv) {
+  CArgs args;
+  args.Parse(argc, argv);
+  if (args.positional.size() != 1) {
+    std::cerr << "usage: " << argv[0] << " [-pool=<host:port>] [-listen=[<addr>:]<port>] [-minerid=<n>] [-coop]"
+	      << " [-connecttimeout=<s>] [-statsinterval=<s>] [-loglevel=<level>] <payout-address>" << std::endl;
+    return EXIT_FAILURE;
+  }
+  pool_username = args.positional[0];
+
+  std::string host, port;
+  if (!ParseHostPort(args.Get("-pool", "ptsmine.beeeeer.org:1337"), &host, &port)) {
+    std::cerr << "usage: " << "-pool must be host:port" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::string listen = args.Get("-listen", "1337");
+  std::string listen_addr = "0.0.0.0", listen_port = listen;
+  if (listen.find(':') != std::string::npos && !ParseHostPort(listen, &listen_addr, &listen_port)) {
+    std::cerr << "usage: " << "-listen must be [addr:]port" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  int connect_timeout = atoi(args.Get("-connecttimeout", "10").c_str());
+  if (connect_timeout <= 0) {
+    std::cerr << "usage: " << "-connecttimeout must be above 0" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  LogLevel log_level = LOG_INFO;
+  if (!LogParseLevel(args.Get("-loglevel", "info").c_str(), &log_level)) {
+    std::cerr << "usage: " << "-loglevel must be debug, info, warn or error" << std::endl;
+    return EXIT_FAILURE;
+  }
+  LogStart(log_level, atoi(args.Get("-lograte", "20").c_str()));
+
+  boost::asio::io_service io_service;
+  CProxy proxy(io_service, host, port, atoi(args.Get("-minerid", "0").c_str()), args.Has("-coop"),
+	      connect_timeout);
+  if (!proxy.Listen(listen_addr, atoi(listen_port.c_str()))) {
+    LogPrintf(LOG_ERROR, "[PROXY] could not listen on %s:%s", listen_addr.c_str(), listen_port.c_str());
+    LogStop();
+    return EXIT_FAILURE;
+  }
+  LogPrintf(LOG_INFO, "[PROXY] listening for miners on %s:%s, pool %s:%s, payouts to %s",
+	    listen_addr.c_str(), listen_port.c_str(), host.c_str(), port.c_str(), pool_username.c_str());
+  proxy.Connect();
+  proxy.StartStats(std::max(1, atoi(args.Get("-statsinterval", "60").c_str())));
+  io_service.run();
+  LogStop();
+  return EXIT_SUCCESS;
+}
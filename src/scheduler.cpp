@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#include "scheduler.hpp"
+
+/* Weight of the newest call in the smoothed rate */
+#define RATE_WEIGHT 0.25
+
+CEngineScheduler::CEngineScheduler() : n_workers(1) {
+  for (int i = 0; i < SCHEDULER_MAX_WORKERS; i++)
+    rate[i] = 0;
+}
+
+void CEngineScheduler::SetWorkers(unsigned int n) {
+  n_workers = n < 1 ? 1 : n > SCHEDULER_MAX_WORKERS ? SCHEDULER_MAX_WORKERS : n;
+}
+
+void CEngineScheduler::Record(unsigned int worker, uint64_t nonces, uint64_t micros) {
+  if (micros == 0)
+    return;
+  boost::atomic<uint64_t>& r = rate[worker % SCHEDULER_MAX_WORKERS];
+  double now = nonces * 1e6 / micros;
+  double old = r.load(boost::memory_order_relaxed);
+  /* Only the owning worker writes its rate */
+  r.store(old == 0 ? now : (1 - RATE_WEIGHT) * old + RATE_WEIGHT * now, boost::memory_order_relaxed);
+}
+
+double CEngineScheduler::Rate(unsigned int worker) const {
+  return rate[worker % SCHEDULER_MAX_WORKERS].load(boost::memory_order_relaxed);
+}
+
+double CEngineScheduler::Share(unsigned int worker) const {
+  double total = 0;
+  for (unsigned int i = 0; i < n_workers; i++) {
+    double r = Rate(i);
+    if (r == 0)
+      return 1.0 / n_workers;
+    total += r;
+  }
+  return Rate(worker) / total;
+}
+
+unsigned int CEngineScheduler::Quota(unsigned int worker, unsigned int rounds_each) const {
+  double quota = (double)rounds_each * n_workers * Share(worker) + 0.5;
+  return quota < 1 ? 1 : (unsigned int)quota;
+}
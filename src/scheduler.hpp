@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <inttypes.h>
+#include <boost/atomic.hpp>
+
+#define SCHEDULER_MAX_WORKERS 64
+
+/* Shares work between workers whose engines run at very different
+ * speeds (-engine=gpu+cpu).  Every worker reports each engine call
+ * here, and the scheduler keeps a smoothed rate per worker.
+ *
+ * Pool work needs no explicit split:  a worker takes the next header
+ * variants as soon as it finishes its last ones, so each engine
+ * already gets variants in proportion to its speed.  Bounded work
+ * (-benchmark, -replayrounds) is different, since every worker would
+ * otherwise hash the same number of variants of each unit and the
+ * fast engine would sit idle waiting for the slow one.  There,
+ * Quota() deals the unit's variants out by measured rate. */
+class CEngineScheduler {
+public:
+  CEngineScheduler();
+
+  void SetWorkers(unsigned int n_workers);
+
+  /* A call on this worker hashed nonces momentum nonces in micros */
+  void Record(unsigned int worker, uint64_t nonces, uint64_t micros);
+
+  /* Smoothed nonces per second, 0 before the first call */
+  double Rate(unsigned int worker) const;
+
+  /* This worker's part of the summed rate, 1/n_workers until every
+   * worker has been measured */
+  double Share(unsigned int worker) const;
+
+  /* Variants this worker should hash of a bounded unit that gives
+   * rounds_each to every worker:  the unit's total, split by Share(),
+   * and at least one each. */
+  unsigned int Quota(unsigned int worker, unsigned int rounds_each) const;
+
+private:
+  unsigned int n_workers;
+  boost::atomic<uint64_t> rate[SCHEDULER_MAX_WORKERS]; /* nonces per second */
+};
+
+#endif /* SCHEDULER_HPP */
@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+#include "selftest.hpp"
+#include "cpuhash.hpp"
+#include "protocol.hpp"
+
+extern "C" {
+#include "sph_sha2.h"
+}
+
+#define SELFTEST_N_SPOTS (1<<23)
+#define SELFTEST_SLICE 1024
+
+const uint8_t selftest_header[80] = {
+  0x02, 0x00, 0x00, 0x00, 0x0b, 0x30, 0x55, 0x7a, 0x9f, 0xc4, 0xe9, 0x0e,
+  0x33, 0x58, 0x7d, 0xa2, 0xc7, 0xec, 0x11, 0x36, 0x5b, 0x80, 0xa5, 0xca,
+  0xef, 0x14, 0x39, 0x5e, 0x83, 0xa8, 0xcd, 0xf2, 0x17, 0x3c, 0x61, 0x86,
+  0x05, 0x60, 0xbb, 0x16, 0x71, 0xcc, 0x27, 0x82, 0xdd, 0x38, 0x93, 0xee,
+  0x49, 0xa4, 0xff, 0x5a, 0xb5, 0x10, 0x6b, 0xc6, 0x21, 0x7c, 0xd7, 0x32,
+  0x8d, 0xe8, 0x43, 0x9e, 0xf9, 0x54, 0xaf, 0x0a, 0x80, 0xb7, 0xd9, 0x52,
+  0xff, 0xff, 0x00, 0x1d, 0x00, 0x00, 0x00, 0x00
+};
+
+static const uint8_t golden_midhash[32] = {
+  0xd4, 0x92, 0x79, 0x87, 0xa2, 0x32, 0x38, 0xf9, 0x79, 0x5d, 0x14, 0x97,
+  0x07, 0x24, 0xbe, 0xfd, 0x00, 0xbc, 0x2e, 0x20, 0x07, 0x09, 0x73, 0x77,
+  0xe4, 0x2a, 0xb5, 0x12, 0xdb, 0xd5, 0x2a, 0x57
+};
+
+/* FNV-1a over the little-endian bytes of every birthday in both slices */
+static const uint64_t golden_slice_digest = 0x22718a4971102f30ULL;
+
+struct GoldenCollision {
+  uint32_t nonceA, nonceB;
+  uint64_t birthday;
+};
+
+/* Every collision in the golden header's nonce space */
+static const GoldenCollision golden_collisions[] = {
+  { 18482104, 62894385, 0x33a0c85eb6952ULL }
+};
+static const int n_golden_collisions = sizeof(golden_collisions) / sizeof(golden_collisions[0]);
+
+/* The quick header is the golden one with nNonce 3654 */
+const uint8_t selftest_quick_header[80] = {
+  0x02, 0x00, 0x00, 0x00, 0x0b, 0x30, 0x55, 0x7a, 0x9f, 0xc4, 0xe9, 0x0e,
+  0x33, 0x58, 0x7d, 0xa2, 0xc7, 0xec, 0x11, 0x36, 0x5b, 0x80, 0xa5, 0xca,
+  0xef, 0x14, 0x39, 0x5e, 0x83, 0xa8, 0xcd, 0xf2, 0x17, 0x3c, 0x61, 0x86,
+  0x05, 0x60, 0xbb, 0x16, 0x71, 0xcc, 0x27, 0x82, 0xdd, 0x38, 0x93, 0xee,
+  0x49, 0xa4, 0xff, 0x5a, 0xb5, 0x10, 0x6b, 0xc6, 0x21, 0x7c, 0xd7, 0x32,
+  0x8d, 0xe8, 0x43, 0x9e, 0xf9, 0x54, 0xaf, 0x0a, 0x80, 0xb7, 0xd9, 0x52,
+  0xff, 0xff, 0x00, 0x1d, 0x46, 0x0e, 0x00, 0x00
+};
+
+static const uint8_t golden_quick_midhash[32] = {
+  0x57, 0xca, 0xa1, 0x89, 0x10, 0xbd, 0x53, 0xb4, 0xcd, 0xbf, 0x44, 0x70,
+  0x9f, 0xe9, 0xc5, 0x45, 0x6c, 0x1a, 0x9d, 0x7b, 0xfb, 0x98, 0xaf, 0x2f,
+  0x2e, 0xf8, 0xa6, 0xe7, 0x69, 0xae, 0x14, 0x6a
+};
+
+/* A collision among the quick header's first 2^MIN_INTENSITY nonces */
+static const GoldenCollision golden_quick_collisions[] = {
+  { 172997, 522221, 0x1e0bb41dee1dULL }
+};
+static const int n_golden_quick_collisions = sizeof(golden_quick_collisions) / sizeof(golden_quick_collisions[0]);
+
+static std::string hex64(uint64_t v) {
+  char buf[24];
+  snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)v);
+  return buf;
+}
+
+/* Scalar reference:  the 8 birthdays of one spot */
+static void reference_birthdays(const uint8_t midhash[32], uint32_t spot, uint64_t birthdays[8]) {
+  uint8_t msg[36], out[64];
+  uint32_t nonce = spot * 8;
+  memcpy(msg, &nonce, 4);
+  memcpy(msg + 4, midhash, 32);
+  sph_sha512_context c512;
+  sph_sha512_init(&c512);
+  sph_sha512(&c512, msg, 36);
+  sph_sha512_close(&c512, out);
+  for (int i = 0; i < 8; i++) {
+    memcpy(&birthdays[i], out + 8*i, 8);
+    birthdays[i] >>= 14;
+  }
+}
+
+uint64_t ReferenceBirthday(const uint8_t midhash[32], uint32_t nonce) {
+  uint64_t birthdays[8];
+  reference_birthdays(midhash, nonce / 8, birthdays);
+  return birthdays[nonce % 8];
+}
+
+bool SelfTestMidhash(const uint8_t midhash[32], std::string *error) {
+  uint8_t ref[32];
+  sph_sha256_context c256;
+  sph_sha256_init(&c256);
+  sph_sha256(&c256, selftest_header, 80);
+  sph_sha256_close(&c256, ref);
+  sph_sha256_init(&c256);
+  sph_sha256(&c256, ref, 32);
+  sph_sha256_close(&c256, ref);
+  if (memcmp(ref, golden_midhash, 32) != 0) {
+    *error = "sph_sha256 does not reproduce the golden midhash";
+    return false;
+  }
+  if (memcmp(midhash, golden_midhash, 32) != 0) {
+    *error = "midhash differs from the golden value";
+    return false;
+  }
+  return true;
+}
+
+bool SelfTestBirthdays(const uint64_t data[16], std::string *error) {
+  uint64_t D[5];
+  for (int i = 1; i < 5; i++)
+    D[i] = __builtin_bswap64(data[i]);
+
+  uint64_t digest = 0xcbf29ce484222325ULL;
+  for (int part = 0; part < 2; part++) {
+    uint32_t lo = part == 0 ? 0 : SELFTEST_N_SPOTS - SELFTEST_SLICE;
+    for (uint32_t spot = lo; spot < lo + SELFTEST_SLICE; spot++) {
+      uint64_t ref[8], H[8];
+      reference_birthdays(golden_midhash, spot, ref);
+      D[0] = (data[0] & 0xffffffff00000000ULL) | (spot*8);
+      cpu_sha512_block(H, D);
+      for (int i = 0; i < 8; i++) {
+	if ((H[i] >> 14) != ref[i]) {
+	  std::stringstream out;
+	  out << "sha512 birthday of nonce " << spot*8+i << " is " << hex64(H[i] >> 14)
+	      << ", sph_sha512 says " << hex64(ref[i]);
+	  *error = out.str();
+	  return false;
+	}
+	for (int b = 0; b < 8; b++) {
+	  digest ^= (ref[i] >> (8*b)) & 0xff;
+	  digest *= 0x100000001b3ULL;
+	}
+      }
+    }
+  }
+  if (digest != golden_slice_digest) {
+    *error = "birthdays agree with each other but not with the golden digest " + hex64(golden_slice_digest);
+    return false;
+  }
+  return true;
+}
+
+/* One engine round at the engine's intensity:  every candidate must
+ * carry its true birthday (for midhash) and every collision listed
+ * must be among them */
+static bool check_round(Hasher *hasher, const uint64_t data[16], const uint8_t midhash[32],
+			const GoldenCollision *collisions, int n_collisions, std::string *error) {
+  uint64_t *results = (uint64_t *)malloc(sizeof(uint64_t) * Hasher::N_RESULTS);
+  if (results == NULL) {
+    *error = "out of memory";
+    return false;
+  }
+  memset(results, 0, sizeof(uint64_t) * Hasher::N_RESULTS);
+  const uint64_t (*batch)[16] = (const uint64_t (*)[16])data;
+  if (hasher->ComputeHashes(batch, results, 1) != 0) {
+    free(results);
+    *error = "engine call failed";
+    return false;
+  }
+
+  uint32_t n_results = *((uint32_t *)results);
+  if (n_results > Hasher::N_RESULT_SLOTS)
+    n_results = Hasher::N_RESULT_SLOTS;
+  std::vector<int> found(n_collisions * 2, 0);
+  bool ok = true;
+  for (uint32_t i = 0; i < n_results && ok; i++) {
+    uint64_t birthday = results[1+i*2];
+    uint32_t nonce = results[1+i*2+1];
+    uint64_t ref[8];
+    reference_birthdays(midhash, nonce / 8, ref);
+    if (ref[nonce % 8] != birthday) {
+      std::stringstream out;
+      out << "candidate nonce " << nonce << " has birthday " << hex64(birthday)
+	  << ", sph_sha512 says " << hex64(ref[nonce % 8]);
+      *error = out.str();
+      ok = false;
+    } else if (!hasher->InPartition(birthday)) {
+      std::stringstream out;
+      out << "candidate nonce " << nonce << " is outside partition " << hasher->GetPartitionIndex()
+	  << " of " << hasher->GetPartitionCount();
+      *error = out.str();
+      ok = false;
+    }
+    for (int c = 0; c < n_collisions; c++) {
+      if (nonce == collisions[c].nonceA)
+	found[c*2] = 1;
+      if (nonce == collisions[c].nonceB)
+	found[c*2+1] = 1;
+    }
+  }
+  for (int c = 0; c < n_collisions && ok; c++) {
+    /* a partitioned engine finds only the collisions in its partition */
+    if (!hasher->InPartition(collisions[c].birthday))
+      continue;
+    if (!found[c*2] || !found[c*2+1]) {
+      std::stringstream out;
+      out << "missed collision " << collisions[c].nonceA << " <-> " << collisions[c].nonceB
+	  << " (" << n_results << " candidates)";
+      *error = out.str();
+      ok = false;
+    }
+  }
+  free(results);
+  return ok;
+}
+
+bool SelfTestEngine(Hasher *hasher, const uint64_t data[16], std::string *error) {
+  int intensity = hasher->GetIntensity();
+  hasher->SetIntensity(Hasher::MAX_INTENSITY);
+  bool ok = check_round(hasher, data, golden_midhash, golden_collisions, n_golden_collisions, error);
+  hasher->SetIntensity(intensity);
+  return ok;
+}
+
+bool SelfTestEngineQuick(Hasher *hasher, const uint64_t data[16], std::string *error) {
+  int intensity = hasher->GetIntensity();
+  hasher->SetIntensity(Hasher::MIN_INTENSITY);
+  bool ok = check_round(hasher, data, golden_quick_midhash, golden_quick_collisions, n_golden_quick_collisions, error);
+  hasher->SetIntensity(intensity);
+  return ok;
+}
+
+bool SelfTestReconnect(std::string *error) {
+  static const uint64_t min_us = 1000, max_us = 64000;
+  CReconnectPolicy policy(300, min_us, max_us, 1);
+  boost::asio::ip::tcp::endpoint ep(boost::asio::ip::address_v4::loopback(), 1);
+  uint64_t last = 0;
+  for (int cycle = 0; cycle < 8; cycle++) {
+    /* the pool takes the connection, then drops it before any work */
+    policy.Connected(ep);
+    uint64_t limit = policy.Limit();
+    uint64_t delay = policy.NextDelay(false);
+    if (delay > limit || (cycle > 0 && limit < max_us && limit <= last)) {
+      std::stringstream out;
+      out << "reconnect " << cycle << " after a dropped connection may wait up to " << limit
+	  << " us, after " << last << " us the time before";
+      *error = out.str();
+      return false;
+    }
+    last = limit;
+  }
+  if (last != max_us) {
+    *error = "the reconnect backoff never reached its limit";
+    return false;
+  }
+  policy.Established();
+  if (policy.Limit() != min_us) {
+    *error = "the reconnect backoff didn't reset once the pool sent work";
+    return false;
+  }
+  return true;
+}
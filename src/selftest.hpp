@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#ifndef SELFTEST_HPP
+#define SELFTEST_HPP
+
+#include <inttypes.h>
+#include <string>
+#include "hasher.h"
+
+/* Known-answer tests for the hashing pipeline.  A miscompiled build or
+ * an unstable (overclocked) device otherwise just looks like a low
+ * share rate.  Each check returns false and describes the first
+ * mismatch in *error. */
+
+/* Scalar reference (sph_sha512 on the 36-byte message):  the 50-bit
+ * birthday of one nonce for a given midHash. */
+uint64_t ReferenceBirthday(const uint8_t midhash[32], uint32_t nonce);
+
+/* Fixed header the tests are built on */
+extern const uint8_t selftest_header[80];
+/* The same with an nNonce whose first 2^MIN_INTENSITY momentum nonces
+ * hold a collision, for the quick engine check */
+extern const uint8_t selftest_quick_header[80];
+
+/* midHash (double SHA-256 of the header) against the golden value
+ * and a fresh SPH computation. */
+bool SelfTestMidhash(const uint8_t midhash[32], std::string *error);
+
+/* Birthdays for two slices of the nonce space (1024 spots at each
+ * end), computed from the padded SHA-512 block in data with the CPU
+ * engine's sha512 and with sph_sha512 on the raw 36-byte message, and
+ * checked against each other and a golden digest.  A few ms. */
+bool SelfTestBirthdays(const uint64_t data[16], std::string *error);
+
+/* One full engine round on the golden header: every candidate must
+ * carry its true birthday and the known collision must be among them.
+ * A partitioned engine must stay in its partition, and is only
+ * expected to find the collision if it falls there.  Seconds on a
+ * CPU; for -selftest. */
+bool SelfTestEngine(Hasher *hasher, const uint64_t data[16], std::string *error);
+
+/* The same checks on one round at the lowest intensity, on the quick
+ * header's SHA-512 block:  1/64 of the work, for every start.  Both
+ * leave the engine's intensity as they found it. */
+bool SelfTestEngineQuick(Hasher *hasher, const uint64_t data[16], std::string *error);
+
+/* The reconnect backoff:  a pool that accepts connections and drops
+ * them before sending work must be retried less and less often, and
+ * the backoff must reset once one sends work.  Only for -selftest:
+ * it isn't part of the hashing, so it never stops a miner starting. */
+bool SelfTestReconnect(std::string *error);
+
+#endif /* SELFTEST_HPP */
@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <boost/atomic.hpp>
+#include "spillhash.hpp"
+#include "cpuhash.hpp"
+#include "affinity.hpp"
+
+#if !defined(__MINGW32__) && !defined(__MINGW64__)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+#define MOMENTUM_N_HASHES (1<<26)
+#define MOMENTUM_N_SPOTS (MOMENTUM_N_HASHES/8)
+#define NONCE_BITS 26
+#define NONCE_MASK ((1<<NONCE_BITS)-1)
+
+/* A record is the birthday below the bucket bits, then the nonce */
+#define LOW_BITS (50 - CSpillHasher::BUCKET_BITS)
+#define LOW_MASK ((1ULL<<LOW_BITS)-1)
+
+#define SWAP64(n) __builtin_bswap64(n)
+
+enum { SPILL_WRITTEN = 0, SPILL_READ, SPILL_HASH_US, SPILL_WRITE_US, SPILL_READ_US, SPILL_DEDUP_US, N_SPILL_TOTALS };
+static boost::atomic<uint64_t> spill_totals[N_SPILL_TOTALS];
+
+SpillStats GetSpillStats() {
+  SpillStats s;
+  s.bytes_written = spill_totals[SPILL_WRITTEN].load(boost::memory_order_relaxed);
+  s.bytes_read = spill_totals[SPILL_READ].load(boost::memory_order_relaxed);
+  s.hash_us = spill_totals[SPILL_HASH_US].load(boost::memory_order_relaxed);
+  s.write_us = spill_totals[SPILL_WRITE_US].load(boost::memory_order_relaxed);
+  s.read_us = spill_totals[SPILL_READ_US].load(boost::memory_order_relaxed);
+  s.dedup_us = spill_totals[SPILL_DEDUP_US].load(boost::memory_order_relaxed);
+  return s;
+}
+
+static inline uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+CSpillHasher::CSpillHasher(int threads, int batch, const std::string& spill_dir) {
+  n_threads = threads;
+  if (n_threads < 1) n_threads = 1;
+  max_batch = batch;
+  if (max_batch < 1) max_batch = 1;
+  if (max_batch > MAX_BATCH) max_batch = MAX_BATCH;
+  dir = spill_dir;
+  fd = -1;
+  table = NULL;
+  table_bytes = 0;
+  /* A bucket's share of 2^26 records is binomial:  1/8 over the mean
+   * is 16 standard deviations. */
+  bucket_slots = (MOMENTUM_N_HASHES / N_BUCKETS) + (MOMENTUM_N_HASHES / N_BUCKETS) / 8;
+  bucket_fill = NULL;
+  job_data = NULL;
+  job_results = NULL;
+  job_batch = 0;
+  job_spots = 0;
+  shutdown = false;
+  start_barrier = NULL;
+  phase_barrier = NULL;
+}
+
+void CSpillHasher::SetAffinity(const std::vector<int>& cpu_list) {
+  cpus = cpu_list;
+}
+
+int CSpillHasher::Initialize() {
+#if defined(__MINGW32__) || defined(__MINGW64__)
+  fprintf(stderr, "The spill engine needs mmap\n");
+  return -1;
+#else
+  std::string path = dir + "/cudapts-spill-XXXXXX";
+  std::vector<char> name(path.begin(), path.end());
+  name.push_back('\0');
+  fd = mkstemp(&name[0]);
+  if (fd < 0) {
+    fprintf(stderr, "Could not create a spill file in %s\n", dir.c_str());
+    return -1;
+  }
+  /* Gone as soon as we are */
+  unlink(&name[0]);
+  table_bytes = sizeof(uint64_t) * bucket_slots * N_BUCKETS;
+  if (ftruncate(fd, table_bytes) != 0) {
+    fprintf(stderr, "Could not size the spill file in %s\n", dir.c_str());
+    return -1;
+  }
+  void *p = mmap(NULL, table_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "Could not map the spill file in %s\n", dir.c_str());
+    return -1;
+  }
+  table = (uint64_t *)p;
+  bucket_fill = new uint32_t[N_BUCKETS];
+  memset(bucket_fill, 0, sizeof(uint32_t) * N_BUCKETS);
+  pending.resize(n_threads);
+  pending_fill.resize(n_threads);
+  read_us.assign(n_threads, 0);
+  dedup_us.assign(n_threads, 0);
+  printf("Initializing.  Spill engine with %d threads\n", n_threads);
+  printf("  spill file: %luMB in %s, %d buckets\n", (unsigned long)(table_bytes >> 20), dir.c_str(), N_BUCKETS);
+
+  start_barrier = new boost::barrier(n_threads+1);
+  phase_barrier = new boost::barrier(n_threads);
+  for (int i = 0; i < n_threads; i++)
+    threads.create_thread(boost::bind(&CSpillHasher::thread_main, this, i));
+  start_barrier->wait();
+  return 0;
+#endif
+}
+
+CSpillHasher::~CSpillHasher() {
+  if (start_barrier != NULL) {
+    shutdown = true;
+    start_barrier->wait();
+    threads.join_all();
+    delete start_barrier;
+    delete phase_barrier;
+  }
+#if !defined(__MINGW32__) && !defined(__MINGW64__)
+  if (table != NULL)
+    munmap(table, table_bytes);
+  if (fd >= 0)
+    close(fd);
+#endif
+  delete[] bucket_fill;
+}
+
+void CSpillHasher::thread_main(int id) {
+  if (!cpus.empty()) {
+    std::vector<int> mine(1, cpus[id % cpus.size()]);
+    SetThreadAffinity(mine);
+  }
+  pending[id].assign(N_BUCKETS * 8, 0);
+  pending_fill[id].assign(N_BUCKETS, 0);
+
+  start_barrier->wait();
+  while (true) {
+    start_barrier->wait();
+    if (shutdown)
+      break;
+    for (int b = 0; b < job_batch; b++)
+      search_one(id, job_data[b], job_results + b*N_RESULTS);
+    start_barrier->wait();
+  }
+}
+
+/* Records are gathered eight to a bucket (one cache line) and then
+ * appended with a single reservation, so the file sees runs of
+ * sequential writes rather than single words. */
+inline void CSpillHasher::append(int id, uint32_t bucket, uint64_t record) {
+  uint8_t& fill = pending_fill[id][bucket];
+  pending[id][bucket*8 + fill] = record;
+  if (++fill == 8)
+    flush(id, bucket);
+}
+
+void CSpillHasher::flush(int id, uint32_t bucket) {
+  uint8_t& fill = pending_fill[id][bucket];
+  if (fill == 0)
+    return;
+  uint32_t slot = __sync_fetch_and_add(&bucket_fill[bucket], fill);
+  if (slot < bucket_slots) {
+    size_t n = std::min<size_t>(fill, bucket_slots - slot);
+    memcpy(table + bucket*bucket_slots + slot, &pending[id][bucket*8], sizeof(uint64_t) * n);
+  }
+  fill = 0;
+}
+
+/* Writes the stage out, so the dirty pages never outgrow one stage;
+ * what's left in the page cache is clean and the kernel may drop it. */
+void CSpillHasher::sync_file() {
+#if !defined(__MINGW32__) && !defined(__MINGW64__)
+  msync(table, table_bytes, MS_SYNC);
+#endif
+}
+
+void CSpillHasher::search_one(int id, const uint64_t data[16], uint64_t *results) {
+  uint64_t D[5];
+  for (int i = 1; i < 5; i++)
+    D[i] = SWAP64(data[i]);
+
+  /* Hash and spill, one stage at a time */
+  uint64_t hash_wall = 0, write_wall = 0;
+  for (int stage = 0; stage < N_STAGES; stage++) {
+    uint64_t t0 = now_us();
+    uint32_t first = (uint64_t)job_spots * stage / N_STAGES;
+    uint32_t last = (uint64_t)job_spots * (stage+1) / N_STAGES;
+    uint32_t lo = first + (uint64_t)(last-first) * id / n_threads;
+    uint32_t hi = first + (uint64_t)(last-first) * (id+1) / n_threads;
+    for (uint32_t spot = lo; spot < hi; spot++) {
+      uint64_t H[8];
+      D[0] = (data[0] & 0xffffffff00000000ULL) | (spot*8);
+      cpu_sha512_block(H, D);
+      for (int i = 0; i < 8; i++) {
+	uint64_t birthday = H[i] >> 14;
+	append(id, birthday >> LOW_BITS, ((birthday & LOW_MASK) << NONCE_BITS) | (spot*8 + i));
+      }
+    }
+    for (uint32_t b = 0; b < (uint32_t)N_BUCKETS; b++)
+      flush(id, b);
+    phase_barrier->wait();
+    if (id == 0) {
+      uint64_t t1 = now_us();
+      sync_file();
+      hash_wall += t1 - t0;
+      write_wall += now_us() - t1;
+    }
+    phase_barrier->wait();
+  }
+
+  /* Read each bucket back and keep the records whose birthday shows
+   * up more than once */
+  uint64_t t0 = now_us();
+  std::vector<uint64_t> bucket;
+  uint64_t records = 0;
+  read_us[id] = 0;
+  dedup_us[id] = 0;
+  for (uint32_t b = id; b < (uint32_t)N_BUCKETS; b += n_threads) {
+    uint64_t t1 = now_us();
+    size_t n = std::min<size_t>(bucket_fill[b], bucket_slots);
+    bucket.assign(table + b*bucket_slots, table + b*bucket_slots + n);
+    bucket_fill[b] = 0;
+    records += n;
+    uint64_t t2 = now_us();
+    std::sort(bucket.begin(), bucket.end());
+    for (size_t i = 0; i < n; ) {
+      size_t j = i + 1;
+      while (j < n && (bucket[j] >> NONCE_BITS) == (bucket[i] >> NONCE_BITS))
+	j++;
+      for (size_t k = i; j - i > 1 && k < j; k++) {
+	uint32_t result_slot = __sync_fetch_and_add((uint32_t *)results, 1);
+	if (result_slot < (uint32_t)N_RESULT_SLOTS) {
+	  results[result_slot*2+1] = ((uint64_t)b << LOW_BITS) | (bucket[k] >> NONCE_BITS);
+	  results[result_slot*2+2] = bucket[k] & NONCE_MASK;
+	}
+      }
+      i = j;
+    }
+    read_us[id] += t2 - t1;
+    dedup_us[id] += now_us() - t2;
+  }
+  spill_totals[SPILL_WRITTEN] += records * sizeof(uint64_t);
+  spill_totals[SPILL_READ] += records * sizeof(uint64_t);
+  phase_barrier->wait();
+
+  /* The bucket pass is one wall-clock phase; split it by where the
+   * threads spent their time */
+  if (id == 0) {
+    uint64_t wall = now_us() - t0, reading = 0, sorting = 0;
+    for (int i = 0; i < n_threads; i++) {
+      reading += read_us[i];
+      sorting += dedup_us[i];
+    }
+    uint64_t read_wall = reading + sorting > 0 ? wall * reading / (reading + sorting) : 0;
+    spill_totals[SPILL_HASH_US] += hash_wall;
+    spill_totals[SPILL_WRITE_US] += write_wall;
+    spill_totals[SPILL_READ_US] += read_wall;
+    spill_totals[SPILL_DEDUP_US] += wall - read_wall;
+  }
+  phase_barrier->wait();
+}
+
+int CSpillHasher::ComputeHashes(const uint64_t data[][16], uint64_t *results, int n_batch) {
+  if (n_batch < 1 || n_batch > max_batch) {
+    fprintf(stderr, "Bad batch size %d (max %d)\n", n_batch, max_batch);
+    return -1;
+  }
+  for (int b = 0; b < n_batch; b++)
+    results[b*N_RESULTS] = 0;
+
+  job_data = data;
+  job_results = results;
+  job_batch = n_batch;
+  job_spots = (uint32_t)1 << (intensity-3);
+  start_barrier->wait();
+  start_barrier->wait();
+  return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#ifndef SPILLHASH_HPP
+#define SPILLHASH_HPP
+
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+#include "hasher.h"
+
+/* Out-of-core engine (-engine=spill) for hosts that can't hold the
+ * CPU engine's tables.  A round hashes the nonce space in stages and
+ * appends each (birthday, nonce) record to one of 4096 buckets, by
+ * the birthday's top 12 bits.  The buckets are regions of one file
+ * in -spilldir, mapped shared, and are synced to disk after every
+ * stage so the dirty pages never add up to more than a stage.  Then
+ * each bucket is read back, sorted and scanned for equal birthdays.
+ * Only true collisions come back, in the usual result layout.
+ *
+ * Memory is a write buffer of 256KB per thread plus the page cache,
+ * which the kernel may reclaim; the file is ~600MB. */
+class CSpillHasher : public Hasher {
+public:
+  CSpillHasher(int n_threads, int max_batch, const std::string& dir);
+  void SetAffinity(const std::vector<int>& cpus);
+  int Initialize();
+  int ComputeHashes(const uint64_t data[][16], uint64_t *hashes, int n_batch);
+  ~CSpillHasher();
+
+  static const int BUCKET_BITS = 12;
+  static const int N_BUCKETS = (1 << BUCKET_BITS);
+  static const int N_STAGES = 16;
+
+ private:
+  void thread_main(int id);
+  void search_one(int id, const uint64_t data[16], uint64_t *results);
+  void append(int id, uint32_t bucket, uint64_t record);
+  void flush(int id, uint32_t bucket);
+  void sync_file();
+
+  int n_threads;
+  int max_batch;
+  std::string dir;
+  std::vector<int> cpus;
+  int fd;
+  uint64_t *table;       /* the mapped file */
+  size_t table_bytes;
+  size_t bucket_slots;   /* records each bucket region holds */
+  uint32_t *bucket_fill; /* records appended to each bucket this round */
+  std::vector<std::vector<uint64_t> > pending; /* per thread, 8 per bucket */
+  std::vector<std::vector<uint8_t> > pending_fill;
+  std::vector<uint64_t> read_us, dedup_us;     /* per thread, this round */
+
+  const uint64_t (*job_data)[16];
+  uint64_t *job_results;
+  int job_batch;
+  uint32_t job_spots;
+  bool shutdown;
+
+  boost::thread_group threads;
+  boost::barrier *start_barrier; /* engine threads + caller */
+  boost::barrier *phase_barrier; /* engine threads only */
+};
+
+/* Totals over every spill engine in the process, for the stats line,
+ * the metrics and the benchmark.  Times are wall clock:  hashing
+ * (including the appends), syncing the stages to disk, reading the
+ * buckets back and sorting them. */
+struct SpillStats {
+  uint64_t bytes_written;
+  uint64_t bytes_read;
+  uint64_t hash_us;
+  uint64_t write_us;
+  uint64_t read_us;
+  uint64_t dedup_us;
+};
+
+SpillStats GetSpillStats();
+
+#endif /* SPILLHASH_HPP */
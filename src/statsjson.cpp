@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#include <cstring>
+#include <cerrno>
+
+#include "statsjson.hpp"
+
+#if !defined(__MINGW32__) && !defined(__MINGW64__)
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#define HAVE_UNIX_SOCKETS 1
+#endif
+
+/* Most queued events we keep if the sink can't keep up */
+#define STATS_QUEUE_MAX 10000
+
+CStatsStream::CStatsStream()
+  : _is_socket(false), _file(NULL), _fd(-1), _interval(60), _dropped(0), _stop(false), _thread(NULL) { }
+
+CStatsStream::~CStatsStream() {
+  Close();
+}
+
+bool CStatsStream::Open(const std::string& target, unsigned int interval_secs, IntervalFn interval_fn) {
+  _target = target;
+  _interval = interval_secs > 0 ? interval_secs : 60;
+  _interval_fn = interval_fn;
+  if (target.compare(0, 5, "unix:") == 0) {
+#ifdef HAVE_UNIX_SOCKETS
+    _is_socket = true;
+    _target = target.substr(5);
+    connect_socket(); /* not fatal, the aggregator may start later */
+#else
+    return false;
+#endif
+  } else {
+    _file = fopen(target.c_str(), "a");
+    if (_file == NULL)
+      return false;
+  }
+  _stop = false;
+  _thread = new boost::thread(boost::bind(&CStatsStream::thread_main, this));
+  return true;
+}
+
+void CStatsStream::Close() {
+  if (_thread != NULL) {
+    {
+      boost::mutex::scoped_lock lock(_mutex);
+      _stop = true;
+      _cond.notify_all();
+    }
+    _thread->join();
+    delete _thread;
+    _thread = NULL;
+  }
+  if (_file != NULL) {
+    fclose(_file);
+    _file = NULL;
+  }
+#ifdef HAVE_UNIX_SOCKETS
+  if (_fd >= 0) {
+    close(_fd);
+    _fd = -1;
+  }
+#endif
+}
+
+void CStatsStream::Emit(const std::string& json) {
+  boost::mutex::scoped_lock lock(_mutex);
+  if (_thread == NULL)
+    return;
+  if (_queue.size() >= STATS_QUEUE_MAX) {
+    _dropped++;
+    return;
+  }
+  _queue.push_back(json);
+  _cond.notify_all();
+}
+
+bool CStatsStream::connect_socket() {
+#ifdef HAVE_UNIX_SOCKETS
+  if (_fd >= 0)
+    return true;
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, _target.c_str(), sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return false;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return false;
+  }
+  _fd = fd;
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool CStatsStream::write_line(const std::string& line) {
+  if (_file != NULL) {
+    fputs(line.c_str(), _file);
+    fputc('\n', _file);
+    return true;
+  }
+#ifdef HAVE_UNIX_SOCKETS
+  if (_fd < 0)
+    return false;
+  std::string buf = line + "\n";
+  size_t off = 0;
+  while (off < buf.size()) {
+#ifdef MSG_NOSIGNAL
+    ssize_t n = send(_fd, buf.data() + off, buf.size() - off, MSG_NOSIGNAL);
+#else
+    ssize_t n = write(_fd, buf.data() + off, buf.size() - off);
+#endif
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      close(_fd);
+      _fd = -1;
+      return false;
+    }
+    off += n;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+void CStatsStream::thread_main() {
+  boost::system_time next = boost::get_system_time() + boost::posix_time::seconds(_interval);
+  while (true) {
+    std::deque<std::string> lines;
+    bool interval_due = false;
+    bool stop;
+    {
+      boost::mutex::scoped_lock lock(_mutex);
+      while (!_stop && _queue.empty() && boost::get_system_time() < next)
+	_cond.timed_wait(lock, next);
+      lines.swap(_queue);
+      stop = _stop;
+      if (boost::get_system_time() >= next) {
+	interval_due = true;
+	next += boost::posix_time::seconds(_interval);
+      }
+    }
+    /* A missing aggregator costs one connect per interval, not one
+     * per line */
+    if (interval_due && _is_socket)
+      connect_socket();
+    uint64_t failed = 0;
+    for (size_t i = 0; i < lines.size(); i++)
+      if (!write_line(lines[i]))
+	failed++;
+    if (interval_due && _interval_fn) {
+      uint64_t dropped;
+      {
+	boost::mutex::scoped_lock lock(_mutex);
+	dropped = _dropped + failed;
+	_dropped = 0;
+      }
+      failed = write_line(_interval_fn(dropped)) ? 0 : dropped + 1;
+    }
+    if (failed > 0) {
+      boost::mutex::scoped_lock lock(_mutex);
+      _dropped += failed;
+    }
+    if (_file != NULL)
+      fflush(_file);
+    if (stop)
+      break;
+  }
+}
+
+std::string JsonEscape(const std::string& s) {
+  std::string out;
+  for (size_t i = 0; i < s.size(); i++) {
+    char c = s[i];
+    switch (c) {
+    case '"': out += "\\\""; break;
+    case '\\': out += "\\\\"; break;
+    case '\n': out += "\\n"; break;
+    case '\r': out += "\\r"; break;
+    case '\t': out += "\\t"; break;
+    default:
+      if ((unsigned char)c < 0x20) {
+	char buf[8];
+	snprintf(buf, sizeof(buf), "\\u%04x", c);
+	out += buf;
+      } else
+	out += c;
+    }
+  }
+  return out;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#ifndef STATSJSON_HPP
+#define STATSJSON_HPP
+
+#include <inttypes.h>
+#include <string>
+#include <deque>
+#include <cstdio>
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+
+/* Newline-delimited JSON stats for log shippers and aggregators.  A
+ * background thread writes one interval record every few seconds (built
+ * by a callback) plus any event records queued with Emit().  Nothing
+ * is written on the caller's thread.  Lines that can't be written (no
+ * socket, or the queue full) are dropped and counted; the callback is
+ * passed how many were lost since the last interval record that went
+ * out. */
+class CStatsStream {
+public:
+  typedef boost::function<std::string (uint64_t lines_dropped)> IntervalFn;
+
+  CStatsStream();
+  ~CStatsStream();
+
+  /* target is a file name (appended to) or "unix:/path" for a
+   * listening Unix stream socket, reconnected at most once per
+   * interval while it's down. */
+  bool Open(const std::string& target, unsigned int interval_secs, IntervalFn interval_fn);
+  void Close();
+
+  /* Queue one JSON object (without the trailing newline) */
+  void Emit(const std::string& json);
+
+private:
+  void thread_main();
+  bool write_line(const std::string& line);
+  bool connect_socket();
+
+  std::string _target;
+  bool _is_socket;
+  FILE *_file;
+  int _fd;
+  unsigned int _interval;
+  IntervalFn _interval_fn;
+
+  boost::mutex _mutex;
+  boost::condition_variable _cond;
+  std::deque<std::string> _queue;
+  uint64_t _dropped;
+  bool _stop;
+  boost::thread *_thread;
+};
+
+/* Helpers for building records by hand */
+std::string JsonEscape(const std::string& s);
+
+#endif /* STATSJSON_HPP */
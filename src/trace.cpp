@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#include <cstring>
+
+#include "trace.hpp"
+#include "metrics.hpp"
+
+static const char trace_magic[8] = { 'P', 'T', 'S', 'T', 'R', 'A', 'C', 'E' };
+
+CTraceWriter::CTraceWriter() : _file(NULL), _start_us(0) { }
+
+CTraceWriter::~CTraceWriter() {
+  Close();
+}
+
+bool CTraceWriter::Open(const std::string& path) {
+  _file = fopen(path.c_str(), "wb");
+  if (_file == NULL)
+    return false;
+  uint32_t version = TRACE_VERSION;
+  if (fwrite(trace_magic, sizeof(trace_magic), 1, _file) != 1 ||
+      fwrite(&version, sizeof(version), 1, _file) != 1) {
+    fclose(_file);
+    _file = NULL;
+    return false;
+  }
+  fflush(_file);
+  _start_us = MonotonicMicros();
+  return true;
+}
+
+void CTraceWriter::Close() {
+  boost::mutex::scoped_lock lock(_mutex);
+  if (_file != NULL) {
+    fclose(_file);
+    _file = NULL;
+  }
+}
+
+void CTraceWriter::Record(TraceRecordType type, const void *data, unsigned int len) {
+  if (len > TRACE_MAX_PAYLOAD)
+    len = TRACE_MAX_PAYLOAD;
+  unsigned char head[12];
+  uint64_t ts = MonotonicMicros() - _start_us;
+  head[0] = type;
+  head[1] = len;
+  head[2] = head[3] = 0;
+  memcpy(head + 4, &ts, 8);
+
+  boost::mutex::scoped_lock lock(_mutex);
+  if (_file == NULL)
+    return;
+  fwrite(head, sizeof(head), 1, _file);
+  if (len > 0)
+    fwrite(data, len, 1, _file);
+  fflush(_file);
+}
+
+CTraceReader::CTraceReader() : _file(NULL) { }
+
+CTraceReader::~CTraceReader() {
+  if (_file != NULL)
+    fclose(_file);
+}
+
+bool CTraceReader::Open(const std::string& path) {
+  _file = fopen(path.c_str(), "rb");
+  if (_file == NULL)
+    return false;
+  char magic[8];
+  uint32_t version;
+  if (fread(magic, sizeof(magic), 1, _file) != 1 || memcmp(magic, trace_magic, sizeof(magic)) != 0 ||
+      fread(&version, sizeof(version), 1, _file) != 1 || version != TRACE_VERSION) {
+    fclose(_file);
+    _file = NULL;
+    return false;
+  }
+  return true;
+}
+
+bool CTraceReader::Next(TraceRecord *rec) {
+  unsigned char head[12];
+  if (_file == NULL || fread(head, sizeof(head), 1, _file) != 1)
+    return false;
+  rec->type = head[0];
+  rec->len = head[1];
+  memcpy(&rec->ts_us, head + 4, 8);
+  if (rec->len > TRACE_MAX_PAYLOAD)
+    return false;
+  if (rec->len > 0 && fread(rec->data, rec->len, 1, _file) != 1)
+    return false;
+  return true;
+}
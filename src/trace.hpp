@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <inttypes.h>
+#include <cstdio>
+#include <string>
+#include <boost/thread.hpp>
+
+/* Binary trace of a mining session, for replaying real work offline.
+ *
+ * The file starts with the 8-byte magic "PTSTRACE" and a 4-byte
+ * version, followed by records of
+ *
+ *   | type (1) | length (1) | reserved (2) | ts_us (8) | payload (length) |
+ *
+ * in host byte order.  ts_us is microseconds since the trace was
+ * opened.  Payloads:
+ *
+ *   TRACE_CONNECT     session (4)
+ *   TRACE_WORK        the 112-byte type 0 frame from the pool
+ *   TRACE_SUBMIT      worker (4) + session (4) + the 88-byte submitted header
+ *   TRACE_RESPONSE    session (4) + the pool's 4-byte answer to a share
+ *   TRACE_DISCONNECT  session (4)
+ *
+ * A session switched away from still answers its shares while the
+ * next one is mined, so submits and answers are matched per session.
+ * CONNECT marks the session the work now comes from; DISCONNECT is
+ * written when a session is closed.
+ */
+
+enum TraceRecordType {
+  TRACE_CONNECT = 1,
+  TRACE_WORK,
+  TRACE_SUBMIT,
+  TRACE_RESPONSE,
+  TRACE_DISCONNECT
+};
+
+#define TRACE_VERSION 2
+#define TRACE_MAX_PAYLOAD 128
+
+struct TraceRecord {
+  uint8_t type;
+  uint8_t len;
+  uint64_t ts_us;
+  unsigned char data[TRACE_MAX_PAYLOAD];
+};
+
+/* Appends records; safe to call from any thread.  Each record is
+ * flushed as it is written, so a crash loses at most the last one. */
+class CTraceWriter {
+public:
+  CTraceWriter();
+  ~CTraceWriter();
+
+  bool Open(const std::string& path);
+  void Close();
+  void Record(TraceRecordType type, const void *data = NULL, unsigned int len = 0);
+
+private:
+  boost::mutex _mutex;
+  FILE *_file;
+  uint64_t _start_us;
+};
+
+class CTraceReader {
+public:
+  CTraceReader();
+  ~CTraceReader();
+
+  /* false if the file is missing or isn't a trace of this version */
+  bool Open(const std::string& path);
+  /* false at end of file or on a truncated record */
+  bool Next(TraceRecord *rec);
+
+private:
+  FILE *_file;
+};
+
+#endif /* TRACE_HPP */
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#include <cstring>
+
+#include "verifier.hpp"
+#include "selftest.hpp"
+#include "affinity.hpp"
+#include "asynclog.hpp"
+#include "metrics.hpp"
+
+static const char *health_names[] = { "healthy", "throttled", "quarantined" };
+
+CCollisionVerifier::CCollisionVerifier(double rate, double max_error, unsigned int cooldown_secs)
+  : rate(rate), max_error(max_error), cooldown_secs(cooldown_secs), dropped(0), stop(false), thread(NULL) {
+  for (int i = 0; i < VERIFIER_MAX_WORKERS; i++) {
+    workers[i].checked = 0;
+    workers[i].errors = 0;
+    workers[i].health = HEALTHY;
+    workers[i].quarantine_until_us = 0;
+    workers[i].error_ppm = 0;
+    workers[i].window_checked = 0;
+    workers[i].window_errors = 0;
+    workers[i].sample_credit = 0;
+  }
+}
+
+CCollisionVerifier::~CCollisionVerifier() {
+  Stop();
+}
+
+void CCollisionVerifier::Start(const std::vector<int>& cpus) {
+  thread = new boost::thread(boost::bind(&CCollisionVerifier::thread_main, this, cpus));
+}
+
+void CCollisionVerifier::Stop() {
+  if (thread == NULL)
+    return;
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    stop = true;
+    cond.notify_all();
+  }
+  thread->join();
+  delete thread;
+  thread = NULL;
+}
+
+void CCollisionVerifier::Sample(unsigned int worker, const uint8_t midhash[32], uint32_t nonceA, uint32_t nonceB, uint64_t birthday) {
+  WorkerState& w = workers[worker % VERIFIER_MAX_WORKERS];
+  w.sample_credit += rate;
+  if (w.sample_credit < 1)
+    return;
+  w.sample_credit -= 1;
+
+  Job job;
+  job.worker = worker % VERIFIER_MAX_WORKERS;
+  memcpy(job.midhash, midhash, 32);
+  job.nonce[0] = nonceA;
+  job.nonce[1] = nonceB;
+  job.birthday = birthday;
+  boost::mutex::scoped_lock lock(mutex);
+  if (queue.size() >= QUEUE_MAX) {
+    dropped.fetch_add(1, boost::memory_order_relaxed);
+    return;
+  }
+  queue.push_back(job);
+  cond.notify_one();
+}
+
+uint64_t CCollisionVerifier::PauseMicros(unsigned int worker, uint64_t last_round_us) {
+  WorkerState& w = workers[worker % VERIFIER_MAX_WORKERS];
+  switch (w.health.load(boost::memory_order_relaxed)) {
+  case THROTTLED:
+    return last_round_us;
+  case QUARANTINED: {
+    uint64_t now = MonotonicMicros();
+    uint64_t until = w.quarantine_until_us.load(boost::memory_order_relaxed);
+    /* probation until the next check moves it on */
+    return until > now ? until - now : last_round_us;
+  }
+  default:
+    return 0;
+  }
+}
+
+CCollisionVerifier::Health CCollisionVerifier::GetHealth(unsigned int worker) const {
+  return (Health)workers[worker % VERIFIER_MAX_WORKERS].health.load(boost::memory_order_relaxed);
+}
+
+double CCollisionVerifier::ErrorRate(unsigned int worker) const {
+  return workers[worker % VERIFIER_MAX_WORKERS].error_ppm.load(boost::memory_order_relaxed) / 1e6;
+}
+
+uint64_t CCollisionVerifier::Checked(unsigned int worker) const {
+  return workers[worker % VERIFIER_MAX_WORKERS].checked.load(boost::memory_order_relaxed);
+}
+
+uint64_t CCollisionVerifier::Errors(unsigned int worker) const {
+  return workers[worker % VERIFIER_MAX_WORKERS].errors.load(boost::memory_order_relaxed);
+}
+
+void CCollisionVerifier::set_health(unsigned int worker, Health h) {
+  WorkerState& w = workers[worker];
+  Health old = (Health)w.health.exchange(h);
+  if (old == h)
+    return;
+  if (h == QUARANTINED) {
+    w.quarantine_until_us = MonotonicMicros() + (uint64_t)cooldown_secs * 1000000;
+    LogPrintf(LOG_ERROR, "[VERIFY] worker %u returned bad birthdays (%.2f%% of checks), quarantined for %u s",
+	      worker, ErrorRate(worker) * 100, cooldown_secs);
+  } else if (old == QUARANTINED)
+    LogPrintf(LOG_WARN, "[VERIFY] worker %u released from quarantine, throttled until it checks out", worker);
+  else
+    LogPrintf(h == HEALTHY ? LOG_INFO : LOG_WARN, "[VERIFY] worker %u is now %s (error rate %.2f%%)",
+	      worker, health_names[h], ErrorRate(worker) * 100);
+}
+
+void CCollisionVerifier::record(unsigned int worker, bool ok) {
+  WorkerState& w = workers[worker];
+  w.checked.fetch_add(1, boost::memory_order_relaxed);
+  if (!ok)
+    w.errors.fetch_add(1, boost::memory_order_relaxed);
+
+  /* A quarantined worker may still have checks in flight; once its
+   * time is up it starts over on probation with a clean window. */
+  if (w.health.load() == QUARANTINED) {
+    if (MonotonicMicros() < w.quarantine_until_us.load())
+      return;
+    w.window_checked = w.window_errors = 0;
+    w.error_ppm = 0;
+    set_health(worker, THROTTLED);
+  }
+
+  w.window_checked += 1;
+  if (!ok)
+    w.window_errors += 1;
+  if (w.window_checked >= VERIFY_WINDOW) {
+    w.window_checked /= 2;
+    w.window_errors /= 2;
+  }
+  double err = w.window_errors / w.window_checked;
+  w.error_ppm = (uint32_t)(err * 1e6);
+  if (w.window_checked < VERIFY_MIN_CHECKS)
+    return;
+  if (err > max_error)
+    set_health(worker, QUARANTINED);
+  else if (err > max_error / 2)
+    set_health(worker, THROTTLED);
+  else
+    set_health(worker, HEALTHY);
+}
+
+void CCollisionVerifier::thread_main(std::vector<int> cpus) {
+  if (!cpus.empty()) {
+    if (SetThreadAffinity(cpus))
+      LogPrintf(LOG_INFO, "[VERIFY] pinned to CPUs %s", FormatCPUList(cpus).c_str());
+    else
+      LogPrintf(LOG_WARN, "[VERIFY] could not pin to CPUs %s", FormatCPUList(cpus).c_str());
+  }
+  while (true) {
+    Job job;
+    {
+      boost::mutex::scoped_lock lock(mutex);
+      while (!stop && queue.empty())
+	cond.wait(lock);
+      if (stop)
+	break;
+      job = queue.front();
+      queue.pop_front();
+    }
+    bool ok = true;
+    for (int i = 0; i < 2; i++) {
+      uint64_t birthday = ReferenceBirthday(job.midhash, job.nonce[i]);
+      if (birthday != job.birthday) {
+	LogPrintf(LOG_DEBUG, "[VERIFY] worker %u: nonce %u has birthday %llx, engine said %llx",
+		  job.worker, job.nonce[i], (unsigned long long)birthday, (unsigned long long)job.birthday);
+	ok = false;
+      }
+    }
+    record(job.worker, ok);
+  }
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2014 David G. Andersen
+ * This code is licensed under the Apache 2.0 license and may be used or re-used
+ * in accordance with its terms.
+ */
+
+#ifndef VERIFIER_HPP
+#define VERIFIER_HPP
+
+#include <inttypes.h>
+#include <vector>
+#include <deque>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+
+#define VERIFIER_MAX_WORKERS 64
+
+/* Re-derives both birthdays of a sample of engine-reported collisions
+ * on the CPU, on its own thread, and keeps an error rate per worker.
+ * An engine that starts returning wrong birthdays (usually an unstable
+ * overclock) is first throttled, then quarantined for a while.
+ *
+ *   HEALTHY      error rate <= max_error/2
+ *   THROTTLED    above that: the worker idles as long as each round
+ *                takes.  Also the probation state after quarantine.
+ *   QUARANTINED  above max_error: the worker stops for the cooldown
+ *
+ * The rate is judged over a window of recent checks that decays by
+ * half every VERIFY_WINDOW checks, and only once it holds at least
+ * VERIFY_MIN_CHECKS. */
+class CCollisionVerifier {
+public:
+  enum Health { HEALTHY = 0, THROTTLED, QUARANTINED };
+
+  static const unsigned int VERIFY_WINDOW = 200;
+  static const unsigned int VERIFY_MIN_CHECKS = 20;
+  static const size_t QUEUE_MAX = 4096;
+
+  CCollisionVerifier(double rate, double max_error, unsigned int cooldown_secs);
+  ~CCollisionVerifier();
+
+  void Start(const std::vector<int>& cpus);
+  void Stop();
+
+  /* Called by a worker for every collision it finds.  Decides whether
+   * to sample it and queues it; never hashes and never waits. */
+  void Sample(unsigned int worker, const uint8_t midhash[32], uint32_t nonceA, uint32_t nonceB, uint64_t birthday);
+
+  /* Microseconds the worker should idle before its next round, given
+   * how long its last one took. */
+  uint64_t PauseMicros(unsigned int worker, uint64_t last_round_us);
+
+  Health GetHealth(unsigned int worker) const;
+  double ErrorRate(unsigned int worker) const;
+  uint64_t Checked(unsigned int worker) const;
+  uint64_t Errors(unsigned int worker) const;
+  uint64_t Dropped() const { return dropped.load(boost::memory_order_relaxed); }
+
+private:
+  struct Job {
+    unsigned int worker;
+    uint8_t midhash[32];
+    uint32_t nonce[2];
+    uint64_t birthday;
+  };
+
+  struct WorkerState {
+    boost::atomic<uint64_t> checked;
+    boost::atomic<uint64_t> errors;
+    boost::atomic<int> health;
+    boost::atomic<uint64_t> quarantine_until_us;
+    boost::atomic<uint32_t> error_ppm;
+    /* verifier thread only */
+    double window_checked;
+    double window_errors;
+    /* owning worker only */
+    double sample_credit;
+  };
+
+  void thread_main(std::vector<int> cpus);
+  void record(unsigned int worker, bool ok);
+  void set_health(unsigned int worker, Health h);
+
+  double rate;
+  double max_error;
+  unsigned int cooldown_secs;
+
+  WorkerState workers[VERIFIER_MAX_WORKERS];
+  boost::atomic<uint64_t> dropped;
+
+  boost::mutex mutex;
+  boost::condition_variable cond;
+  std::deque<Job> queue;
+  bool stop;
+  boost::thread *thread;
+};
+
+#endif /* VERIFIER_HPP */